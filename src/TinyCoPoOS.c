@@ -1,5 +1,9 @@
 // Created on Sunday, November 17, 2024 https://www.iwriteiam.nl/D2411.html#17
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 // Type following defintions and defines that can be application specific,
 // for example, defined by enumaration types.
 
@@ -13,35 +17,131 @@ typedef uint32_t TimerId;
 typedef uint32_t QueueId;
 #define NR_QUEUES 10
 // Qeuee 0 is reserved for the main queue
+// The other queues use one of the last tasks as sentinel, which can thus
+// not be used for real tasks (tcposc does not give out these ids)
+#define QUEUE_SENTINEL(Q) ((Q) == 0 ? 0 : NR_TASKS - (Q))
+// The task before the sentinels runs the timers, see runTimerTask
+#define TIMER_TASK (NR_TASKS - NR_QUEUES)
 
 typedef uint32_t CriticalSectionId;
 #define NR_CRITICAL_SECTIONS 20
 
+typedef uint32_t TaskGroupId;
+#define NR_TASK_GROUPS 4
+// Group 0 is reserved for tasks without a budget
+// The last NR_TASK_GROUPS queues are reserved for the groups
+#define TASK_GROUP_QUEUE(G) (NR_QUEUES - NR_TASK_GROUPS + (G))
+
+typedef uint32_t CountingSectionId;
+#define NR_COUNTING_SECTIONS 2
+#define MAX_COUNTING_SECTION_COUNT 8
+// The NR_COUNTING_SECTIONS queues before those of the groups are reserved
+// for the counting sections
+#define COUNTING_SECTION_QUEUE(S) (TASK_GROUP_QUEUE(0) - NR_COUNTING_SECTIONS + (S))
+
 typedef uint32_t TimeTick;
-TimeTick timeTick
+TimeTick timeTick;
 #define MAX_TIME_TICK 1000
 #define INCREMENT_TIME_TICK timeTick = 1 + (timeTick % MAX_TIME_TICK); 
 #define TIMER_DONE(X) ((X) == timeTick)
 #define TIMER_ON(T) (1 + (timeTick + (T) - 1) % MAX_TIME_TICK)
+// For a constant T from 1 to MAX_TIME_TICK - 1, as checked by tcposc for
+// time literals like 10ms, a compare replaces the modulo
+#define TIMER_ON_CONST(T) (timeTick + (T) > MAX_TIME_TICK ? timeTick + (T) - MAX_TIME_TICK : timeTick + (T))
 #define TIMER_OFF 0
 
+// The first scratchArenaStatic bytes of the scratch arena are used for the
+// local variables that tcposc places in it. tcposc defines scratchArenaStatic
+// and replaces the references to a placed variable by SCRATCH_VAR or
+// SCRATCH_ARRAY with its offset.
+#define SCRATCH_ARENA_SIZE 64
+#define SCRATCH_VAR(T, O) (*(T*)((uint8_t*)scratchArena + (O)))
+#define SCRATCH_ARRAY(T, N, O) (*(T(*)[N])((uint8_t*)scratchArena + (O)))
+
+// The statistics block for tcpostop is only updated when TCPOS_STATS is
+// defined, see StatsBegin
+#ifdef TCPOS_STATS
+#define STATS(X) X
+void StatsQueueAdd(QueueId queue_id, TaskId task_id);
+void StatsQueuePop(QueueId queue_id, TaskId task_id);
+void StatsSectionHolder(CriticalSectionId critical_section_id, TaskId task_id);
+#else
+#define STATS(X)
+#endif
+
+// The step that is running is only recorded for the sampling profiler,
+// see ProfileTick
+#ifdef TCPOS_PROFILE
+#define PROFILE(X) X
+extern void (* volatile runningStep)();
+#else
+#define PROFILE(X)
+#endif
+
+// With TCPOS_PREINITIALIZED, the scheduler tables are defined with their
+// initial state by the code emitted by 'tcposc --preinit', such that no
+// initialization is needed at boot
+#ifdef TCPOS_PREINITIALIZED
+#define PREINITIALIZED extern
+#else
+#define PREINITIALIZED
+#endif
+
 
 typedef struct
 {
 	void (*function)();
 	TaskId next_task;
+	TaskGroupId group;
+	bool queued; // In one of the queues
 } Task;
 
-Task tasks[NR_TASKS];
+PREINITIALIZED Task tasks[NR_TASKS];
 
 
 typedef struct
 {
-	timeTick time;
+	TimeTick time;
 	TaskId task;
+	TimeTick period; // 0 for a one-shot timer
 } Timer;
 
-Timer timers[NR_TIMERS];
+PREINITIALIZED Timer timers[NR_TIMERS];
+
+// Arms a timer that queues the task at time 'at' and then every period
+// ticks, as used by the TimersInit that tcposc emits for the 'every'
+// statements, which passes TIMER_ON_CONST(period) for 'at'
+void TimerStartPeriodic(TimerId timer_id, TimeTick at, TimeTick period, TaskId task_id)
+{
+	timers[timer_id].task = task_id;
+	timers[timer_id].period = period;
+	timers[timer_id].time = at;
+}
+
+// Adaptive back-off for polls of conditions that have no interrupt,
+// written as 'poll backoff (min..max)' in tcposc. A pass of the poll that
+// finds the condition false calls PollBackoffAgain instead of queueing the
+// step again, which arms the timer of the poll with the current interval.
+// The interval starts at min ticks and is doubled on every pass, up to max
+// ticks, which bounds the extra latency. Leaving the poll calls
+// PollBackoffDone, which resets the interval.
+
+TimeTick pollIntervals[NR_TIMERS];
+
+void PollBackoffAgain(TimerId timer_id, TaskId task_id, TimeTick min, TimeTick max)
+{
+	TimeTick interval = pollIntervals[timer_id] < min ? min : pollIntervals[timer_id];
+	timers[timer_id].task = task_id;
+	timers[timer_id].period = 0;
+	timers[timer_id].time = TIMER_ON(interval);
+	pollIntervals[timer_id] = interval > max / 2 ? max : 2 * interval;
+}
+
+void PollBackoffDone(TimerId timer_id)
+{
+	timers[timer_id].time = TIMER_OFF;
+	pollIntervals[timer_id] = 0;
+}
 
 
 typedef struct
@@ -51,7 +151,7 @@ typedef struct
 } Queue;
 #define MAIN_RUN_QUEUE 0
 
-Queue queues[NR_QUEUES];
+PREINITIALIZED Queue queues[NR_QUEUES];
 
 void QueueInit(QueueId queue_id, TaskId task_id)
 {
@@ -62,9 +162,11 @@ void QueueInit(QueueId queue_id, TaskId task_id)
 
 void QueueAdd(QueueId queue_id, TaskId task_id)
 {
-	tasks[queues[queue_id].last] = task_id;
+	tasks[queues[queue_id].last].next_task = task_id;
 	queues[queue_id].last = task_id;
 	tasks[task_id].next_task = 0; 
+	tasks[task_id].queued = true;
+	STATS(StatsQueueAdd(queue_id, task_id));
 }
 
 bool QueueEmpty(QueueId queue_id)
@@ -74,12 +176,15 @@ bool QueueEmpty(QueueId queue_id)
 
 TaskId QueuePop(QueueId queue_id)
 {
-	TaskId task_id = tasks[queues[queue_id].first].next;
+	TaskId sentinel = queues[queue_id].first;
+	TaskId task_id = tasks[sentinel].next_task;
 	if (task_id != 0)
 	{
-		queues[queue_id].first = tasks[task_id].next_id;
-		if (queues[queue_id].first == 0)
-			queues[queue_id].last = queues[queue_id].first;
+		tasks[sentinel].next_task = tasks[task_id].next_task;
+		if (queues[queue_id].last == task_id)
+			queues[queue_id].last = sentinel;
+		tasks[task_id].queued = false;
+		STATS(StatsQueuePop(queue_id, task_id));
 	}
 	return task_id;
 }
@@ -87,7 +192,7 @@ TaskId QueuePop(QueueId queue_id)
 
 typedef struct
 {
-	Queue queue;
+	QueueId queue;
 	TaskId claimed_by;
 } CriticalSection;
 
@@ -108,6 +213,7 @@ bool CriticalSectionEnter(CriticalSectionId critical_section_id, TaskId task_id)
 		return false;
 	}
 	criticalSections[critical_section_id].claimed_by = task_id;
+	STATS(StatsSectionHolder(critical_section_id, task_id));
 	return true;
 }
 // Caller needs to exit the task when this function returns false
@@ -116,27 +222,1231 @@ void CriticalSectionLeave(CriticalSectionId critical_section_id)
 {
 	TaskId next_task_id = QueuePop(criticalSections[critical_section_id].queue);
 	criticalSections[critical_section_id].claimed_by = next_task_id;
+	STATS(StatsSectionHolder(critical_section_id, next_task_id));
 	if (next_task_id != 0)
-		QueueAdd(MAIN_RUN_QUEUE, nex_task_id);
+		QueueAdd(MAIN_RUN_QUEUE, next_task_id);
+}
+
+// Counting sections for pools of identical resources, like DMA channels,
+// declared with 'resource dma (3);' in tcposc. Up to count tasks can hold
+// one of the resources at the same time. The index of the resource that
+// is acquired is returned, such that 'queue for dma [channel]' knows which
+// one to use. On leaving, the resource is handed to the first waiting
+// task, which finds it assigned to itself when it enters again.
+
+typedef struct
+{
+	uint32_t count;
+	TaskId holders[MAX_COUNTING_SECTION_COUNT];
+} CountingSection;
+
+PREINITIALIZED CountingSection countingSections[NR_COUNTING_SECTIONS];
+
+void CountingSectionInit(CountingSectionId counting_section_id, uint32_t count)
+{
+	QueueInit(COUNTING_SECTION_QUEUE(counting_section_id), QUEUE_SENTINEL(COUNTING_SECTION_QUEUE(counting_section_id)));
+	countingSections[counting_section_id].count = count;
+	for (uint32_t i = 0; i < MAX_COUNTING_SECTION_COUNT; i++)
+		countingSections[counting_section_id].holders[i] = 0;
+}
+
+bool CountingSectionEnter(CountingSectionId counting_section_id, TaskId task_id, uint32_t *index)
+{
+	CountingSection *section = &countingSections[counting_section_id];
+	uint32_t found = section->count;
+	for (uint32_t i = 0; i < section->count; i++)
+		if (section->holders[i] == task_id)
+		{
+			// Handed over by CountingSectionLeave
+			found = i;
+			break;
+		}
+		else if (section->holders[i] == 0 && found == section->count)
+			found = i;
+	if (found == section->count)
+	{
+		QueueAdd(COUNTING_SECTION_QUEUE(counting_section_id), task_id);
+		return false;
+	}
+	section->holders[found] = task_id;
+	if (index != NULL)
+		*index = found;
+	return true;
+}
+// Caller needs to exit the task when this function returns false
+
+void CountingSectionLeave(CountingSectionId counting_section_id, uint32_t index)
+{
+	TaskId next_task_id = QueuePop(COUNTING_SECTION_QUEUE(counting_section_id));
+	countingSections[counting_section_id].holders[index] = next_task_id;
+	if (next_task_id != 0)
+		QueueAdd(MAIN_RUN_QUEUE, next_task_id);
+}
+
+// Scratch arena for data that does not survive the end of a step. It is
+// reset before every dispatch of a step.
+
+extern const uint32_t scratchArenaStatic;
+uint64_t scratchArena[(SCRATCH_ARENA_SIZE + 7) / 8];
+uint32_t scratchArenaTop = 0;
+
+void *ScratchAlloc(uint32_t size)
+{
+	uint32_t top = (scratchArenaTop + 7) & ~7;
+	if (top + size > SCRATCH_ARENA_SIZE)
+		return 0;
+	scratchArenaTop = top + size;
+	return (uint8_t*)scratchArena + top;
+}
+
+// Deferred binary logging. tcposc replaces calls to Log by calls to
+// LogWrite<N> with the id of the format string. Only the id, the time tick
+// and the raw arguments are stored in the ring. The ring is dumped and
+// decoded on the host by tcposlog with the id table written by tcposc.
+
+#define LOG_RING_SIZE 64 // Must be a power of two
+#define LOG_MAX_ARGS 4
+#define LOG_RING_MAGIC 0x474C4354
+#define LOG_ID_WRITING 0xFFFF
+
+typedef struct
+{
+	uint16_t id;
+	uint16_t nr_args;
+	TimeTick time;
+	uint32_t args[LOG_MAX_ARGS];
+} LogEntry;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t size;
+	uint32_t head; // Number of entries written
+	LogEntry entries[LOG_RING_SIZE];
+} LogRing;
+
+LogRing logRing = { LOG_RING_MAGIC, LOG_RING_SIZE, 0 };
+
+void LogWrite(uint16_t id, uint16_t nr_args, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	// The atomic increment reserves the entry, such that ISRs can also log
+	uint32_t head = __atomic_fetch_add(&logRing.head, 1, __ATOMIC_RELAXED);
+	LogEntry *entry = &logRing.entries[head & (LOG_RING_SIZE - 1)];
+	entry->id = LOG_ID_WRITING;
+	entry->nr_args = nr_args;
+	entry->time = timeTick;
+	entry->args[0] = a0;
+	entry->args[1] = a1;
+	entry->args[2] = a2;
+	entry->args[3] = a3;
+	__atomic_store_n(&entry->id, id, __ATOMIC_RELEASE);
+}
+
+#define LogWrite0(I) LogWrite(I, 0, 0, 0, 0, 0)
+#define LogWrite1(I,A) LogWrite(I, 1, (uint32_t)(A), 0, 0, 0)
+#define LogWrite2(I,A,B) LogWrite(I, 2, (uint32_t)(A), (uint32_t)(B), 0, 0)
+#define LogWrite3(I,A,B,C) LogWrite(I, 3, (uint32_t)(A), (uint32_t)(B), (uint32_t)(C), 0)
+#define LogWrite4(I,A,B,C,D) LogWrite(I, 4, (uint32_t)(A), (uint32_t)(B), (uint32_t)(C), (uint32_t)(D))
+
+// The argument of a float conversion (%f, %e, %g) is passed through
+// LogFloatBits by tcposc, because the cast to uint32_t would convert the
+// value. A double argument is stored as a float.
+static inline uint32_t LogFloatBits(float value)
+{
+	union { float value; uint32_t bits; } u;
+	u.value = value;
+	return u.bits;
+}
+
+// CPU reservation for groups of tasks (declared with 'group' in tcposc).
+// Each group has a budget of ticks per period, enforced by a deferrable
+// server: the budget is charged for every tick during which a task of the
+// group is running, and it is restored to the full budget at the start of
+// every period. Tasks of a group with an exhausted budget are held in the
+// queue of the group until the replenishment.
+
+typedef struct
+{
+	TimeTick budget;
+	TimeTick period;
+	TimeTick remaining;
+	TimeTick replenish;
+} TaskGroup;
+
+PREINITIALIZED TaskGroup taskGroups[NR_TASK_GROUPS];
+TaskId runningTask = 0;
+
+void TaskGroupInit(TaskGroupId group_id, TimeTick budget, TimeTick period)
+{
+	QueueInit(TASK_GROUP_QUEUE(group_id), QUEUE_SENTINEL(TASK_GROUP_QUEUE(group_id)));
+	taskGroups[group_id].budget = budget;
+	taskGroups[group_id].period = period;
+	taskGroups[group_id].remaining = budget;
+	taskGroups[group_id].replenish = TIMER_ON(period);
+}
+
+// To be called from the tick interrupt, after INCREMENT_TIME_TICK
+void TaskGroupsChargeTick(void)
+{
+	TaskGroupId group_id = tasks[runningTask].group;
+	if (group_id != 0 && taskGroups[group_id].remaining > 0)
+		taskGroups[group_id].remaining--;
+}
+
+void TaskGroupsReplenish(void)
+{
+	for (TaskGroupId group_id = 1; group_id < NR_TASK_GROUPS; group_id++)
+		if (TIMER_DONE(taskGroups[group_id].replenish))
+		{
+			taskGroups[group_id].remaining = taskGroups[group_id].budget;
+			taskGroups[group_id].replenish = TIMER_ON(taskGroups[group_id].period);
+			TaskId task_id;
+			while ((task_id = QueuePop(TASK_GROUP_QUEUE(group_id))) != 0)
+				QueueAdd(MAIN_RUN_QUEUE, task_id);
+		}
+}
+
+// ISR-safe posting of tasks. An interrupt handler may not touch the
+// queues, so it writes the task in a ring with PostTaskFromIsr. The ring
+// is drained into the main run queue by runMainQueue. A slot is reserved
+// with a compare-and-swap, such that nested interrupts can also post, and
+// it holds 0 until the task has been written. A task that is already in
+// one of the queues, for example waiting for a critical section, is not
+// queued again.
+
+#define POST_RING_SIZE 16 // Must be a power of two
+
+TaskId postRing[POST_RING_SIZE];
+uint32_t postRingHead = 0; // Number of reserved slots
+uint32_t postRingTail = 0; // Number of drained slots
+
+bool PostTaskFromIsr(TaskId task_id)
+{
+	uint32_t head = __atomic_load_n(&postRingHead, __ATOMIC_RELAXED);
+	do
+	{
+		if (head - __atomic_load_n(&postRingTail, __ATOMIC_ACQUIRE) >= POST_RING_SIZE)
+			return false;
+	} while (!__atomic_compare_exchange_n(&postRingHead, &head, head + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_store_n(&postRing[head & (POST_RING_SIZE - 1)], task_id, __ATOMIC_RELEASE);
+	return true;
+}
+// Returns false when the ring is full, in which case the task is lost
+
+void DrainPostRing(void)
+{
+	while (postRingTail != __atomic_load_n(&postRingHead, __ATOMIC_ACQUIRE))
+	{
+		TaskId *slot = &postRing[postRingTail & (POST_RING_SIZE - 1)];
+		TaskId task_id = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		if (task_id == 0)
+			break; // Reserved, but not yet written
+		*slot = 0;
+		__atomic_store_n(&postRingTail, postRingTail + 1, __ATOMIC_RELEASE);
+		if (!tasks[task_id].queued)
+			QueueAdd(MAIN_RUN_QUEUE, task_id);
+	}
+}
+
+// High-resolution one-shot timers, for delays shorter than a tick, like
+// the settle time of a device. tcposc uses HrTimerStart instead of
+// TimerStart for a time literal that is not a whole number of ticks. The
+// timers are kept in a list sorted on expiry time, of which the first is
+// armed in a hardware compare register. The platform provides:
+// - HrNow, returning a free running microsecond counter,
+// - HrArmCompare, arming the compare interrupt at an absolute time,
+// - HrDisarmCompare, disabling the compare interrupt.
+// The compare interrupt calls HrTimerIsr, which posts the task of each
+// expired timer through PostTaskFromIsr. tcposc also replaces TimerDone
+// and TimerReset of such a timer by HrTimerDone and HrTimerCancel.
+
+typedef uint32_t HrTime; // Microseconds, wraps around
+#define HR_BEFORE(A,B) ((int32_t)((A) - (B)) < 0)
+#define HR_NONE NR_TIMERS
+
+HrTime HrNow(void);
+void HrArmCompare(HrTime at);
+void HrDisarmCompare(void);
+
+typedef struct
+{
+	HrTime expires;
+	TaskId task;
+	TimerId next;
+	bool expired;
+} HrTimer;
+
+HrTimer hrTimers[NR_TIMERS];
+TimerId hrFirst = HR_NONE;
+
+// To be called with the compare interrupt disabled, because the list is
+// only changed by the interrupt while it is armed
+void HrTimerUnlink(TimerId timer_id)
+{
+	TimerId *ref = &hrFirst;
+	while (*ref != HR_NONE && *ref != timer_id)
+		ref = &hrTimers[*ref].next;
+	if (*ref == timer_id)
+		*ref = hrTimers[timer_id].next;
+	hrTimers[timer_id].expired = false;
+}
+
+void HrTimerStart(TimerId timer_id, HrTime duration)
+{
+	HrDisarmCompare();
+	HrTimerUnlink(timer_id);
+	hrTimers[timer_id].expires = HrNow() + duration;
+	hrTimers[timer_id].task = runningTask;
+	TimerId *ref = &hrFirst;
+	while (*ref != HR_NONE && !HR_BEFORE(hrTimers[timer_id].expires, hrTimers[*ref].expires))
+		ref = &hrTimers[*ref].next;
+	hrTimers[timer_id].next = *ref;
+	*ref = timer_id;
+	HrArmCompare(hrTimers[hrFirst].expires);
+}
+
+void HrTimerIsr(void)
+{
+	while (hrFirst != HR_NONE && !HR_BEFORE(HrNow(), hrTimers[hrFirst].expires))
+	{
+		TimerId timer_id = hrFirst;
+		hrFirst = hrTimers[timer_id].next;
+		hrTimers[timer_id].expired = true;
+		PostTaskFromIsr(hrTimers[timer_id].task);
+	}
+	if (hrFirst != HR_NONE)
+		HrArmCompare(hrTimers[hrFirst].expires);
+	else
+		HrDisarmCompare();
+}
+
+bool HrTimerDone(TimerId timer_id)
+{
+	return __atomic_load_n(&hrTimers[timer_id].expired, __ATOMIC_ACQUIRE);
+}
+
+void HrTimerCancel(TimerId timer_id)
+{
+	HrDisarmCompare();
+	HrTimerUnlink(timer_id);
+	if (hrFirst != HR_NONE)
+		HrArmCompare(hrTimers[hrFirst].expires);
+}
+
+#ifdef TCPOS_HOST
+// Host implementation of the compare register with a timerfd, which is
+// waited on by a thread that plays the role of the compare interrupt.
+// HrDisarmCompare blocks this 'interrupt' with a mutex, which is
+// released by HrArmCompare.
+
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+int hrTimerFd = -1;
+pthread_t hrIrqThread;
+pthread_mutex_t hrIrqMutex = PTHREAD_MUTEX_INITIALIZER;
+bool hrIrqDisabled = false;
+
+HrTime HrNow(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (HrTime)(now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+}
+
+void HrArmCompare(HrTime at)
+{
+	int32_t delta = (int32_t)(at - HrNow());
+	struct itimerspec spec = { { 0, 0 }, { 0, 1 } }; // Already expired
+	if (delta > 0)
+	{
+		spec.it_value.tv_sec = delta / 1000000;
+		spec.it_value.tv_nsec = (delta % 1000000) * 1000;
+	}
+	timerfd_settime(hrTimerFd, 0, &spec, NULL);
+	if (hrIrqDisabled)
+	{
+		hrIrqDisabled = false;
+		pthread_mutex_unlock(&hrIrqMutex);
+	}
+}
+
+void HrDisarmCompare(void)
+{
+	struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+	timerfd_settime(hrTimerFd, 0, &spec, NULL);
+	if (!hrIrqDisabled && !pthread_equal(pthread_self(), hrIrqThread))
+	{
+		pthread_mutex_lock(&hrIrqMutex);
+		hrIrqDisabled = true;
+	}
+}
+
+void *HrIrqThread(void *data)
+{
+	for (;;)
+	{
+		uint64_t expirations;
+		if (read(hrTimerFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+			continue;
+		pthread_mutex_lock(&hrIrqMutex);
+		HrTimerIsr();
+		pthread_mutex_unlock(&hrIrqMutex);
+	}
+	return NULL;
+}
+
+void HrHostInit(void)
+{
+	hrTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+	pthread_create(&hrIrqThread, NULL, HrIrqThread, NULL);
+}
+#endif
+
+// Statistics block for live monitoring with tcpostop. The block has a
+// fixed layout with a version, such that the viewer does not depend on
+// the configuration of the application. It holds the state of each task,
+// the depth of each queue, the number of armed timers, the holders of the
+// critical sections and the maximum latency from queueing to dispatch in
+// the current and in the previous window of STATS_WINDOW_TICKS ticks.
+// There is one writer, the main loop, and the block is read while it is
+// updated, either through shared memory (TCPOS_HOST) or with a debugger.
+// The sequence number is odd during an update, and a reader retries when
+// it was odd or has changed while reading (a seqlock).
+
+#define STATS_MAGIC 0x54534354
+#define STATS_VERSION 1
+#define STATS_MAX_TASKS 128
+#define STATS_MAX_QUEUES 16
+#define STATS_MAX_SECTIONS 32
+#define STATS_WINDOW_TICKS 1000
+#define STATS_SHM_NAME "/tcpos-stats"
+
+#define STATS_IDLE 0
+#define STATS_QUEUED 1 // In the main run queue
+#define STATS_WAITING 2 // In another queue
+#define STATS_RUNNING 3
+
+typedef struct
+{
+	uint8_t state;
+	uint8_t group;
+	uint16_t reserved;
+	uint32_t runs;
+	HrTime max_latency; // Current window
+	HrTime prev_max_latency; // Previous window
+} TaskStats;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence;
+	TimeTick time;
+	uint32_t nr_tasks;
+	uint32_t nr_queues;
+	uint32_t nr_sections;
+	uint32_t armed_timers;
+	TaskStats tasks[STATS_MAX_TASKS];
+	uint32_t queue_depths[STATS_MAX_QUEUES];
+	uint32_t section_holders[STATS_MAX_SECTIONS];
+} Stats;
+
+#ifdef TCPOS_STATS
+
+_Static_assert(NR_TASKS <= STATS_MAX_TASKS && NR_QUEUES <= STATS_MAX_QUEUES && NR_CRITICAL_SECTIONS <= STATS_MAX_SECTIONS, "Too large for the statistics block");
+
+Stats statsBlock = { STATS_MAGIC, STATS_VERSION, 0, 0, NR_TASKS, NR_QUEUES, NR_CRITICAL_SECTIONS };
+Stats *stats = &statsBlock;
+HrTime statsQueuedAt[NR_TASKS];
+uint32_t statsWindowTicks = 0;
+
+void StatsBegin(void)
+{
+	__atomic_store_n(&stats->sequence, stats->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void StatsEnd(void)
+{
+	__atomic_store_n(&stats->sequence, stats->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void StatsQueueAdd(QueueId queue_id, TaskId task_id)
+{
+	StatsBegin();
+	stats->queue_depths[queue_id]++;
+	if (queue_id == MAIN_RUN_QUEUE)
+	{
+		stats->tasks[task_id].state = STATS_QUEUED;
+		statsQueuedAt[task_id] = HrNow();
+	}
+	else
+		stats->tasks[task_id].state = STATS_WAITING;
+	StatsEnd();
+}
+
+void StatsQueuePop(QueueId queue_id, TaskId task_id)
+{
+	StatsBegin();
+	stats->queue_depths[queue_id]--;
+	stats->tasks[task_id].state = STATS_IDLE;
+	StatsEnd();
+}
+
+void StatsSectionHolder(CriticalSectionId critical_section_id, TaskId task_id)
+{
+	StatsBegin();
+	stats->section_holders[critical_section_id] = task_id;
+	StatsEnd();
+}
+
+void StatsRunStart(TaskId task_id)
+{
+	HrTime latency = HrNow() - statsQueuedAt[task_id];
+	StatsBegin();
+	TaskStats *task_stats = &stats->tasks[task_id];
+	task_stats->state = STATS_RUNNING;
+	task_stats->group = tasks[task_id].group;
+	task_stats->runs++;
+	if (latency > task_stats->max_latency)
+		task_stats->max_latency = latency;
+	StatsEnd();
+}
+
+void StatsRunEnd(TaskId task_id)
+{
+	StatsBegin();
+	if (stats->tasks[task_id].state == STATS_RUNNING)
+		stats->tasks[task_id].state = STATS_IDLE;
+	StatsEnd();
+}
+
+// Called by the timer task, every tick
+void StatsTick(void)
+{
+	uint32_t armed_timers = 0;
+	for (int i = 0; i < NR_TIMERS; i++)
+		if (timers[i].time != TIMER_OFF)
+			armed_timers++;
+	bool new_window = ++statsWindowTicks == STATS_WINDOW_TICKS;
+	StatsBegin();
+	stats->time = timeTick;
+	stats->armed_timers = armed_timers;
+	if (new_window)
+		for (int i = 0; i < NR_TASKS; i++)
+		{
+			stats->tasks[i].prev_max_latency = stats->tasks[i].max_latency;
+			stats->tasks[i].max_latency = 0;
+		}
+	StatsEnd();
+	if (new_window)
+		statsWindowTicks = 0;
+}
+
+#ifdef TCPOS_HOST
+// On the host, the block is moved to /dev/shm/tcpos-stats, where it is
+// read by tcpostop. To be called before the first task is queued.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+void StatsHostInit(void)
+{
+	int fd = shm_open(STATS_SHM_NAME, O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+		return;
+	void *block = ftruncate(fd, sizeof(Stats)) == 0
+		? mmap(NULL, sizeof(Stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+		: MAP_FAILED;
+	close(fd);
+	if (block == MAP_FAILED)
+		return;
+	*(Stats*)block = statsBlock;
+	stats = (Stats*)block;
+}
+#endif
+#endif
+
+// Sampling profiler, for parts without a cycle counter. ProfileTick is to
+// be called from the tick interrupt and counts how often each step
+// function of each task (or the idle loop, with task 0) is found running.
+// The platform may also pass the interrupted PC, as taken from the
+// exception frame, or 0. The counts are kept in a hash table on the key
+// (task, step, pc), such that no memory is allocated. When the table is
+// full, the sample is counted as lost. The profile is dumped and turned
+// into a CPU percentage per step, or into folded stacks, by tcposprof with
+// the symbol table of the application. Addresses are stored in 32 bits.
+
+#define PROFILE_SIZE 64 // Must be a power of two
+#define PROFILE_MAGIC 0x46525054
+
+typedef struct
+{
+	uint32_t task;
+	uint32_t step; // Address of the step function
+	uint32_t pc;
+	uint32_t count;
+} ProfileEntry;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t size;
+	uint32_t samples;
+	uint32_t lost;
+	ProfileEntry entries[PROFILE_SIZE];
+} Profile;
+
+#ifdef TCPOS_PROFILE
+
+Profile profile = { PROFILE_MAGIC, PROFILE_SIZE, 0, 0 };
+void (* volatile runningStep)() = 0;
+
+void ProfileTick(uint32_t pc)
+{
+	TaskId task_id = runningTask;
+	uint32_t step = task_id != 0 ? (uint32_t)(uintptr_t)runningStep : 0;
+	profile.samples++;
+	uint32_t i = (task_id * 31 + (step >> 2) + (pc >> 1)) & (PROFILE_SIZE - 1);
+	for (uint32_t probes = 0; probes < PROFILE_SIZE; probes++, i = (i + 1) & (PROFILE_SIZE - 1))
+	{
+		ProfileEntry *entry = &profile.entries[i];
+		if (entry->count == 0)
+		{
+			entry->task = task_id;
+			entry->step = step;
+			entry->pc = pc;
+		}
+		else if (entry->task != task_id || entry->step != step || entry->pc != pc)
+			continue;
+		entry->count++;
+		return;
+	}
+	profile.lost++;
+}
+
+#endif
+
+// Event groups. A group holds a mask of event bits, which are set and
+// cleared by tasks, or set by ISRs with EventGroupSetFromIsr. A task waits
+// for any or all bits of a mask with 'wait any (group, mask);' or
+// 'wait all (group, mask);', which tcposc compiles into a step split: the
+// step ends with a call of EventGroupWait and the next step is run when
+// the mask is satisfied. A waiting task is removed from the list of
+// waiters before it is posted, such that it is woken exactly once. Bits
+// set by an ISR are handled by runMainQueue.
+
+typedef uint32_t EventGroupId;
+#define NR_EVENT_GROUPS 8 // At most 32
+typedef uint32_t EventMask;
+
+typedef struct
+{
+	EventMask bits;
+	TaskId first_waiter;
+} EventGroup;
+
+EventGroup eventGroups[NR_EVENT_GROUPS];
+uint32_t eventGroupsSetFromIsr = 0; // A bit for each group
+
+typedef struct
+{
+	EventMask mask;
+	bool all;
+	TaskId next;
+} EventWaiter;
+
+EventWaiter eventWaiters[NR_TASKS];
+
+#define EVENT_MASK_SATISFIED(B,W) ((W).all ? ((B) & (W).mask) == (W).mask : ((B) & (W).mask) != 0)
+
+void EventGroupWake(EventGroupId group_id)
+{
+	EventMask bits = __atomic_load_n(&eventGroups[group_id].bits, __ATOMIC_ACQUIRE);
+	TaskId *ref = &eventGroups[group_id].first_waiter;
+	while (*ref != 0)
+	{
+		TaskId task_id = *ref;
+		if (EVENT_MASK_SATISFIED(bits, eventWaiters[task_id]))
+		{
+			*ref = eventWaiters[task_id].next;
+			QueueAdd(MAIN_RUN_QUEUE, task_id);
+		}
+		else
+			ref = &eventWaiters[task_id].next;
+	}
+}
+
+void EventGroupSet(EventGroupId group_id, EventMask bits)
+{
+	__atomic_fetch_or(&eventGroups[group_id].bits, bits, __ATOMIC_RELEASE);
+	EventGroupWake(group_id);
+}
+
+void EventGroupSetFromIsr(EventGroupId group_id, EventMask bits)
+{
+	__atomic_fetch_or(&eventGroups[group_id].bits, bits, __ATOMIC_RELEASE);
+	__atomic_fetch_or(&eventGroupsSetFromIsr, (uint32_t)1 << group_id, __ATOMIC_RELEASE);
+}
+
+void EventGroupClear(EventGroupId group_id, EventMask bits)
+{
+	__atomic_fetch_and(&eventGroups[group_id].bits, ~bits, __ATOMIC_RELEASE);
+}
+
+void EventGroupWait(EventGroupId group_id, EventMask mask, bool all, TaskId task_id, void (*next_step)())
+{
+	tasks[task_id].function = next_step;
+	eventWaiters[task_id].mask = mask;
+	eventWaiters[task_id].all = all;
+	if (EVENT_MASK_SATISFIED(__atomic_load_n(&eventGroups[group_id].bits, __ATOMIC_ACQUIRE), eventWaiters[task_id]))
+	{
+		QueueAdd(MAIN_RUN_QUEUE, task_id);
+		return;
+	}
+	eventWaiters[task_id].next = eventGroups[group_id].first_waiter;
+	eventGroups[group_id].first_waiter = task_id;
+}
+
+void EventGroupsWakeSetFromIsr(void)
+{
+	uint32_t groups = __atomic_exchange_n(&eventGroupsSetFromIsr, 0, __ATOMIC_ACQUIRE);
+	for (EventGroupId group_id = 0; groups != 0; group_id++, groups >>= 1)
+		if (groups & 1)
+			EventGroupWake(group_id);
+}
+
+// Topics for one-to-many data flow, declared with 'topic' in tcposc,
+// which also emits the pools and the lists of subscribers. A publisher
+// gets a free slot of the pool with TopicAcquire, writes the sample in
+// it and calls TopicPublish, which gives every subscriber a reference to
+// the slot, without copying the sample. A subscriber gets the sample with
+// TopicReceive and releases it with TopicDone (or with the next
+// TopicReceive). When a subscriber has not received the previous sample
+// yet, it is replaced by the new one. A subscriber is only queued by
+// TopicPublish when it is waiting on the topic: at the start, and after a
+// TopicReceive that found no sample, after which it should end its step.
+// A slot returns to the pool when the last reference is released. Topics
+// are used from tasks only.
+
+typedef uint32_t TopicId;
+#define NR_TOPICS 4
+#define MAX_TOPIC_SLOTS 17 // 2 * MAX_TOPIC_SUBSCRIBERS + 1
+#define MAX_TOPIC_SUBSCRIBERS 8
+#define TOPIC_NO_SLOT 0xFF
+
+typedef struct
+{
+	uint8_t *pool;
+	uint32_t slot_size;
+	uint32_t nr_slots;
+	uint8_t refs[MAX_TOPIC_SLOTS];
+	const TaskId *subscribers;
+	uint32_t nr_subscribers;
+	uint8_t pending[MAX_TOPIC_SUBSCRIBERS];
+	uint8_t current[MAX_TOPIC_SUBSCRIBERS];
+	bool waiting[MAX_TOPIC_SUBSCRIBERS];
+} Topic;
+
+Topic topics[NR_TOPICS];
+
+void TopicInit(TopicId topic_id, void *pool, uint32_t slot_size, uint32_t nr_slots, const TaskId *subscribers, uint32_t nr_subscribers)
+{
+	Topic *topic = &topics[topic_id];
+	topic->pool = (uint8_t*)pool;
+	topic->slot_size = slot_size;
+	topic->nr_slots = nr_slots;
+	for (uint32_t i = 0; i < nr_slots; i++)
+		topic->refs[i] = 0;
+	topic->subscribers = subscribers;
+	topic->nr_subscribers = nr_subscribers;
+	for (uint32_t i = 0; i < nr_subscribers; i++)
+	{
+		topic->pending[i] = topic->current[i] = TOPIC_NO_SLOT;
+		topic->waiting[i] = true;
+	}
+}
+
+void TopicUnref(Topic *topic, uint8_t *ref_slot)
+{
+	if (*ref_slot != TOPIC_NO_SLOT)
+		topic->refs[*ref_slot]--;
+	*ref_slot = TOPIC_NO_SLOT;
+}
+
+void *TopicAcquire(TopicId topic_id)
+{
+	Topic *topic = &topics[topic_id];
+	for (uint32_t slot = 0; slot < topic->nr_slots; slot++)
+		if (topic->refs[slot] == 0)
+		{
+			topic->refs[slot] = 1; // Reference of the publisher
+			return topic->pool + slot * topic->slot_size;
+		}
+	return 0; // Cannot happen with the pool size calculated by tcposc
+}
+
+void TopicPublish(TopicId topic_id, void *sample)
+{
+	Topic *topic = &topics[topic_id];
+	uint8_t slot = ((uint8_t*)sample - topic->pool) / topic->slot_size;
+	for (uint32_t i = 0; i < topic->nr_subscribers; i++)
+	{
+		TopicUnref(topic, &topic->pending[i]);
+		if (topic->waiting[i])
+		{
+			topic->waiting[i] = false;
+			QueueAdd(MAIN_RUN_QUEUE, topic->subscribers[i]);
+		}
+		topic->refs[slot]++;
+		topic->pending[i] = slot;
+	}
+	TopicUnref(topic, &slot);
+}
+
+uint32_t TopicSubscriber(Topic *topic, TaskId task_id)
+{
+	uint32_t i = 0;
+	while (i < topic->nr_subscribers && topic->subscribers[i] != task_id)
+		i++;
+	return i;
+}
+
+const void *TopicReceive(TopicId topic_id, TaskId task_id)
+{
+	Topic *topic = &topics[topic_id];
+	uint32_t i = TopicSubscriber(topic, task_id);
+	if (i == topic->nr_subscribers)
+		return 0;
+	TopicUnref(topic, &topic->current[i]);
+	topic->current[i] = topic->pending[i];
+	topic->pending[i] = TOPIC_NO_SLOT;
+	if (topic->current[i] == TOPIC_NO_SLOT)
+	{
+		topic->waiting[i] = true;
+		return 0;
+	}
+	return topic->pool + topic->current[i] * topic->slot_size;
+}
+
+void TopicDone(TopicId topic_id, TaskId task_id)
+{
+	Topic *topic = &topics[topic_id];
+	uint32_t i = TopicSubscriber(topic, task_id);
+	if (i < topic->nr_subscribers)
+		TopicUnref(topic, &topic->current[i]);
+}
+
+// Retention of the scheduler state across deep sleep, for parts of which
+// only a small retention RAM is kept powered. SchedulerCheckpoint compacts
+// the live state into an image of records of bytes: the step at which each
+// task continues, the tasks in each queue (in order), the armed timers with
+// the ticks that remain, the holders of the critical and counting sections
+// and the budgets of the groups. When there is a gap in time between the
+// checkpoint and the restore, the remaining ticks are counted from the time
+// tick of the restore. SchedulerRestore rebuilds all tables from the image
+// and returns false when there is no valid image, as after a cold boot, in
+// which case the application has to initialize the tables itself. The
+// image is consumed by the restore. The platform may place retentionImage
+// in the retention RAM by defining RETENTION_SECTION.
+
+#define RETENTION_SIZE 256
+#define RETENTION_MAGIC 0x4E544552
+
+#ifndef RETENTION_SECTION
+#define RETENTION_SECTION
+#endif
+
+#define RETENTION_TASK 1
+#define RETENTION_QUEUE 2
+#define RETENTION_TIMER 3
+#define RETENTION_SECTION_HOLDER 4
+#define RETENTION_COUNTING 5
+#define RETENTION_GROUP 6
+
+_Static_assert(NR_TASKS <= 256 && NR_QUEUES <= 256 && NR_TIMERS <= 256 && MAX_TIME_TICK <= 0x10000, "Too large for the retention image");
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t checksum;
+	uint32_t size; // Number of bytes used in data
+	uint8_t data[RETENTION_SIZE];
+} RetentionImage;
+
+RETENTION_SECTION RetentionImage retentionImage;
+
+typedef struct
+{
+	uint8_t *data;
+	uint32_t pos;
+	bool full;
+} RetentionWriter;
+
+void RetentionPut(RetentionWriter *writer, const void *value, uint32_t size)
+{
+	if (writer->pos + size > RETENTION_SIZE)
+	{
+		writer->full = true;
+		return;
+	}
+	for (uint32_t i = 0; i < size; i++)
+		writer->data[writer->pos++] = ((const uint8_t*)value)[i];
+}
+
+void RetentionPut8(RetentionWriter *writer, uint32_t value)
+{
+	uint8_t byte = value;
+	RetentionPut(writer, &byte, 1);
+}
+
+void RetentionPut16(RetentionWriter *writer, uint32_t value)
+{
+	RetentionPut8(writer, value & 0xFF);
+	RetentionPut8(writer, value >> 8);
+}
+
+uint32_t RetentionGet16(const uint8_t *data)
+{
+	return data[0] | (data[1] << 8);
+}
+
+// Number of ticks until the time of a timer, from 1 to MAX_TIME_TICK
+TimeTick RetentionRemaining(TimeTick time)
+{
+	return (time + MAX_TIME_TICK - timeTick - 1) % MAX_TIME_TICK + 1;
+}
+
+uint32_t RetentionChecksum(const RetentionImage *image)
+{
+	uint32_t hash = 2166136261u;
+	for (uint32_t i = 0; i < image->size; i++)
+		hash = (hash ^ image->data[i]) * 16777619u;
+	return hash ^ image->size;
+}
+
+bool SchedulerCheckpoint(RetentionImage *image)
+{
+	RetentionWriter writer = { image->data, 0, false };
+	for (TaskId task_id = 1; task_id < NR_TASKS; task_id++)
+		if (tasks[task_id].function != 0 || tasks[task_id].group != 0)
+		{
+			RetentionPut8(&writer, RETENTION_TASK);
+			RetentionPut8(&writer, task_id);
+			RetentionPut8(&writer, tasks[task_id].group);
+			RetentionPut(&writer, &tasks[task_id].function, sizeof(tasks[task_id].function));
+		}
+	for (QueueId queue_id = 0; queue_id < NR_QUEUES; queue_id++)
+	{
+		uint32_t nr_tasks = 0;
+		for (TaskId task_id = tasks[queues[queue_id].first].next_task; task_id != 0; task_id = tasks[task_id].next_task)
+			nr_tasks++;
+		if (nr_tasks == 0)
+			continue;
+		RetentionPut8(&writer, RETENTION_QUEUE);
+		RetentionPut8(&writer, queue_id);
+		RetentionPut8(&writer, nr_tasks);
+		for (TaskId task_id = tasks[queues[queue_id].first].next_task; task_id != 0; task_id = tasks[task_id].next_task)
+			RetentionPut8(&writer, task_id);
+	}
+	for (TimerId timer_id = 0; timer_id < NR_TIMERS; timer_id++)
+		if (timers[timer_id].time != TIMER_OFF)
+		{
+			RetentionPut8(&writer, RETENTION_TIMER);
+			RetentionPut8(&writer, timer_id);
+			RetentionPut8(&writer, timers[timer_id].task);
+			RetentionPut16(&writer, RetentionRemaining(timers[timer_id].time));
+			RetentionPut16(&writer, timers[timer_id].period);
+		}
+	for (CriticalSectionId critical_section_id = 0; critical_section_id < NR_CRITICAL_SECTIONS; critical_section_id++)
+		if (criticalSections[critical_section_id].queue != 0)
+		{
+			RetentionPut8(&writer, RETENTION_SECTION_HOLDER);
+			RetentionPut8(&writer, critical_section_id);
+			RetentionPut8(&writer, criticalSections[critical_section_id].queue);
+			RetentionPut8(&writer, criticalSections[critical_section_id].claimed_by);
+		}
+	for (CountingSectionId counting_section_id = 0; counting_section_id < NR_COUNTING_SECTIONS; counting_section_id++)
+	{
+		CountingSection *section = &countingSections[counting_section_id];
+		RetentionPut8(&writer, RETENTION_COUNTING);
+		RetentionPut8(&writer, counting_section_id);
+		RetentionPut8(&writer, section->count);
+		for (uint32_t i = 0; i < section->count; i++)
+			RetentionPut8(&writer, section->holders[i]);
+	}
+	for (TaskGroupId group_id = 1; group_id < NR_TASK_GROUPS; group_id++)
+		if (taskGroups[group_id].period != 0)
+		{
+			RetentionPut8(&writer, RETENTION_GROUP);
+			RetentionPut8(&writer, group_id);
+			RetentionPut16(&writer, taskGroups[group_id].budget);
+			RetentionPut16(&writer, taskGroups[group_id].period);
+			RetentionPut16(&writer, taskGroups[group_id].remaining);
+			RetentionPut16(&writer, RetentionRemaining(taskGroups[group_id].replenish));
+		}
+	image->size = writer.pos;
+	image->checksum = RetentionChecksum(image);
+	image->magic = writer.full ? 0 : RETENTION_MAGIC;
+	return !writer.full;
+}
+// Returns false when the state does not fit in the image
+
+bool SchedulerRestore(RetentionImage *image)
+{
+	if (image->magic != RETENTION_MAGIC || image->size > RETENTION_SIZE || image->checksum != RetentionChecksum(image))
+		return false;
+	image->magic = 0;
+
+	for (TaskId task_id = 0; task_id < NR_TASKS; task_id++)
+	{
+		tasks[task_id].function = 0;
+		tasks[task_id].group = 0;
+		tasks[task_id].queued = false;
+	}
+	for (QueueId queue_id = 0; queue_id < NR_QUEUES; queue_id++)
+		QueueInit(queue_id, QUEUE_SENTINEL(queue_id));
+	for (TimerId timer_id = 0; timer_id < NR_TIMERS; timer_id++)
+		timers[timer_id].time = TIMER_OFF;
+	for (CriticalSectionId critical_section_id = 0; critical_section_id < NR_CRITICAL_SECTIONS; critical_section_id++)
+		CriticalSectionInit(critical_section_id, 0);
+	for (TaskGroupId group_id = 0; group_id < NR_TASK_GROUPS; group_id++)
+		taskGroups[group_id].period = 0;
+
+	const uint8_t *data = image->data;
+	const uint8_t *end = data + image->size;
+	while (data < end)
+		switch (*data++)
+		{
+			case RETENTION_TASK:
+				tasks[data[0]].group = data[1];
+				for (uint32_t i = 0; i < sizeof(tasks[0].function); i++)
+					((uint8_t*)&tasks[data[0]].function)[i] = data[2 + i];
+				data += 2 + sizeof(tasks[0].function);
+				break;
+			case RETENTION_QUEUE:
+				for (uint32_t i = 0; i < data[1]; i++)
+					QueueAdd(data[0], data[2 + i]);
+				data += 2 + data[1];
+				break;
+			case RETENTION_TIMER:
+				timers[data[0]].task = data[1];
+				timers[data[0]].time = TIMER_ON(RetentionGet16(data + 2));
+				timers[data[0]].period = RetentionGet16(data + 4);
+				data += 6;
+				break;
+			case RETENTION_SECTION_HOLDER:
+				CriticalSectionInit(data[0], data[1]);
+				criticalSections[data[0]].claimed_by = data[2];
+				data += 3;
+				break;
+			case RETENTION_COUNTING:
+				// Not with CountingSectionInit, which would clear the
+				// restored queue of the waiting tasks
+				countingSections[data[0]].count = data[1];
+				for (uint32_t i = 0; i < MAX_COUNTING_SECTION_COUNT; i++)
+					countingSections[data[0]].holders[i] = i < data[1] ? data[2 + i] : 0;
+				data += 2 + data[1];
+				break;
+			case RETENTION_GROUP:
+				taskGroups[data[0]].budget = RetentionGet16(data + 1);
+				taskGroups[data[0]].period = RetentionGet16(data + 3);
+				taskGroups[data[0]].remaining = RetentionGet16(data + 5);
+				taskGroups[data[0]].replenish = TIMER_ON(RetentionGet16(data + 7));
+				data += 9;
+				break;
+			default:
+				return false;
+		}
+	return true;
+}
+
+#ifdef TCPOS_HOST
+// Test of a checkpoint and a restore, with the tables cleared in between
+// as by a power down, and a different time tick after the wake up. It is
+// run by tcpostest.
+
+#include <stdio.h>
+#include <string.h>
+
+void RetentionTestStep(void) {}
+
+bool RetentionTest(void)
+{
+	for (QueueId queue_id = 0; queue_id < NR_QUEUES; queue_id++)
+		QueueInit(queue_id, QUEUE_SENTINEL(queue_id));
+	CriticalSectionInit(1, 2);
+	CountingSectionInit(0, 2);
+	timeTick = 990;
+	tasks[11].function = RetentionTestStep;
+	tasks[12].group = 1;
+	taskGroups[1].budget = 3;
+	taskGroups[1].period = 20;
+	taskGroups[1].remaining = 1;
+	taskGroups[1].replenish = TIMER_ON(15);
+	QueueAdd(MAIN_RUN_QUEUE, 11);
+	QueueAdd(MAIN_RUN_QUEUE, 13);
+	CriticalSectionEnter(1, 14);
+	CriticalSectionEnter(1, 15);
+	countingSections[0].holders[1] = 16;
+	CountingSectionEnter(0, 18, NULL);
+	CountingSectionEnter(0, 19, NULL); // Waits for a resource
+	TimerStartPeriodic(3, TIMER_ON(50), 50, 17);
+
+	if (!SchedulerCheckpoint(&retentionImage))
+	{
+		printf("ERROR: checkpoint does not fit in %d bytes\n", RETENTION_SIZE);
+		return false;
+	}
+	uint32_t size = retentionImage.size;
+
+	memset(tasks, 0, sizeof(tasks));
+	memset(queues, 0, sizeof(queues));
+	memset(timers, 0, sizeof(timers));
+	memset(criticalSections, 0, sizeof(criticalSections));
+	memset(countingSections, 0, sizeof(countingSections));
+	memset(taskGroups, 0, sizeof(taskGroups));
+	timeTick = 7;
+
+	if (!SchedulerRestore(&retentionImage))
+		printf("ERROR: restore failed\n");
+	else if (   tasks[11].function != RetentionTestStep || tasks[12].group != 1
+			 || QueuePop(MAIN_RUN_QUEUE) != 11 || QueuePop(MAIN_RUN_QUEUE) != 13 || QueuePop(MAIN_RUN_QUEUE) != 0
+			 || criticalSections[1].claimed_by != 14 || QueuePop(2) != 15
+			 || countingSections[0].count != 2 || countingSections[0].holders[0] != 18 || countingSections[0].holders[1] != 16
+			 || QueuePop(COUNTING_SECTION_QUEUE(0)) != 19 || QueuePop(COUNTING_SECTION_QUEUE(0)) != 0
+			 || timers[3].task != 17 || timers[3].period != 50 || timers[3].time != 7 + 50
+			 || taskGroups[1].remaining != 1 || taskGroups[1].replenish != 7 + 15)
+		printf("ERROR: restored state differs\n");
+	else if (SchedulerRestore(&retentionImage))
+		printf("ERROR: image restored twice\n");
+	else
+	{
+		printf("OK: checkpoint of %u bytes restored\n", size);
+		return true;
+	}
+	return false;
+}
+
+// Test that a task that is posted by an interrupt, like the expiry of a
+// high-resolution timer, while it waits for a critical section, is not
+// queued twice.
+
+bool PostTest(void)
+{
+	for (QueueId queue_id = 0; queue_id < NR_QUEUES; queue_id++)
+		QueueInit(queue_id, QUEUE_SENTINEL(queue_id));
+	CriticalSectionInit(1, 2);
+	CriticalSectionEnter(1, 14);
+	CriticalSectionEnter(1, 15);
+	PostTaskFromIsr(15);
+	PostTaskFromIsr(16);
+	DrainPostRing();
+	CriticalSectionLeave(1);
+	if (   QueuePop(MAIN_RUN_QUEUE) != 16 || QueuePop(MAIN_RUN_QUEUE) != 15 || QueuePop(MAIN_RUN_QUEUE) != 0
+		|| QueuePop(2) != 0)
+	{
+		printf("ERROR: posted task queued twice\n");
+		return false;
+	}
+	printf("OK: posted task queued once\n");
+	return true;
+}
+
+// Test the scratch variables as tcposc emits them for initialized locals,
+// like 'uint8_t x = 0x12; uint8_t y = 0x34; long n = 7;', which are
+// assigned in the step and read back through the same offsets.
+
+bool ScratchTest(void)
+{
+	scratchArenaTop = scratchArenaStatic;
+	SCRATCH_VAR(uint8_t, 0) = 0x12;
+	SCRATCH_VAR(uint8_t, 1) = 0x34;
+	SCRATCH_VAR(long, 4) = 7;
+	uint8_t *buffer = (uint8_t*)ScratchAlloc(4);
+	for (int i = 0; i < 4; i++)
+		buffer[i] = 0xFF;
+	uint16_t temp = (SCRATCH_VAR(uint8_t, 0) << 8) | SCRATCH_VAR(uint8_t, 1);
+	if (temp != 0x1234 || SCRATCH_VAR(long, 4) != 7 || scratchArenaStatic < 4 + sizeof(long))
+	{
+		printf("ERROR: scratch variables overwritten\n");
+		return false;
+	}
+	printf("OK: scratch variables round-trip\n");
+	return true;
+}
+
+// Test that a periodic timer does not queue its task again, while the task
+// still waits for a critical section.
+
+void runTimerTask(void);
+
+bool PeriodicTest(void)
+{
+	for (QueueId queue_id = 0; queue_id < NR_QUEUES; queue_id++)
+		QueueInit(queue_id, QUEUE_SENTINEL(queue_id));
+	for (int i = 0; i < NR_TIMERS; i++)
+		timers[i].time = TIMER_OFF;
+	CriticalSectionInit(1, 2);
+	CriticalSectionEnter(1, 14);
+	CriticalSectionEnter(1, 15);
+	TimerStartPeriodic(0, timeTick, 1, 15);
+	runTimerTask();
+	CriticalSectionLeave(1);
+	if (   QueuePop(MAIN_RUN_QUEUE) != TIMER_TASK || QueuePop(MAIN_RUN_QUEUE) != 15 || QueuePop(MAIN_RUN_QUEUE) != 0
+		|| QueuePop(2) != 0)
+	{
+		printf("ERROR: periodic task queued while waiting\n");
+		return false;
+	}
+	printf("OK: periodic task not queued while waiting\n");
+	return true;
 }
+#endif
 
 void runTimerTask(void)
 {
 	for (int i = 0; i < NR_TIMERS; i++)
 		if (TIMER_DONE(timers[i].time))
-			QueueAdd(MAIN_RUN_QUEUE, timers[i].task);
-	QueueAdd(MAIN_RUN_QUEUE, tasks[TIMER_TASK]);
+		{
+			// A task that is still queued, for example waiting for a critical
+			// section, skips this start, as adding it again corrupts the queue
+			if (!tasks[timers[i].task].queued)
+				QueueAdd(MAIN_RUN_QUEUE, timers[i].task);
+			timers[i].time = timers[i].period != 0 ? TIMER_ON(timers[i].period) : TIMER_OFF;
+		}
+	TaskGroupsReplenish();
+	STATS(StatsTick());
+	QueueAdd(MAIN_RUN_QUEUE, TIMER_TASK);
 }
 
 void runMainQueue(void)
 {
 	for (;;)
 	{
-		task_id = QueuePop(MAIN_RUN_QUEUE);
+		DrainPostRing();
+		EventGroupsWakeSetFromIsr();
+		TaskId task_id = QueuePop(MAIN_RUN_QUEUE);
 		if (task_id == 0)
 			break;
 		
+		TaskGroupId group_id = tasks[task_id].group;
+		if (group_id != 0 && taskGroups[group_id].remaining == 0)
+		{
+			// Hold the task until the budget of its group is replenished
+			QueueAdd(TASK_GROUP_QUEUE(group_id), task_id);
+			continue;
+		}
+		PROFILE(runningStep = tasks[task_id].function);
+		runningTask = task_id;
+		scratchArenaTop = scratchArenaStatic;
+		STATS(StatsRunStart(task_id));
 		tasks[task_id].function();
+		STATS(StatsRunEnd(task_id));
+		runningTask = 0;
 	}
 }
 
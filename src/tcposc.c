@@ -16,6 +16,11 @@
 #include <malloc.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #ifndef NULL
 #define NULL 0
@@ -27,26 +32,468 @@ typedef int bool;
 
 typedef unsigned char byte;
 
+/*
+	Slab allocator
+	~~~~~~~~~~~~~~
+	All allocations through MALLOC and FREE go through a slab allocator.
+	Small objects are rounded up to one of the size classes and taken
+	from slabs of SLAB_SIZE bytes, which are aligned on SLAB_SIZE, such
+	that the slab of an object can be found by masking its address. Each
+	thread has a magazine per size class, with free objects that can be
+	allocated and freed without locking. When a magazine is empty or full,
+	half of it is exchanged with the depot, which is shared between the
+	threads and protected by a mutex. Objects larger than the largest size
+	class are allocated with malloc, prefixed with a slab header. To tell
+	them apart when they are freed, the frames of SLAB_SIZE bytes that are
+	used by slabs are marked in a two level bitmap, which can be read
+	without locking.
+	A thread should call slab_flush_magazines before it exits, to return
+	its free objects. slab_trim returns slabs without used objects to the
+	system, and slab_release_all releases all memory in bulk, when all
+	objects are no longer needed. slab_report prints the usage and the
+	fragmentation of the slabs. It only knows the magazines of the calling
+	thread, thus the other threads should have flushed their magazines.
+*/
+
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_HEADER_SIZE 64
+#define MAGAZINE_SIZE 64
+#define NR_SIZE_CLASSES 8
+#define SLAB_LARGE NR_SIZE_CLASSES
+
+const unsigned int slab_class_sizes[NR_SIZE_CLASSES] = { 16, 32, 48, 64, 96, 128, 192, 256 };
+
+typedef struct slab *slab_p;
+struct slab
+{
+	int size_class;        /* Size class or SLAB_LARGE for a single large object */
+	size_t size;           /* Size of the large object */
+	unsigned int nr_used;  /* Number of objects not in the depot */
+	slab_p prev;
+	slab_p next;
+};
+
+typedef struct slab_object *slab_object_p;
+struct slab_object
+{
+	slab_object_p next;
+};
+
+struct
+{
+	slab_p slabs;
+	slab_object_p free_objects;
+	unsigned long nr_slabs;
+	unsigned long nr_free;
+} slab_depot[NR_SIZE_CLASSES + 1];
+pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct
+{
+	unsigned int nr;
+	void *objects[MAGAZINE_SIZE];
+} magazine_t, *magazine_p;
+
+__thread magazine_t slab_magazines[NR_SIZE_CLASSES];
+unsigned long slab_allocated_bytes = 0;
+
+#define SLAB_OF(P) ((slab_p)((uintptr_t)(P) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+/* The bitmap of the frames covers an address space of 48 bits */
+#define SLAB_FRAME(P) ((uintptr_t)(P) / SLAB_SIZE)
+#define SLAB_FRAME_MAP_BITS 16
+#define SLAB_FRAME_LEAF_WORDS ((1 << 16) / 64)
+
+uint64_t *slab_frame_map[1 << SLAB_FRAME_MAP_BITS];
+
+void slab_frame_mark(slab_p slab, bool used)
+/*  Must be called with the mutex locked */
+{
+	uintptr_t frame = SLAB_FRAME(slab);
+	uint64_t **ref_leaf = &slab_frame_map[(frame >> 16) & ((1 << SLAB_FRAME_MAP_BITS) - 1)];
+	if (*ref_leaf == NULL)
+	{
+		uint64_t *leaf = (uint64_t*)calloc(SLAB_FRAME_LEAF_WORDS, sizeof(uint64_t));
+		if (leaf == NULL)
+		{
+			fprintf(stderr, "ERROR: out of memory\n");
+			exit(1);
+		}
+		__atomic_store_n(ref_leaf, leaf, __ATOMIC_RELEASE);
+	}
+	uint64_t bit = (uint64_t)1 << (frame % 64);
+	if (used)
+		__atomic_fetch_or(&(*ref_leaf)[(frame & 0xFFFF) / 64], bit, __ATOMIC_RELEASE);
+	else
+		__atomic_fetch_and(&(*ref_leaf)[(frame & 0xFFFF) / 64], ~bit, __ATOMIC_RELEASE);
+}
+
+bool slab_frame_used(void *p)
+{
+	uintptr_t frame = SLAB_FRAME(p);
+	uint64_t *leaf = __atomic_load_n(&slab_frame_map[(frame >> 16) & ((1 << SLAB_FRAME_MAP_BITS) - 1)], __ATOMIC_ACQUIRE);
+	return leaf != NULL && (__atomic_load_n(&leaf[(frame & 0xFFFF) / 64], __ATOMIC_ACQUIRE) & ((uint64_t)1 << (frame % 64))) != 0;
+}
+
+int slab_size_class(size_t size)
+{
+	for (int size_class = 0; size_class < NR_SIZE_CLASSES; size_class++)
+		if (size <= slab_class_sizes[size_class])
+			return size_class;
+	return SLAB_LARGE;
+}
+
+slab_p slab_new(int size_class, size_t size)
+{
+	void *memory = NULL;
+	if (size_class == SLAB_LARGE ? (memory = malloc(size)) == NULL : posix_memalign(&memory, SLAB_SIZE, size) != 0)
+	{
+		fprintf(stderr, "ERROR: out of memory\n");
+		exit(1);
+	}
+	slab_p slab = (slab_p)memory;
+	if (size_class != SLAB_LARGE)
+		slab_frame_mark(slab, TRUE);
+	slab->size_class = size_class;
+	slab->size = size;
+	slab->nr_used = 0;
+	slab->prev = NULL;
+	slab->next = slab_depot[size_class].slabs;
+	if (slab->next != NULL)
+		slab->next->prev = slab;
+	slab_depot[size_class].slabs = slab;
+	slab_depot[size_class].nr_slabs++;
+	return slab;
+}
+
+void slab_unlink(slab_p slab)
+{
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		slab_depot[slab->size_class].slabs = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+	slab_depot[slab->size_class].nr_slabs--;
+}
+
+void slab_refill(int size_class, magazine_p magazine)
+{
+	pthread_mutex_lock(&slab_mutex);
+	if (slab_depot[size_class].free_objects == NULL)
+	{
+		slab_p slab = slab_new(size_class, SLAB_SIZE);
+		unsigned int size = slab_class_sizes[size_class];
+		for (char *object = (char*)slab + SLAB_SIZE - size; object >= (char*)slab + SLAB_HEADER_SIZE; object -= size)
+		{
+			((slab_object_p)object)->next = slab_depot[size_class].free_objects;
+			slab_depot[size_class].free_objects = (slab_object_p)object;
+			slab_depot[size_class].nr_free++;
+		}
+	}
+	while (magazine->nr < MAGAZINE_SIZE / 2 && slab_depot[size_class].free_objects != NULL)
+	{
+		slab_object_p object = slab_depot[size_class].free_objects;
+		slab_depot[size_class].free_objects = object->next;
+		slab_depot[size_class].nr_free--;
+		SLAB_OF(object)->nr_used++;
+		magazine->objects[magazine->nr++] = object;
+	}
+	pthread_mutex_unlock(&slab_mutex);
+}
+
+void slab_flush(int size_class, magazine_p magazine, unsigned int keep)
+{
+	pthread_mutex_lock(&slab_mutex);
+	while (magazine->nr > keep)
+	{
+		slab_object_p object = (slab_object_p)magazine->objects[--magazine->nr];
+		object->next = slab_depot[size_class].free_objects;
+		slab_depot[size_class].free_objects = object;
+		slab_depot[size_class].nr_free++;
+		SLAB_OF(object)->nr_used--;
+	}
+	pthread_mutex_unlock(&slab_mutex);
+}
+
+void *slab_alloc(size_t size)
+{
+	__atomic_fetch_add(&slab_allocated_bytes, size, __ATOMIC_RELAXED);
+	int size_class = slab_size_class(size);
+	if (size_class == SLAB_LARGE)
+	{
+		pthread_mutex_lock(&slab_mutex);
+		slab_p slab = slab_new(SLAB_LARGE, SLAB_HEADER_SIZE + size);
+		slab->nr_used = 1;
+		pthread_mutex_unlock(&slab_mutex);
+		return (char*)slab + SLAB_HEADER_SIZE;
+	}
+	magazine_p magazine = &slab_magazines[size_class];
+	if (magazine->nr == 0)
+		slab_refill(size_class, magazine);
+	return magazine->objects[--magazine->nr];
+}
+
+void slab_free(void *p)
+{
+	if (p == NULL)
+		return;
+	if (!slab_frame_used(p))
+	{
+		slab_p slab = (slab_p)((char*)p - SLAB_HEADER_SIZE);
+		pthread_mutex_lock(&slab_mutex);
+		slab_unlink(slab);
+		pthread_mutex_unlock(&slab_mutex);
+		free(slab);
+		return;
+	}
+	slab_p slab = SLAB_OF(p);
+	magazine_p magazine = &slab_magazines[slab->size_class];
+	if (magazine->nr == MAGAZINE_SIZE)
+		slab_flush(slab->size_class, magazine, MAGAZINE_SIZE / 2);
+	magazine->objects[magazine->nr++] = p;
+}
+
+void slab_flush_magazines(void)
+{
+	for (int size_class = 0; size_class < NR_SIZE_CLASSES; size_class++)
+		slab_flush(size_class, &slab_magazines[size_class], 0);
+}
+
+void slab_trim(void)
+{
+	pthread_mutex_lock(&slab_mutex);
+	for (int size_class = 0; size_class < NR_SIZE_CLASSES; size_class++)
+	{
+		slab_object_p *ref_object = &slab_depot[size_class].free_objects;
+		while (*ref_object != NULL)
+			if (SLAB_OF(*ref_object)->nr_used == 0)
+			{
+				*ref_object = (*ref_object)->next;
+				slab_depot[size_class].nr_free--;
+			}
+			else
+				ref_object = &(*ref_object)->next;
+		for (slab_p slab = slab_depot[size_class].slabs; slab != NULL;)
+		{
+			slab_p next = slab->next;
+			if (slab->nr_used == 0)
+			{
+				slab_unlink(slab);
+				slab_frame_mark(slab, FALSE);
+				free(slab);
+			}
+			slab = next;
+		}
+	}
+	pthread_mutex_unlock(&slab_mutex);
+}
+
+void slab_release_all(void)
+{
+	pthread_mutex_lock(&slab_mutex);
+	for (int size_class = 0; size_class <= SLAB_LARGE; size_class++)
+	{
+		while (slab_depot[size_class].slabs != NULL)
+		{
+			slab_p slab = slab_depot[size_class].slabs;
+			slab_depot[size_class].slabs = slab->next;
+			if (size_class != SLAB_LARGE)
+				slab_frame_mark(slab, FALSE);
+			free(slab);
+		}
+		slab_depot[size_class].free_objects = NULL;
+		slab_depot[size_class].nr_slabs = 0;
+		slab_depot[size_class].nr_free = 0;
+	}
+	pthread_mutex_unlock(&slab_mutex);
+	for (int size_class = 0; size_class < NR_SIZE_CLASSES; size_class++)
+		slab_magazines[size_class].nr = 0;
+}
+
+void slab_report(FILE *fout)
+/*  The objects in the magazines of other threads are counted as used */
+{
+	pthread_mutex_lock(&slab_mutex);
+	fprintf(fout, "%6s %8s %10s %10s %10s %10s %8s\n", "size", "slabs", "objects", "used", "depot", "magazine", "frag");
+	for (int size_class = 0; size_class < NR_SIZE_CLASSES; size_class++)
+	{
+		unsigned int size = slab_class_sizes[size_class];
+		unsigned long per_slab = (SLAB_SIZE - SLAB_HEADER_SIZE) / size;
+		unsigned long nr_used = 0;
+		for (slab_p slab = slab_depot[size_class].slabs; slab != NULL; slab = slab->next)
+			nr_used += slab->nr_used;
+		unsigned long nr_magazine = slab_magazines[size_class].nr;
+		unsigned long nr_slabs = slab_depot[size_class].nr_slabs;
+		/* Fragmentation: the part of the slabs that is not used by objects */
+		unsigned long used_bytes = (nr_used - nr_magazine) * size;
+		fprintf(fout, "%6u %8lu %10lu %10lu %10lu %10lu %7lu%%\n", size, nr_slabs, nr_slabs * per_slab,
+				nr_used - nr_magazine, slab_depot[size_class].nr_free, nr_magazine,
+				nr_slabs == 0 ? 0 : 100 - (100 * used_bytes) / (nr_slabs * SLAB_SIZE));
+	}
+	unsigned long large_bytes = 0;
+	for (slab_p slab = slab_depot[SLAB_LARGE].slabs; slab != NULL; slab = slab->next)
+		large_bytes += slab->size;
+	fprintf(fout, "%6s %8lu %10lu bytes\n", "large", slab_depot[SLAB_LARGE].nr_slabs, large_bytes);
+	pthread_mutex_unlock(&slab_mutex);
+}
+
+/*
+	Allocation profiling
+	~~~~~~~~~~~~~~~~~~~~
+	When compiled with -DTRACE_ALLOCATIONS=1, all allocations are counted
+	per source line of the MALLOC call: the number of allocations and
+	frees, the bytes, the live objects and the peak of live bytes. For
+	this, each allocation is prefixed with a header that records the line
+	and the size. The types that are managed with free lists (trees,
+	prev_child, result_list and nt_stack) count how often an object is
+	allocated and released. At exit, a summary sorted on peak live bytes
+	is printed on stderr. The counters are protected by a mutex, as the
+	files are parsed by multiple threads with --jobs.
+*/
+
+enum alloc_type_t { at_tree, at_prev_child, at_result_list, at_nt_stack, NR_ALLOC_TYPES };
+
 #if TRACE_ALLOCATIONS
 
+typedef struct
+{
+	unsigned int line;
+	unsigned long nr_allocs;
+	unsigned long nr_frees;
+	unsigned long bytes;
+	unsigned long live_bytes;
+	unsigned long peak_live_bytes;
+} alloc_site_t, *alloc_site_p;
+
+typedef union
+{
+	struct
+	{
+		unsigned int line;
+		size_t size;
+	} info;
+	long double align;
+} alloc_header_t;
+
+pthread_mutex_t alloc_sites_mutex = PTHREAD_MUTEX_INITIALIZER;
+alloc_site_p alloc_sites = NULL;
+unsigned int nr_alloc_sites = 0;
+unsigned long alloc_live_bytes = 0;
+unsigned long alloc_peak_live_bytes = 0;
+
+struct
+{
+	const char *name;
+	unsigned long nr_new;
+	unsigned long nr_released;
+	unsigned long live;
+	unsigned long peak_live;
+} alloc_types[NR_ALLOC_TYPES] = { { "tree" }, { "prev_child" }, { "result_list" }, { "nt_stack" } };
+
+void alloc_type_count(enum alloc_type_t type)
+{
+	pthread_mutex_lock(&alloc_sites_mutex);
+	alloc_types[type].nr_new++;
+	if (++alloc_types[type].live > alloc_types[type].peak_live)
+		alloc_types[type].peak_live = alloc_types[type].live;
+	pthread_mutex_unlock(&alloc_sites_mutex);
+}
+
+void alloc_type_release(enum alloc_type_t type)
+{
+	pthread_mutex_lock(&alloc_sites_mutex);
+	alloc_types[type].nr_released++;
+	alloc_types[type].live--;
+	pthread_mutex_unlock(&alloc_sites_mutex);
+}
+
+#define ALLOC_TYPE_NEW(T) alloc_type_count(T);
+#define ALLOC_TYPE_RELEASE(T) alloc_type_release(T);
+
+int alloc_site_compare(const void *a, const void *b)
+{
+	const alloc_site_t *site_a = (const alloc_site_t*)a;
+	const alloc_site_t *site_b = (const alloc_site_t*)b;
+	if (site_a->peak_live_bytes != site_b->peak_live_bytes)
+		return site_a->peak_live_bytes < site_b->peak_live_bytes ? 1 : -1;
+	return site_a->bytes < site_b->bytes ? 1 : site_a->bytes > site_b->bytes ? -1 : 0;
+}
+
+void print_alloc_profile(void)
+{
+	alloc_site_p sites = (alloc_site_p)malloc(nr_alloc_sites * sizeof(alloc_site_t));
+	unsigned int nr_sites = 0;
+	for (unsigned int line = 0; line < nr_alloc_sites; line++)
+		if (alloc_sites[line].nr_allocs > 0)
+			sites[nr_sites++] = alloc_sites[line];
+	qsort(sites, nr_sites, sizeof(alloc_site_t), alloc_site_compare);
+
+	fprintf(stderr, "Allocations per line (peak live %lu bytes, live at exit %lu bytes):\n", alloc_peak_live_bytes, alloc_live_bytes);
+	fprintf(stderr, "%6s %10s %10s %12s %10s %12s %12s\n", "line", "allocs", "frees", "bytes", "live", "live bytes", "peak bytes");
+	for (unsigned int i = 0; i < nr_sites; i++)
+		fprintf(stderr, "%6u %10lu %10lu %12lu %10lu %12lu %12lu\n", sites[i].line, sites[i].nr_allocs, sites[i].nr_frees,
+				sites[i].bytes, sites[i].nr_allocs - sites[i].nr_frees, sites[i].live_bytes, sites[i].peak_live_bytes);
+	free(sites);
+
+	fprintf(stderr, "Free list managed types:\n");
+	fprintf(stderr, "%-12s %10s %10s %10s %10s\n", "type", "new", "released", "live", "peak live");
+	for (int type = 0; type < NR_ALLOC_TYPES; type++)
+		fprintf(stderr, "%-12s %10lu %10lu %10lu %10lu\n", alloc_types[type].name, alloc_types[type].nr_new,
+				alloc_types[type].nr_released, alloc_types[type].live, alloc_types[type].peak_live);
+}
+
 void *my_malloc(size_t size, unsigned int line)
 {
-	void *p = malloc(size);
-	fprintf(stdout, "At line %u: allocated %lu bytes %p\n", line, size, p);
-	return p;
+	pthread_mutex_lock(&alloc_sites_mutex);
+	if (line >= nr_alloc_sites)
+	{
+		if (nr_alloc_sites == 0)
+			atexit(print_alloc_profile);
+		unsigned int nr_sites = 2 * line + 1;
+		alloc_sites = (alloc_site_p)realloc(alloc_sites, nr_sites * sizeof(alloc_site_t));
+		memset(alloc_sites + nr_alloc_sites, 0, (nr_sites - nr_alloc_sites) * sizeof(alloc_site_t));
+		for (unsigned int i = nr_alloc_sites; i < nr_sites; i++)
+			alloc_sites[i].line = i;
+		nr_alloc_sites = nr_sites;
+	}
+	alloc_site_p site = &alloc_sites[line];
+	site->nr_allocs++;
+	site->bytes += size;
+	site->live_bytes += size;
+	if (site->live_bytes > site->peak_live_bytes)
+		site->peak_live_bytes = site->live_bytes;
+	alloc_live_bytes += size;
+	if (alloc_live_bytes > alloc_peak_live_bytes)
+		alloc_peak_live_bytes = alloc_live_bytes;
+	pthread_mutex_unlock(&alloc_sites_mutex);
+
+	alloc_header_t *header = (alloc_header_t*)slab_alloc(sizeof(alloc_header_t) + size);
+	header->info.line = line;
+	header->info.size = size;
+	return header + 1;
 }
 
 void my_free(void *p, unsigned int line)
 {
-
-	fprintf(stdout, "At line %u: freed %p\n", line, p);
-	free(p);
+	if (p == NULL)
+		return;
+	alloc_header_t *header = (alloc_header_t*)p - 1;
+	pthread_mutex_lock(&alloc_sites_mutex);
+	alloc_site_p site = &alloc_sites[header->info.line];
+	site->nr_frees++;
+	site->live_bytes -= header->info.size;
+	alloc_live_bytes -= header->info.size;
+	pthread_mutex_unlock(&alloc_sites_mutex);
+	slab_free(header);
 }
 
 #else
 
-#define my_malloc(X,L) malloc(X)
-#define my_free(X,L) free(X)
+#define my_malloc(X,L) slab_alloc(X)
+#define my_free(X,L) slab_free(X)
+#define ALLOC_TYPE_NEW(T)
+#define ALLOC_TYPE_RELEASE(T)
 
 #endif
 
@@ -108,11 +555,28 @@ typedef struct text_pos text_pos_t, *text_pos_p;
 
 /*  Definition for a non-terminal  */
 
+enum memo_policy
+{
+	memo_auto,   /* Decided before parsing (see resolve_memo_policies) */
+	memo_always, /* Results are always stored in the cache */
+	memo_never   /* The cache is never used */
+};
+
 struct non_terminal
 {
 	const char *name;     /* Name of the non-terminal */
+	int id;               /* Number in order of definition */
 	rule_p normal;       /* Normal rules */
 	rule_p recursive;    /* Left-recursive rules */
+	enum memo_policy memo; /* Memoization policy */
+	bool nullable;       /* Whether it can be parsed without consuming input */
+	int mark;            /* For traversing the grammar */
+	unsigned long memo_lookups; /* Number of lookups in the cache */
+	unsigned long memo_hits;    /* Number of lookups that found a result */
+	unsigned long work;         /* Parse work spent in the rules */
+	unsigned long inclusive_work; /* Including the work of the non-terminals it calls */
+	int depth;                  /* Number of active parse_nt calls (with a budget) */
+	char_set_p first;           /* Characters it can start with (see calculate_first) */
 };
 
 typedef struct non_terminal_dict *non_terminal_dict_p;
@@ -126,14 +590,27 @@ struct non_terminal_dict
 
 non_terminal_p find_nt(const char *name, non_terminal_dict_p *p_nt)
 {
+   int id = 0;
    while (*p_nt != NULL && (*p_nt)->elem.name != name && strcmp((*p_nt)->elem.name, name) != 0)
-		p_nt = &((*p_nt)->next);
+   {	p_nt = &((*p_nt)->next);
+		id++;
+   }
 
    if (*p_nt == NULL)
    {   *p_nt = MALLOC(struct non_terminal_dict);
 	   (*p_nt)->elem.name = name;
+	   (*p_nt)->elem.id = id;
 	   (*p_nt)->elem.normal = NULL;
 	   (*p_nt)->elem.recursive = NULL;
+	   (*p_nt)->elem.memo = memo_auto;
+	   (*p_nt)->elem.nullable = FALSE;
+	   (*p_nt)->elem.mark = 0;
+	   (*p_nt)->elem.memo_lookups = 0;
+	   (*p_nt)->elem.memo_hits = 0;
+	   (*p_nt)->elem.work = 0;
+	   (*p_nt)->elem.inclusive_work = 0;
+	   (*p_nt)->elem.depth = 0;
+	   (*p_nt)->elem.first = NULL;
 	   (*p_nt)->next = NULL;
    }
    return &(*p_nt)->elem;
@@ -473,6 +950,7 @@ void element_print(FILE *f, element_p element)
 
 #define HEADER(N) non_terminal_dict_p *_nt = N; non_terminal_p nt; rule_p* ref_rule; rule_p* ref_rec_rule; rule_p rules; element_p* ref_element; element_p element;
 #define NT_DEF(N) nt = find_nt(N, _nt); ref_rule = &nt->normal; ref_rec_rule = &nt->recursive;
+#define MEMO(P) nt->memo = P;
 #define RULE rules = *ref_rule = new_rule(); ref_rule = &rules->next; ref_element = &rules->elements;
 #define REC_RULE(E) rules = *ref_rec_rule = new_rule(); rules->rec_start_function = E; ref_rec_rule = &rules->next; ref_element = &rules->elements;
 #define _NEW_GR(K) element = *ref_element = new_element(K); ref_element = &element->next;
@@ -962,9 +1440,10 @@ void text_buffer_from_file(text_buffer_p text_buffer, FILE *f)
 {
 	fseek(f, 0L, SEEK_END);
 	size_t length = ftell(f);
-	char *buffer = MALLOC_N(length, char);
+	char *buffer = MALLOC_N(length + 1, char);
 	fseek(f, 0L, SEEK_SET);
 	length = fread(buffer, 1, length, f);
+	buffer[length] = '\0'; /* The scanner looks at the character at the end */
 	
 	text_buffer->tab_size = 4;
 	text_buffer->buffer_len = length;
@@ -1069,6 +1548,13 @@ typedef struct
 	nt_stack_p nt_stack;
 	cache_item_p (*cache_hit_function)(void *cache, size_t pos, const char *nt);
 	void *cache;
+	non_terminal_p cur_nt;          /* Non-terminal which rules are being parsed */
+	unsigned long work;             /* Number of elements attempted and characters re-consumed */
+	unsigned long work_budget;      /* Maximum work (0 for no maximum) */
+	bool out_of_work;               /* Whether parsing was aborted because of the budget */
+	unsigned long *work_per_line;   /* Work per input line (only with a budget) */
+	unsigned int nr_work_lines;
+	bool collect_statistics;        /* Whether to count the memoization lookups and hits */
 } parser_t, *parser_p;
 
 void parser_init(parser_p parser, text_buffer_p text_buffer)
@@ -1077,6 +1563,120 @@ void parser_init(parser_p parser, text_buffer_p text_buffer)
 	parser->nt_stack = NULL;
 	parser->cache_hit_function = 0;
 	parser->cache = NULL;
+	parser->cur_nt = NULL;
+	parser->work = 0;
+	parser->work_budget = 0;
+	parser->out_of_work = FALSE;
+	parser->work_per_line = NULL;
+	parser->nr_work_lines = 0;
+	parser->collect_statistics = TRUE;
+}
+
+/*
+	Parse work budget
+	~~~~~~~~~~~~~~~~~
+	Back-tracking can make parsing super-linear on some inputs. The work of
+	the parser is counted as the number of elements that are attempted plus
+	the number of characters that are consumed again after back-tracking.
+	When a budget is set, and the work exceeds it, all remaining elements
+	fail, such that parsing unwinds quickly. The work is also registered per
+	non-terminal and per input line for reporting where it was spent. For a
+	non-terminal, both the work in its own rules and the inclusive work,
+	with that of the non-terminals it calls, are registered. The inclusive
+	work is only counted for the outermost call of a recursive non-terminal.
+*/
+
+bool parser_charge_work(parser_p parser, unsigned long amount)
+{
+	if (parser->out_of_work)
+		return FALSE;
+	parser->work += amount;
+	if (parser->work_budget == 0)
+		return TRUE;
+	if (parser->cur_nt != NULL)
+		parser->cur_nt->work += amount;
+	unsigned int line = parser->text_buffer->pos.cur_line;
+	if (line >= parser->nr_work_lines)
+	{
+		unsigned int nr_lines = 2 * line + 1;
+		unsigned long *work_per_line = MALLOC_N(nr_lines, unsigned long);
+		for (unsigned int i = 0; i < nr_lines; i++)
+			work_per_line[i] = i < parser->nr_work_lines ? parser->work_per_line[i] : 0;
+		FREE(parser->work_per_line);
+		parser->work_per_line = work_per_line;
+		parser->nr_work_lines = nr_lines;
+	}
+	parser->work_per_line[line] += amount;
+	if (parser->work > parser->work_budget)
+		parser->out_of_work = TRUE;
+	return !parser->out_of_work;
+}
+
+void parser_set_pos(parser_p parser, text_pos_p text_pos)
+{
+	if (text_pos->pos < parser->text_buffer->pos.pos)
+		parser_charge_work(parser, parser->text_buffer->pos.pos - text_pos->pos);
+	text_buffer_set_pos(parser->text_buffer, text_pos);
+}
+
+void parser_enter_nt(parser_p parser, non_terminal_p nt, unsigned long *start_work)
+{
+	if (parser->work_budget != 0 && nt->depth++ == 0)
+		*start_work = parser->work;
+}
+
+void parser_leave_nt(parser_p parser, non_terminal_p nt, unsigned long start_work)
+{
+	if (parser->work_budget != 0 && --nt->depth == 0)
+		nt->inclusive_work += parser->work - start_work;
+}
+
+#define NR_REPORTED_NTS 5
+#define NT_WORK_BEFORE(A, B) ((A)->inclusive_work > (B)->inclusive_work || ((A)->inclusive_work == (B)->inclusive_work && (A)->id < (B)->id))
+
+void parser_report_work(parser_p parser, non_terminal_dict_p all_nt, FILE *fout)
+{
+	fprintf(fout, "ERROR: parsing aborted after %lu units of work (budget %lu)\n", parser->work, parser->work_budget);
+	non_terminal_p max_nt = NULL;
+	for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+		if (max_nt == NULL || nt_dict->elem.work > max_nt->work)
+			max_nt = &nt_dict->elem;
+	if (max_nt != NULL)
+		fprintf(fout, "- most work in the rules of non-terminal %s (%lu units, %lu including the non-terminals it calls)\n",
+				max_nt->name, max_nt->work, max_nt->inclusive_work);
+	/* The non-terminals with the most inclusive work, in decreasing order */
+	fprintf(fout, "- most work including the non-terminals called:\n");
+	non_terminal_p prev_nt = NULL;
+	for (int i = 0; i < NR_REPORTED_NTS; i++)
+	{
+		non_terminal_p next_nt = NULL;
+		for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+			if (   nt_dict->elem.inclusive_work > 0 && (prev_nt == NULL || NT_WORK_BEFORE(prev_nt, &nt_dict->elem))
+				&& (next_nt == NULL || NT_WORK_BEFORE(&nt_dict->elem, next_nt)))
+				next_nt = &nt_dict->elem;
+		if (next_nt == NULL)
+			break;
+		fprintf(fout, "  %s (%lu units)\n", next_nt->name, next_nt->inclusive_work);
+		prev_nt = next_nt;
+	}
+	unsigned int max_line = 0;
+	for (unsigned int i = 1; i < parser->nr_work_lines; i++)
+		if (parser->work_per_line[i] > parser->work_per_line[max_line])
+			max_line = i;
+	if (parser->nr_work_lines > 0)
+		fprintf(fout, "- most work at line %u (%lu units)\n", max_line, parser->work_per_line[max_line]);
+}
+
+/*  - Function to reset the work of the non-terminals before parsing with a new budget */
+
+void reset_parse_work(non_terminal_dict_p all_nt)
+{
+	for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+	{
+		nt_dict->elem.work = 0;
+		nt_dict->elem.inclusive_work = 0;
+		nt_dict->elem.depth = 0;
+	}
 }
 
 nt_stack_p nt_stack_push(const char *name, parser_p parser);
@@ -1094,6 +1694,21 @@ nt_stack_p nt_stack_pop(nt_stack_p cur);
 
 bool parse_rule(parser_p parser, element_p element, const result_p prev_result, rule_p rules, result_p rule_result);
 
+/*  The position at which the rule that is being parsed started, which is
+	given to the tree made at the end of the rule. For a left-recursive rule
+	this is the start of the non-terminal. */
+
+__thread text_pos_t rule_start_pos;
+
+bool parse_rule_from(parser_p parser, text_pos_p start_pos, const result_p prev_result, rule_p rule, result_p rule_result)
+{
+	text_pos_t parent_start_pos = rule_start_pos;
+	rule_start_pos = *start_pos;
+	bool parsed = parse_rule(parser, rule->elements, prev_result, rule, rule_result);
+	rule_start_pos = parent_start_pos;
+	return parsed;
+}
+
 bool parse_nt(parser_p parser, non_terminal_p non_term, result_p result)
 {
 	ENTER_RESULT_CONTEXT
@@ -1103,9 +1718,15 @@ bool parse_nt(parser_p parser, non_terminal_p non_term, result_p result)
 
 	/* First try the cache (if available) */
 	cache_item_p cache_item = NULL;
-	if (parser->cache_hit_function != NULL)
+	if (parser->cache_hit_function != NULL && non_term->memo != memo_never)
 	{
 		cache_item = parser->cache_hit_function(parser->cache, parser->text_buffer->pos.pos, nt);
+		if (parser->collect_statistics)
+		{
+			non_term->memo_lookups++;
+			if (cache_item != NULL && cache_item->success != s_unknown)
+				non_term->memo_hits++;
+		}
 		if (cache_item != NULL)
 		{
 			if (cache_item->success == s_success)
@@ -1126,8 +1747,13 @@ bool parse_nt(parser_p parser, non_terminal_p non_term, result_p result)
 		}
 	}
 	
+	unsigned long start_work = 0;
+	parser_enter_nt(parser, non_term, &start_work);
+
 	/* Push the current non-terminal on stack */
 	parser->nt_stack = nt_stack_push(nt, parser);
+	non_terminal_p parent_nt = parser->cur_nt;
+	parser->cur_nt = non_term;
 
 	if (debug_nt)
 	{   printf("%*.*s", depth, depth, "");
@@ -1136,11 +1762,12 @@ bool parse_nt(parser_p parser, non_terminal_p non_term, result_p result)
 	}
 
 	/* Try the normal rules in order of declaration */
+	text_pos_t start_pos = parser->text_buffer->pos;
 	bool parsed_a_rule = FALSE;
 	for (rule_p rule = non_term->normal; rule != NULL; rule = rule->next )
 	{
 		DECL_RESULT(start)
-		if (parse_rule(parser, rule->elements, &start, rule, result))
+		if (parse_rule_from(parser, &start_pos, &start, rule, result))
 		{
 			parsed_a_rule = TRUE;
 			DISP_RESULT(start)
@@ -1161,6 +1788,8 @@ bool parse_nt(parser_p parser, non_terminal_p non_term, result_p result)
 		
 		/* Pop the current non-terminal from the stack */
 		parser->nt_stack = nt_stack_pop(parser->nt_stack);
+		parser->cur_nt = parent_nt;
+		parser_leave_nt(parser, non_term, start_work);
 		
 		EXIT_RESULT_CONTEXT
 		return FALSE;
@@ -1182,7 +1811,7 @@ bool parse_nt(parser_p parser, non_terminal_p non_term, result_p result)
 				}
 			}
 			DECL_RESULT(rule_result)
-			if (parse_rule(parser, rule->elements, &start_result, rule, &rule_result))
+			if (parse_rule_from(parser, &start_pos, &start_result, rule, &rule_result))
 			{
 				parsed_a_rule = TRUE;
 				result_assign(result, &rule_result);
@@ -1213,6 +1842,8 @@ bool parse_nt(parser_p parser, non_terminal_p non_term, result_p result)
 
 	/* Pop the current non-terminal from the stack */
 	parser->nt_stack = nt_stack_pop(parser->nt_stack);
+	parser->cur_nt = parent_nt;
+	parser_leave_nt(parser, non_term, start_work);
 	
 	EXIT_RESULT_CONTEXT
 	return TRUE;
@@ -1377,7 +2008,7 @@ bool parse_rule(parser_p parser, element_p element, const result_p prev_result,
 					else
 					{
 						/* Failed to parse the next element of the sequence: reset the current position to the saved position. */
-						text_buffer_set_pos(parser->text_buffer, &sp);
+						parser_set_pos(parser, &sp);
 						DISP_RESULT(next_seq_elem);
 						break;
 					}
@@ -1427,7 +2058,7 @@ bool parse_rule(parser_p parser, element_p element, const result_p prev_result,
 	}
 	
 	/* Failed to parse the rule: reset the current position to the saved position. */
-	text_buffer_set_pos(parser->text_buffer, &sp);
+	parser_set_pos(parser, &sp);
 	
 	/* If the element was optional (and should not be avoided): Skip the element
 	   and try to parse the remainder of the rule */
@@ -1530,7 +2161,7 @@ bool parse_seq(parser_p parser, element_p element, const result_p prev_seq, cons
 	}
 	
 	/* Failed to parse the next element of the sequence: reset the current position to the saved position. */
-	text_buffer_set_pos(parser->text_buffer, &sp);
+	parser_set_pos(parser, &sp);
 
 	/* In case of the avoid modifier, an attempt to parse the remained of the
 	   rule, was already made. So, only in case of no avoid modifier, attempt
@@ -1571,6 +2202,8 @@ void expect_element(parser_p parser, element_p element);
 
 bool parse_element(parser_p parser, element_p element, const result_p prev_result, result_p result)
 {
+	if (!parser_charge_work(parser, 1))
+		return FALSE;
 	DEBUG_ENTER_P2("parse_element at %d.%d: ", parser->text_buffer->pos.cur_line, parser->text_buffer->pos.cur_column);
 	DEBUG_PR(element); DEBUG_NL;
 
@@ -1596,7 +2229,7 @@ bool parse_element(parser_p parser, element_p element, const result_p prev_resul
 				if (element->condition != 0 && !(*element->condition)(&nt_result, element->condition_argument))
 				{
 					DISP_RESULT(nt_result)
-					text_buffer_set_pos(parser->text_buffer, &sp);
+					parser_set_pos(parser, &sp);
 					EXIT_RESULT_CONTEXT
 					DEBUG_EXIT("parse_element failed due to condition function"); DEBUG_NL;
 					return FALSE;
@@ -1608,7 +2241,7 @@ bool parse_element(parser_p parser, element_p element, const result_p prev_resul
 				else if (!(*element->add_function)(prev_result, &nt_result, result))
 				{
 					DISP_RESULT(nt_result)
-					text_buffer_set_pos(parser->text_buffer, &sp);
+					parser_set_pos(parser, &sp);
 					EXIT_RESULT_CONTEXT
 					DEBUG_EXIT("parse_element failed due to add function"); DEBUG_NL;
 					return FALSE;
@@ -1620,13 +2253,15 @@ bool parse_element(parser_p parser, element_p element, const result_p prev_resul
 			{
 				/* Try all rules in the grouping */
 				DECL_RESULT(rule_result);
+				/* A grouping that continues the enclosing rule, starts where it started */
+				text_pos_t start_pos = element->add_function == 0 ? rule_start_pos : parser->text_buffer->pos;
 				rule_p rule = element->info.rules;
 				for ( ; rule != NULL; rule = rule->next )
 				{
 					DECL_RESULT(start);
 					if (element->add_function == 0)
 						result_assign(&start, prev_result);
-					if (parse_rule(parser, rule->elements, &start, rule, &rule_result))
+					if (parse_rule_from(parser, &start_pos, &start, rule, &rule_result))
 					{
 						DISP_RESULT(start);
 						break;
@@ -1648,7 +2283,7 @@ bool parse_element(parser_p parser, element_p element, const result_p prev_resul
 				else if (!(*element->add_function)(prev_result, &rule_result, result))
 				{
 					DISP_RESULT(rule_result)
-					text_buffer_set_pos(parser->text_buffer, &sp);
+					parser_set_pos(parser, &sp);
 					EXIT_RESULT_CONTEXT
 					DEBUG_EXIT("parse_element failed due to add function"); DEBUG_NL;
 					return FALSE;
@@ -1817,64 +2452,257 @@ cache_item_p solutions_find(void *cache, size_t pos, const char *nt)
 }
 
 /*
-	White space tests
-	~~~~~~~~~~~~~~~~~
+	Memoization policies
+	~~~~~~~~~~~~~~~~~~~~
+	Looking up (and allocating) a cache item for every non-terminal at
+	every position costs more than it saves for small non-terminals, like
+	white space and operators, which are parsed in a few steps. Each
+	non-terminal has a memoization policy, which can be set with the MEMO
+	define in the grammar. The policy 'memo_auto' is resolved before
+	parsing, with the following heuristics:
+	- A non-terminal that can (indirectly) call itself without consuming
+	  input, always needs to be memoized, because the cache breaks the
+	  left-recursion.
+	- A non-terminal that only refers to itself and to non-terminals
+	  without any references is not memoized, because parsing it again is
+	  bounded by the input it consumes.
+	- Otherwise, when a profile from a previous run is available, a
+	  non-terminal that was looked up often but hardly ever hit is not
+	  memoized.
 */
 
-void test_parse_white_space(non_terminal_dict_p *all_nt, const char *input)
-{
-	ENTER_RESULT_CONTEXT
+#define MEMO_PROFILE_MIN_LOOKUPS 16
+#define MEMO_PROFILE_MIN_HIT_RATIO 16 /* at least one hit in this number of lookups */
 
-	text_buffer_t text_buffer;
-	text_buffer_assign_string(&text_buffer, input);
-	
-	solutions_t solutions;
-	solutions_init(&solutions, &text_buffer);
-	
-	parser_t parser;
-	parser_init(&parser, &text_buffer);
-	parser.cache_hit_function = solutions_find;
-	parser.cache = &solutions;
-	
-	DECL_RESULT(result);
-	if (parse_nt(&parser, find_nt("white_space", all_nt), &result) && text_buffer_end(&text_buffer))
+bool element_nullable(element_p element)
+{
+	if (element->optional)
+		return TRUE;
+	switch (element->kind)
 	{
-		fprintf(stderr, "OK: parsed white space\n");
+		case rk_nt:
+			return element->info.non_terminal->nullable;
+		case rk_grouping:
+			for (rule_p rule = element->info.rules; rule != NULL; rule = rule->next)
+			{
+				bool nullable = TRUE;
+				for (element_p elem = rule->elements; elem != NULL && nullable; elem = elem->next)
+					nullable = element_nullable(elem);
+				if (nullable)
+					return TRUE;
+			}
+			return FALSE;
+		default:
+			break;
 	}
-	else
+	return FALSE;
+}
+
+void calculate_nullable(non_terminal_dict_p all_nt)
+{
+	for (bool changed = TRUE; changed;)
 	{
-		fprintf(stderr, "ERROR: failed to parse white space from '%s'\n", input);
+		changed = FALSE;
+		for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+		{
+			non_terminal_p nt = &nt_dict->elem;
+			for (rule_p rule = nt->normal; rule != NULL && !nt->nullable; rule = rule->next)
+			{
+				bool nullable = TRUE;
+				for (element_p element = rule->elements; element != NULL && nullable; element = element->next)
+					nullable = element_nullable(element);
+				if (nullable)
+				{
+					nt->nullable = TRUE;
+					changed = TRUE;
+				}
+			}
+		}
 	}
-	DISP_RESULT(result);
+}
 
-	solutions_free(&solutions);
+/*  - Function to check if the rules can call the target non-terminal without consuming input.
+	    Only the normal rules of a non-terminal are at the leftmost position: the
+	    recursive rules continue after the non-terminal has already been parsed. */
 
-	EXIT_RESULT_CONTEXT
+bool rules_left_reach(rule_p rules, non_terminal_p target, int mark)
+{
+	for (rule_p rule = rules; rule != NULL; rule = rule->next)
+		for (element_p element = rule->elements; element != NULL; element = element->next)
+		{
+			if (element->kind == rk_nt)
+			{
+				non_terminal_p nt = element->info.non_terminal;
+				if (nt == target)
+					return TRUE;
+				if (nt->mark != mark)
+				{
+					nt->mark = mark;
+					if (rules_left_reach(nt->normal, target, mark))
+						return TRUE;
+				}
+			}
+			else if (element->kind == rk_grouping && rules_left_reach(element->info.rules, target, mark))
+				return TRUE;
+			if (!element_nullable(element))
+				break;
+		}
+	return FALSE;
 }
 
-void test_white_space_grammar(non_terminal_dict_p *all_nt)
+int nt_mark = 0;
+
+bool nt_left_recursive(non_terminal_p nt)
 {
-	test_parse_white_space(all_nt, " ");
-	test_parse_white_space(all_nt, "/* */");
+	nt->mark = ++nt_mark;
+	return rules_left_reach(nt->normal, nt, nt_mark);
 }
 
-/*
-	Number tests
-	~~~~~~~~~~~~
-*/
+/*  - Function to check if the rules only refer to the given non-terminal and non-terminals without references */
 
-void test_parse_number(non_terminal_dict_p *all_nt, const char *input, int num)
+bool elements_refer_only_to(element_p elements, non_terminal_p self, int depth);
+
+bool rules_refer_only_to(rule_p rules, non_terminal_p self, int depth)
 {
-	ENTER_RESULT_CONTEXT
-	text_buffer_t text_buffer;
-	text_buffer_assign_string(&text_buffer, input);
-	
-	solutions_t solutions;
-	solutions_init(&solutions, &text_buffer);
-	
-	parser_t parser;
-	parser_init(&parser, &text_buffer);
-	parser.cache_hit_function = solutions_find;
+	for (rule_p rule = rules; rule != NULL; rule = rule->next)
+		if (!elements_refer_only_to(rule->elements, self, depth))
+			return FALSE;
+	return TRUE;
+}
+
+bool elements_refer_only_to(element_p elements, non_terminal_p self, int depth)
+{
+	for (element_p element = elements; element != NULL; element = element->next)
+	{
+		if (element->kind == rk_nt && element->info.non_terminal != self)
+		{
+			non_terminal_p nt = element->info.non_terminal;
+			if (depth > 0 || !rules_refer_only_to(nt->normal, NULL, depth + 1) || !rules_refer_only_to(nt->recursive, NULL, depth + 1))
+				return FALSE;
+		}
+		else if (element->kind == rk_grouping && !rules_refer_only_to(element->info.rules, self, depth))
+			return FALSE;
+		if (element->chain_rule != NULL && !elements_refer_only_to(element->chain_rule, self, depth))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+void resolve_memo_policies(non_terminal_dict_p all_nt, bool use_profile)
+{
+	calculate_nullable(all_nt);
+	for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+	{
+		non_terminal_p nt = &nt_dict->elem;
+		if (nt->memo != memo_auto)
+			continue;
+		nt->memo = memo_always;
+		if (nt_left_recursive(nt))
+			continue;
+		if (rules_refer_only_to(nt->normal, nt, 0) && rules_refer_only_to(nt->recursive, nt, 0))
+			nt->memo = memo_never;
+		else if (   use_profile && nt->memo_lookups >= MEMO_PROFILE_MIN_LOOKUPS
+				 && nt->memo_hits * MEMO_PROFILE_MIN_HIT_RATIO < nt->memo_lookups)
+			nt->memo = memo_never;
+	}
+	for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+	{
+		nt_dict->elem.memo_lookups = 0;
+		nt_dict->elem.memo_hits = 0;
+	}
+}
+
+/*  - Functions to read and write the memoization profile (lines with name, lookups and hits) */
+
+bool read_memo_profile(const char *file_name, non_terminal_dict_p all_nt)
+{
+	FILE *f = fopen(file_name, "r");
+	if (f == NULL)
+		return FALSE;
+	char name[100];
+	unsigned long lookups, hits;
+	while (fscanf(f, "%99s %lu %lu", name, &lookups, &hits) == 3)
+		for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+			if (strcmp(nt_dict->elem.name, name) == 0)
+			{
+				nt_dict->elem.memo_lookups = lookups;
+				nt_dict->elem.memo_hits = hits;
+			}
+	fclose(f);
+	return TRUE;
+}
+
+bool write_memo_profile(const char *file_name, non_terminal_dict_p all_nt)
+{
+	FILE *f = fopen(file_name, "w");
+	if (f == NULL)
+		return FALSE;
+	for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+		if (nt_dict->elem.memo != memo_never)
+			fprintf(f, "%s %lu %lu\n", nt_dict->elem.name, nt_dict->elem.memo_lookups, nt_dict->elem.memo_hits);
+	fclose(f);
+	return TRUE;
+}
+
+/*
+	White space tests
+	~~~~~~~~~~~~~~~~~
+*/
+
+void test_parse_white_space(non_terminal_dict_p *all_nt, const char *input)
+{
+	ENTER_RESULT_CONTEXT
+
+	text_buffer_t text_buffer;
+	text_buffer_assign_string(&text_buffer, input);
+	
+	solutions_t solutions;
+	solutions_init(&solutions, &text_buffer);
+	
+	parser_t parser;
+	parser_init(&parser, &text_buffer);
+	parser.cache_hit_function = solutions_find;
+	parser.cache = &solutions;
+	
+	DECL_RESULT(result);
+	if (parse_nt(&parser, find_nt("white_space", all_nt), &result) && text_buffer_end(&text_buffer))
+	{
+		fprintf(stderr, "OK: parsed white space\n");
+	}
+	else
+	{
+		fprintf(stderr, "ERROR: failed to parse white space from '%s'\n", input);
+	}
+	DISP_RESULT(result);
+
+	solutions_free(&solutions);
+
+	EXIT_RESULT_CONTEXT
+}
+
+void test_white_space_grammar(non_terminal_dict_p *all_nt)
+{
+	test_parse_white_space(all_nt, " ");
+	test_parse_white_space(all_nt, "/* */");
+}
+
+/*
+	Number tests
+	~~~~~~~~~~~~
+*/
+
+void test_parse_number(non_terminal_dict_p *all_nt, const char *input, int num)
+{
+	ENTER_RESULT_CONTEXT
+	text_buffer_t text_buffer;
+	text_buffer_assign_string(&text_buffer, input);
+	
+	solutions_t solutions;
+	solutions_init(&solutions, &text_buffer);
+	
+	parser_t parser;
+	parser_init(&parser, &text_buffer);
+	parser.cache_hit_function = solutions_find;
 	parser.cache = &solutions;
 	
 	DECL_RESULT(result);
@@ -1915,6 +2743,7 @@ typedef struct
 	const char *type_name;
 	unsigned int line;
 	unsigned int column;
+	const char *file;     /* Path of the included file, or NULL for the input file */
 } node_t, *node_p;
 
 DEFINE_BASE_TYPE(node_p)
@@ -1926,6 +2755,7 @@ void init_node(node_p node, const char *type_name, void (*release_node)(void *))
 	node->type_name = type_name;
 	node->line = 0;
 	node->column = 0;
+	node->file = NULL;
 }
 
 void node_set_pos(node_p node, text_pos_p ps)
@@ -1952,8 +2782,7 @@ struct tree_t
 
 DEFINE_SUB_BASE_TYPE(tree_p, node_p)
 
-tree_p old_tree_nodes = NULL;
-long nr_allocated_tree_nodes = 0L;
+__thread long nr_allocated_tree_nodes = 0L;
 
 void release_tree(void *data)
 {
@@ -1967,22 +2796,16 @@ void release_tree(void *data)
 			RESULT_RELEASE(&tree->children[i]);
 		FREE(tree->children);
 	}
-	*(tree_p*)tree = old_tree_nodes;
-	old_tree_nodes = tree;
+	FREE(tree);
+	ALLOC_TYPE_RELEASE(at_tree)
 }
 
 const char *tree_node_type = "tree_node_type";
 
 tree_p malloc_tree(tree_param_p tree_param)
 {
-	tree_p new_tree_node;
-
-	if (old_tree_nodes != NULL)
-	{   new_tree_node = old_tree_nodes;
-		old_tree_nodes = *(tree_p*)old_tree_nodes;
-	}
-	else
-		new_tree_node = MALLOC(struct tree_t);
+	tree_p new_tree_node = MALLOC(struct tree_t);
+	ALLOC_TYPE_NEW(at_tree)
 
 	init_node(&new_tree_node->_node, tree_node_type, release_tree);
 	new_tree_node->tree_param = tree_param;
@@ -2019,28 +2842,20 @@ struct prev_child_t
 
 DEFINE_BASE_TYPE(prev_child_p)
 
-prev_child_p old_prev_childs = NULL;
-
 void release_prev_child( void *data )
 {
 	prev_child_p prev_child = CAST(prev_child_p, data);
 	RESULT_RELEASE(&prev_child->child);
 	if (prev_child != NULL)
 		ref_counted_base_dec(prev_child);
-	prev_child->prev = old_prev_childs;
-	old_prev_childs = prev_child;
+	FREE(prev_child);
+	ALLOC_TYPE_RELEASE(at_prev_child)
 }
 
 prev_child_p malloc_prev_child()
 {
-	prev_child_p new_prev_child;
-	if (old_prev_childs != NULL)
-	{
-		new_prev_child = old_prev_childs;
-		old_prev_childs = old_prev_childs->prev;
-	}
-	else
-		new_prev_child = MALLOC(struct prev_child_t);
+	prev_child_p new_prev_child = MALLOC(struct prev_child_t);
+	ALLOC_TYPE_NEW(at_prev_child)
 	new_prev_child->_base.cnt = 1;
 	new_prev_child->_base.release = release_prev_child;
 	RESULT_INIT(&new_prev_child->child);
@@ -2109,6 +2924,24 @@ bool take_child(result_p prev, result_p elem, result_p result)
 	return TRUE;
 }
 
+/*  Trees take the position of the first child that has a position, unless
+	they are made at the end of a rule, which gives them its start position  */
+
+void tree_set_pos_from_children(tree_p tree)
+{
+	for (int i = 0; i < tree->nr_children; i++)
+		if (tree->children[i].data != NULL)
+		{
+			node_p child = CAST(node_p, tree->children[i].data);
+			if (child->line != 0)
+			{
+				tree->_node.line = child->line;
+				tree->_node.column = child->column;
+				return;
+			}
+		}
+}
+
 tree_p make_tree_with_children(tree_param_p tree_param, prev_child_p children)
 {
 	tree_p tree = malloc_tree(tree_param);
@@ -2124,6 +2957,7 @@ tree_p make_tree_with_children(tree_param_p tree_param, prev_child_p children)
 		RESULT_INIT(&tree->children[i]);
 		result_assign(&tree->children[i], &child->child);
 	}
+	tree_set_pos_from_children(tree);
 	return tree;
 }
 
@@ -2137,6 +2971,7 @@ tree_p make_tree_with_children_of_tree(tree_param_p tree_param, tree_p list)
 		RESULT_INIT(&tree->children[i]);
 		result_assign(&tree->children[i], &list->children[i]);
 	}
+	tree_set_pos_from_children(tree);
 	return tree;
 }
 
@@ -2160,6 +2995,7 @@ bool make_tree(const result_p rule_result, void* data, result_p result)
 	prev_child_p children = CAST(prev_child_p, rule_result->data);
 	tree_param_p tree_param = (tree_param_p)data;
 	tree_p tree = make_tree_with_children(tree_param, children);
+	node_set_pos(&tree->_node, &rule_start_pos);
 	result_assign_ref_counted(result, &tree->_node._base, tree_print);
 	SET_TYPE(tree_p, tree);
 	return TRUE;
@@ -2173,6 +3009,7 @@ bool make_tree_from_list(const result_p rule_result, void* data, result_p result
 	    		   && children->child.data != 0 && node_is_tree(CAST(node_p, children->child.data), "list"))
 	    		? make_tree_with_children_of_tree(tree_param, CAST(tree_p, children->child.data))
 				: make_tree_with_children(tree_param, children);
+	node_set_pos(&tree->_node, &rule_start_pos);
 	result_assign_ref_counted(result, &tree->_node._base, tree_print);
 	SET_TYPE(tree_p, tree);
 	return TRUE;
@@ -2181,7 +3018,8 @@ bool make_tree_from_list(const result_p rule_result, void* data, result_p result
 bool pass_tree(const result_p rule_result, void* data, result_p result)
 {
 	prev_child_p child = CAST(prev_child_p, rule_result->data);
-	result_transfer(result, &child->child);
+	if (child != NULL)
+		result_transfer(result, &child->child);
 	return TRUE;
 }
 
@@ -2216,9 +3054,10 @@ struct hexa_hash_tree_t
 	} data;
 };
 
-byte *keyword_state = NULL;
+__thread byte *keyword_state = NULL;
+pthread_mutex_t ident_string_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-char *ident_string(const char *s)
+char *ident_string_unlocked(const char *s)
 /*  Returns a unique address representing the string. the global
     keyword_state will point to the integer value in the range [0..254].
 	If the string does not occure in the store, it is added and the state
@@ -2288,6 +3127,16 @@ char *ident_string(const char *s)
 	}
 }
 
+char *ident_string(const char *s)
+/*  Locks ident_string_unlocked, such that identifiers can be parsed by
+	concurrent parsers. */
+{
+	pthread_mutex_lock(&ident_string_mutex);
+	char *string = ident_string_unlocked(s);
+	pthread_mutex_unlock(&ident_string_mutex);
+	return string;
+}
+
 /*  Parsing an identifier  */
 
 /*  Data structure needed during parsing.
@@ -2660,7 +3509,7 @@ struct string_buffer
 	char buf[100];
 	string_buffer_p next;
 };
-string_buffer_p global_string_buffer = NULL;
+__thread string_buffer_p global_string_buffer = NULL;
 
 string_buffer_p new_string_buffer()
 {
@@ -3145,7 +3994,7 @@ bool not_a_keyword(result_p result, const void *argument)
 }
 
 
-const char * const list_type = "list";
+const char list_type[] = "list";
 
 bool add_seq_as_list(result_p prev, result_p seq, void *data, result_p result)
 {
@@ -3173,6 +4022,8 @@ bool add_seq_as_list(result_p prev, result_p seq, void *data, result_p result)
 #define TREE_FROM_LIST(N,F) rules->end_function = make_tree_from_list; { static tree_param_t tp = { N, F }; rules->end_function_data = &tp; }
 #define TREE_FROM_LIST_TP(N) rules->end_function = make_tree_from_list; rules->end_function_data = &N##_tp;
 #define KEYWORD(K) NTF("ident", 0) element->condition = equal_string; element->condition_argument = ident_string(K); *keyword_state = 1; WS
+/* A keyword that is only recognized in its rule and can still be used as an identifier elsewhere */
+#define CONTEXT_KEYWORD(K) NTF("ident", 0) element->condition = equal_string; element->condition_argument = ident_string(K); WS
 #define OPTN OPT(0)
 #define IDENT NTF("ident", add_child) element->condition = not_a_keyword; WS
 #define IDENT_OPT NTF("ident", add_child) element->condition = not_a_keyword; OPTN WS
@@ -3190,6 +4041,8 @@ TREE_PARAM(semi, "%*;")
 TREE_PARAM(assignment, "%* %* %*")
 TREE_PARAM(ass, "=")
 TREE_PARAM(call, "%*(%*)")
+TREE_PARAM(sub, "%* - %*")
+TREE_PARAM(statements, "%<{\n%>%*\n%<}%>")
 
 void c_grammar(non_terminal_dict_p *all_nt)
 {
@@ -3203,6 +4056,9 @@ void c_grammar(non_terminal_dict_p *all_nt)
 	
 	NT_DEF("primary_expr")
 		RULE IDENT PASS
+		RULE NT("int") CHAR('u') CHAR('s') WS TREE("time_us", "%*us")
+		RULE NT("int") CHAR('m') CHAR('s') WS TREE("time_ms", "%*ms")
+		RULE NT("int") CHAR('s') WS TREE("time_s", "%*s")
 		RULE NTP("int") WS
 		RULE NTP("double") WS
 		RULE NTP("char") WS
@@ -3324,6 +4180,23 @@ void c_grammar(non_terminal_dict_p *all_nt)
 		RULE NTP("conditional_expr")
 
 	NT_DEF("declaration")
+		RULE CHAR_WS('#') KEYWORD("include") NT("string") WS TREE("include", "#include %*\n")
+		RULE CONTEXT_KEYWORD("topic") IDENT CHAR_WS('(')
+			{ GROUPING
+				RULE NT("type_specifier") PASS
+			} SEQL("") ADD_CHILD CHAR_WS(')')
+			CHAR_WS('{')
+			{ GROUPING
+				RULE IDENT PASS
+			} SEQL(", ") { CHAIN CHAR_WS(',') } ADD_CHILD
+			CHAR_WS('}') CHAR_WS(';') TREE("topic", "topic %* (%*) { %* };\n")
+		RULE CONTEXT_KEYWORD("resource") IDENT CHAR_WS('(') NT("expr") CHAR_WS(')') CHAR_WS(';') TREE("resource", "resource %* (%*);\n")
+		RULE KEYWORD("group") IDENT KEYWORD("budget") CHAR_WS('(') NT("expr") CHAR_WS(')') KEYWORD("per") CHAR_WS('(') NT("expr") CHAR_WS(')')
+			CHAR_WS('{')
+			{ GROUPING
+				RULE IDENT PASS
+			} SEQL(", ") { CHAIN CHAR_WS(',') } ADD_CHILD
+			CHAR_WS('}') CHAR_WS(';') TREE("group", "group %* budget (%*) per (%*) { %* };\n")
 		RULE
 		{ GROUPING
 			RULE NT("storage_class_specifier") PASS
@@ -3559,12 +4432,23 @@ void c_grammar(non_terminal_dict_p *all_nt)
 		RULE KEYWORD("continue") CHAR_WS(';') TREE("cont", "continue;")
 		RULE KEYWORD("break") CHAR_WS(';') TREE("break", "break;")
 		RULE KEYWORD("return") NT("expr") OPTN CHAR_WS(';') TREE("ret", "return%*;")
-		RULE KEYWORD("queue") WS KEYWORD("for") WS NT("ident") WS NT("statement") TREE("queuefor","queue for %*\n%>%*%<")
-		RULE KEYWORD("poll") WS NT("statement")
+		RULE KEYWORD("queue") WS KEYWORD("for") WS NT("ident") WS
+		{ GROUPING
+			RULE CHAR_WS('[') NT("expr") CHAR_WS(']') TREE("index", " [%*]")
+		} OPTN ADD_CHILD NT("statement") TREE("queuefor","queue for %*%*\n%>%*%<")
+		RULE KEYWORD("poll") WS
+		{ GROUPING
+			RULE CONTEXT_KEYWORD("backoff") CHAR_WS('(') NT("expr") CHAR('.') CHAR_WS('.') NT("expr") CHAR_WS(')') TREE("backoff"," backoff (%*..%*)")
+		} OPTN ADD_CHILD NT("statement")
 		{ GROUPING
 			RULE KEYWORD("at") WS KEYWORD("most") WS CHAR_WS('(') NT("expr") CHAR_WS(')') NT("statement") TREE("atmost","\nat most (%*)\n%>%*%<\n")
-		} OPTN ADD_CHILD TREE("poll","poll\n%>%*%<%*")
+		} OPTN ADD_CHILD TREE("poll","poll%*\n%>%*%<%*")
 		RULE KEYWORD("timer") WS NT("ident") WS CHAR_WS(';') TREE("timer","timer %*;")
+		RULE CONTEXT_KEYWORD("wait")
+		{ GROUPING
+			RULE CONTEXT_KEYWORD("any") TREE("any", "any")
+			RULE CONTEXT_KEYWORD("all") TREE("all", "all")
+		} ADD_CHILD CHAR_WS('(') NT("expr") CHAR_WS(',') NT("expr") CHAR_WS(')') CHAR_WS(';') TREE("wait", "wait %* (%*, %*);")
 		RULE KEYWORD("every") WS CHAR_WS('(') NT("expr") CHAR_WS(')') KEYWORD("start") WS NT("ident") WS CHAR_WS(';') TREE("every", "every (%*) start %*;")
 
 	NT_DEF("root")
@@ -3577,1097 +4461,4298 @@ void c_grammar(non_terminal_dict_p *all_nt)
 
 
 /*
-	Fixed string output stream
-	~~~~~~~~~~~~~~~~~~~~~~~~~~
+	Grammar analysis
+	~~~~~~~~~~~~~~~~
+	With the --analyze-grammar option the grammar is inspected for
+	constructs that make the back-tracking parser slow or fail:
+	- alternatives that start with the same characters, such that the
+	  first has to fail before the second is tried,
+	- alternatives that share a common prefix, which could be factored out,
+	- sequences of elements that can be parsed without consuming input,
+	- left-recursive cycles through normal rules, which parse_nt cannot
+	  handle (only direct left-recursion with REC_RULE is supported),
+	- non-terminals that are unreachable from root or have no rules.
+	The cost of a finding is estimated as the number of elements that are
+	attempted in vain, where non-terminals are expanded a few levels deep.
 */
 
-typedef struct fixed_string_ostream fixed_string_ostream_t, *fixed_string_ostream_p;
-struct fixed_string_ostream
-{
-	ostream_t ostream;
-	char *buffer;
-	unsigned int i;
-	unsigned int len;
-};
+#define ANALYSIS_COST_DEPTH 2
+#define ANALYSIS_MIN_PREFIX 2
 
-void fixed_string_ostream_put(ostream_p ostream, char ch)
+int nr_grammar_findings = 0;
+
+void grammar_finding(FILE *fout, non_terminal_p nt, const char *fmt, ...)
 {
-	if (((fixed_string_ostream_p)ostream)->i < ((fixed_string_ostream_p)ostream)->len)
-		((fixed_string_ostream_p)ostream)->buffer[((fixed_string_ostream_p)ostream)->i++] = ch;
+	va_list arg_ptr;
+	va_start(arg_ptr, fmt);
+	fprintf(fout, "%s: ", nt->name);
+	vfprintf(fout, fmt, arg_ptr);
+	fprintf(fout, "\n");
+	va_end(arg_ptr);
+	nr_grammar_findings++;
 }
 
-void fixed_string_ostream_init(fixed_string_ostream_p ostream, char *buffer, unsigned int len)
+void char_set_union(char_set_p char_set, char_set_p other)
 {
-	ostream->ostream.put = fixed_string_ostream_put;
-	ostream->buffer = buffer;
-	ostream->i = 0;
-	ostream->len = len - 1;
+	for (int i = 0; i < 32; i++)
+		char_set->bitvec[i] |= other->bitvec[i];
 }
 
-void fixed_string_ostream_finish(fixed_string_ostream_p ostream)
+bool char_set_common(char_set_p char_set, char_set_p other, byte *ch)
 {
-	ostream->buffer[ostream->i] = '\0';
+	for (int i = 0; i < 256; i++)
+		if (char_set_contains(char_set, i) && char_set_contains(other, i))
+		{
+			*ch = i;
+			return TRUE;
+		}
+	return FALSE;
 }
 
+/*  - Functions to calculate the set of characters that elements can start with */
 
+void rules_first(rule_p rules, char_set_p first);
 
-
-void test_parse_grammar(non_terminal_dict_p *all_nt, const char *nt, const char *input, const char *exp_output)
+void element_first(element_p element, char_set_p first)
 {
-	ENTER_RESULT_CONTEXT
-
-	text_buffer_t text_buffer;
-	text_buffer_assign_string(&text_buffer, input);
-	
-	solutions_t solutions;
-	solutions_init(&solutions, &text_buffer);
-	
-	parser_t parser;
-	parser_init(&parser, &text_buffer);
-	parser.cache_hit_function = solutions_find;
-	parser.cache = &solutions;
-	
-	DECL_RESULT(result);
-	if (parse_nt(&parser, find_nt(nt, all_nt), &result) && text_buffer_end(&text_buffer))
+	switch (element->kind)
 	{
-		if (result.data == NULL)
-			fprintf(stderr, "ERROR: parsing '%s' did not return result\n", input);
-		else
-		{
-			char output[200];
-			fixed_string_ostream_t fixed_string_ostream;
-			fixed_string_ostream_init(&fixed_string_ostream, output, 200);
-			result_print(&result, &fixed_string_ostream.ostream);
-			fixed_string_ostream_finish(&fixed_string_ostream);
-			if (strcmp(output, exp_output) != 0)
-			{
-				fprintf(stderr, "ERROR: parsed value '%s' from '%s' instead of expected '%s'\n",
-						output, input, exp_output);
-			}
-			else
-				fprintf(stderr, "OK: parsed '%s' to '%s'\n", input, output);
-		}
+		case rk_nt:
+			if (element->condition == equal_string)
+				char_set_add_char(first, *(const char*)element->condition_argument);
+			else if (element->info.non_terminal->first != NULL)
+				char_set_union(first, element->info.non_terminal->first);
+			break;
+		case rk_grouping:
+			rules_first(element->info.rules, first);
+			break;
+		case rk_char:
+			char_set_add_char(first, element->info.ch);
+			break;
+		case rk_charset:
+			char_set_union(first, element->info.char_set);
+			break;
+		case rk_term:
+			char_set_add_range(first, 1, 255);
+			break;
+		case rk_end:
+			break;
 	}
-	else
+}
+
+void elements_first(element_p elements, char_set_p first)
+{
+	for (element_p element = elements; element != NULL; element = element->next)
 	{
-		fprintf(stderr, "ERROR: failed to parse ident from '%s'\n", input);
+		element_first(element, first);
+		if (!element_nullable(element))
+			break;
 	}
-	DISP_RESULT(result);
-	
-	solutions_free(&solutions);
+}
 
-	EXIT_RESULT_CONTEXT
+void rules_first(rule_p rules, char_set_p first)
+{
+	for (rule_p rule = rules; rule != NULL; rule = rule->next)
+		elements_first(rule->elements, first);
 }
 
-void test_c_grammar(non_terminal_dict_p *all_nt)
+void calculate_first(non_terminal_dict_p all_nt)
 {
-	test_parse_grammar(all_nt, "expr", "a", "list(a)");
-	test_parse_grammar(all_nt, "expr", "a*b", "list(times(a,b))");
+	for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+		if (nt_dict->elem.first == NULL)
+			nt_dict->elem.first = new_char_set();
+	for (bool changed = TRUE; changed;)
+	{
+		changed = FALSE;
+		for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+		{
+			struct char_set first = *nt_dict->elem.first;
+			rules_first(nt_dict->elem.normal, &first);
+			if (memcmp(first.bitvec, nt_dict->elem.first->bitvec, 32) != 0)
+			{
+				*nt_dict->elem.first = first;
+				changed = TRUE;
+			}
+		}
+	}
 }
 
-/*
-	File output stream
-	~~~~~~~~~~~~~~~~~~
-*/
+/*  - Functions to estimate the number of elements attempted */
 
-typedef struct file_ostream file_ostream_t, *file_ostream_p;
-struct file_ostream
-{
-	ostream_t ostream;
-	FILE *f;
-};
+long elements_cost(element_p elements, int depth);
 
-void file_ostream_put(ostream_p ostream, char ch)
+long rules_cost(rule_p rules, int depth)
 {
-	if (((file_ostream_p)ostream)->f != NULL)
-		fputc(ch, ((file_ostream_p)ostream)->f);
+	long cost = 0;
+	for (rule_p rule = rules; rule != NULL; rule = rule->next)
+		cost += elements_cost(rule->elements, depth);
+	return cost;
 }
 
-void file_ostream_init(file_ostream_p ostream, FILE *f)
+long elements_cost(element_p elements, int depth)
 {
-	ostream->ostream.put = file_ostream_put;
-	ostream->f = f;
+	long cost = 0;
+	for (element_p element = elements; element != NULL; element = element->next)
+	{
+		cost++;
+		if (element->kind == rk_nt && depth > 0)
+			cost += rules_cost(element->info.non_terminal->normal, depth - 1);
+		else if (element->kind == rk_grouping)
+			cost += rules_cost(element->info.rules, depth);
+	}
+	return cost;
 }
 
-/*
-	Expect
-*/
-
-#define MAX_EXP_SYM 200
-
-struct nt_stack
+bool elements_equal(element_p element, element_p other)
 {
-	const char *name;
-	unsigned long int ref_count;
-	text_pos_t pos;
-	nt_stack_p parent;
-};
-nt_stack_p nt_stack_allocated = NULL;
+	if (   element->kind != other->kind || element->optional != other->optional || element->sequence != other->sequence
+		|| element->condition != other->condition || element->condition_argument != other->condition_argument)
+		return FALSE;
+	switch (element->kind)
+	{
+		case rk_nt: return element->info.non_terminal == other->info.non_terminal;
+		case rk_char: return element->info.ch == other->info.ch;
+		case rk_charset: return memcmp(element->info.char_set->bitvec, other->info.char_set->bitvec, 32) == 0;
+		case rk_term: return element->info.terminal_function == other->info.terminal_function;
+		case rk_end: return TRUE;
+		default: break;
+	}
+	return FALSE;
+}
 
-nt_stack_p nt_stack_push(const char *name, parser_p parser)
+void analyze_alternatives(non_terminal_p nt, FILE *fout)
 {
-	nt_stack_p child;
-	if (nt_stack_allocated != NULL)
+	int i = 1;
+	for (rule_p rule = nt->normal; rule != NULL; rule = rule->next, i++)
 	{
-		child = nt_stack_allocated;
-		nt_stack_allocated = child->parent;
+		struct char_set first;
+		memset(first.bitvec, 0, 32);
+		elements_first(rule->elements, &first);
+		int j = i + 1;
+		for (rule_p other = rule->next; other != NULL; other = other->next, j++)
+		{
+			int prefix = 0;
+			element_p element = rule->elements;
+			for (element_p other_element = other->elements;
+				 element != NULL && other_element != NULL && elements_equal(element, other_element);
+				 element = element->next, other_element = other_element->next)
+				prefix++;
+			if (prefix >= ANALYSIS_MIN_PREFIX)
+			{
+				/* Cost of the prefix */
+				long cost = elements_cost(rule->elements, ANALYSIS_COST_DEPTH) - elements_cost(element, ANALYSIS_COST_DEPTH);
+				grammar_finding(fout, nt, "rules %d and %d share a prefix of %d elements, left factoring saves ~%ld element attempts", i, j, prefix, cost);
+				continue;
+			}
+			/* Different keywords are rejected after scanning the first identifier */
+			if (   rule->elements != NULL && other->elements != NULL
+				&& rule->elements->condition == equal_string && other->elements->condition == equal_string)
+				continue;
+			struct char_set other_first;
+			memset(other_first.bitvec, 0, 32);
+			elements_first(other->elements, &other_first);
+			byte ch;
+			if (char_set_common(&first, &other_first, &ch))
+			{
+				fprintf(fout, "%s: rules %d and %d can both start with '", nt->name, i, j);
+				if (ch > ' ' && ch < 127)
+					fprintf(fout, "%c", ch);
+				else
+					print_c_string_char(fout, ch);
+				fprintf(fout, "', back-tracking costs ~%ld element attempts\n", elements_cost(rule->elements, ANALYSIS_COST_DEPTH));
+				nr_grammar_findings++;
+			}
+		}
+	}
+}
+
+void analyze_sequences(non_terminal_p nt, rule_p rules, FILE *fout);
+
+void analyze_sequences_elements(non_terminal_p nt, element_p elements, FILE *fout)
+{
+	for (element_p element = elements; element != NULL; element = element->next)
+	{
+		if (element->sequence)
+		{
+			struct element once = *element;
+			once.optional = FALSE;
+			if (element_nullable(&once))
+			{
+				fprintf(fout, "%s: sequence of nullable element ", nt->name);
+				element_print(fout, element);
+				fprintf(fout, "can repeat without consuming input, cost unbounded\n");
+				nr_grammar_findings++;
+			}
+		}
+		if (element->kind == rk_grouping)
+			analyze_sequences(nt, element->info.rules, fout);
+		if (element->chain_rule != NULL)
+			analyze_sequences_elements(nt, element->chain_rule, fout);
+	}
+}
+
+void analyze_sequences(non_terminal_p nt, rule_p rules, FILE *fout)
+{
+	for (rule_p rule = rules; rule != NULL; rule = rule->next)
+		analyze_sequences_elements(nt, rule->elements, fout);
+}
+
+void rules_mark_reachable(rule_p rules, int mark);
+
+void elements_mark_reachable(element_p elements, int mark)
+{
+	for (element_p element = elements; element != NULL; element = element->next)
+	{
+		if (element->kind == rk_nt && element->info.non_terminal->mark != mark)
+		{
+			non_terminal_p nt = element->info.non_terminal;
+			nt->mark = mark;
+			rules_mark_reachable(nt->normal, mark);
+			rules_mark_reachable(nt->recursive, mark);
+		}
+		else if (element->kind == rk_grouping)
+			rules_mark_reachable(element->info.rules, mark);
+		if (element->chain_rule != NULL)
+			elements_mark_reachable(element->chain_rule, mark);
+	}
+}
+
+void rules_mark_reachable(rule_p rules, int mark)
+{
+	for (rule_p rule = rules; rule != NULL; rule = rule->next)
+		elements_mark_reachable(rule->elements, mark);
+}
+
+void analyze_grammar(non_terminal_dict_p all_nt, const char *root, FILE *fout)
+{
+	calculate_nullable(all_nt);
+	calculate_first(all_nt);
+
+	for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+	{
+		non_terminal_p nt = &nt_dict->elem;
+		if (nt->normal == NULL)
+		{
+			grammar_finding(fout, nt, "is used but has no rules, every attempt fails");
+			continue;
+		}
+		analyze_alternatives(nt, fout);
+		analyze_sequences(nt, nt->normal, fout);
+		analyze_sequences(nt, nt->recursive, fout);
+		nt->mark = ++nt_mark;
+		if (rules_left_reach(nt->normal, nt, nt_mark))
+			grammar_finding(fout, nt, "is left-recursive through its normal rules, which parse_nt cannot handle (use REC_RULE), parsing fails");
+	}
+
+	non_terminal_p root_nt = find_nt(root, &all_nt);
+	root_nt->mark = ++nt_mark;
+	rules_mark_reachable(root_nt->normal, nt_mark);
+	for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+		if (nt_dict->elem.mark != nt_mark)
+			grammar_finding(fout, &nt_dict->elem, "is not reachable from %s, cost of %ld elements in the grammar", root,
+							rules_cost(nt_dict->elem.normal, 0) + rules_cost(nt_dict->elem.recursive, 0));
+
+	fprintf(fout, "%d finding(s)\n", nr_grammar_findings);
+}
+
+
+/*
+	Static grammar tables
+	~~~~~~~~~~~~~~~~~~~~~
+	Building the grammar with c_grammar allocates hundreds of rules,
+	elements and character sets at every start. With the option
+	--emit-grammar-tables <file> the grammar is written as static C tables
+	with all references resolved, which can be compiled in with:
+
+	  ./tcposc --emit-grammar-tables tcposc_grammar.h
+	  gcc -DUSE_GRAMMAR_TABLES tcposc.c ... -o tcposc
+
+	The rules, elements, character sets and tree parameters are const,
+	such that they are placed in read-only memory. Only the non-terminals
+	are writable, because they hold the memoization policy and statistics.
+	Functions are written by name, using the registry below, which has to
+	be extended when a new function is used in the grammar.
+*/
+
+typedef void (*any_function_p)(void);
+
+struct
+{
+	any_function_p function;
+	const char *name;
+} grammar_functions[] =
+{
+#define GRAMMAR_FUNCTION(F) { (any_function_p)F, #F },
+	GRAMMAR_FUNCTION(add_child)
+	GRAMMAR_FUNCTION(take_child)
+	GRAMMAR_FUNCTION(rec_add_child)
+	GRAMMAR_FUNCTION(make_tree)
+	GRAMMAR_FUNCTION(make_tree_from_list)
+	GRAMMAR_FUNCTION(pass_tree)
+	GRAMMAR_FUNCTION(add_seq_as_list)
+	GRAMMAR_FUNCTION(pass_to_sequence)
+	GRAMMAR_FUNCTION(use_sequence_result)
+	GRAMMAR_FUNCTION(equal_string)
+	GRAMMAR_FUNCTION(not_a_keyword)
+	GRAMMAR_FUNCTION(ident_add_char)
+	GRAMMAR_FUNCTION(ident_set_pos)
+	GRAMMAR_FUNCTION(create_ident_tree)
+	GRAMMAR_FUNCTION(char_set_pos)
+	GRAMMAR_FUNCTION(escaped_char)
+	GRAMMAR_FUNCTION(normal_char)
+	GRAMMAR_FUNCTION(create_char_tree)
+	GRAMMAR_FUNCTION(string_set_pos)
+	GRAMMAR_FUNCTION(string_data_add_normal_char)
+	GRAMMAR_FUNCTION(string_data_add_escaped_char)
+	GRAMMAR_FUNCTION(string_data_add_first_octal)
+	GRAMMAR_FUNCTION(string_data_add_second_octal)
+	GRAMMAR_FUNCTION(string_data_add_third_octal)
+	GRAMMAR_FUNCTION(create_string_tree)
+	GRAMMAR_FUNCTION(int_set_pos)
+	GRAMMAR_FUNCTION(int_data_add_char)
+	GRAMMAR_FUNCTION(create_int_tree)
+#undef GRAMMAR_FUNCTION
+};
+
+/*  - Table to number pointers in order of appearance */
+
+typedef struct
+{
+	const void **items;
+	int nr;
+	int size;
+} pointer_table_t, *pointer_table_p;
+
+int pointer_table_index(pointer_table_p table, const void *item)
+{
+	for (int i = 0; i < table->nr; i++)
+		if (table->items[i] == item)
+			return i;
+	if (table->nr == table->size)
+	{
+		int size = table->size == 0 ? 64 : 2 * table->size;
+		const void **items = MALLOC_N(size, const void*);
+		for (int i = 0; i < table->nr; i++)
+			items[i] = table->items[i];
+		FREE(table->items);
+		table->items = items;
+		table->size = size;
+	}
+	table->items[table->nr] = item;
+	return table->nr++;
+}
+
+pointer_table_t grammar_nt_table = { NULL, 0, 0 };
+pointer_table_t grammar_rule_table = { NULL, 0, 0 };
+pointer_table_t grammar_element_table = { NULL, 0, 0 };
+pointer_table_t grammar_char_set_table = { NULL, 0, 0 };
+pointer_table_t grammar_tree_param_table = { NULL, 0, 0 };
+pointer_table_t grammar_keyword_table = { NULL, 0, 0 };
+bool grammar_tables_ok = TRUE;
+
+void collect_grammar_elements(element_p elements);
+
+void collect_grammar_rules(rule_p rules)
+{
+	for (rule_p rule = rules; rule != NULL; rule = rule->next)
+	{
+		pointer_table_index(&grammar_rule_table, rule);
+		if (rule->end_function_data != NULL)
+			pointer_table_index(&grammar_tree_param_table, rule->end_function_data);
+		collect_grammar_elements(rule->elements);
+	}
+}
+
+void collect_grammar_elements(element_p elements)
+{
+	for (element_p element = elements; element != NULL; element = element->next)
+	{
+		pointer_table_index(&grammar_element_table, element);
+		if (element->kind == rk_charset)
+			pointer_table_index(&grammar_char_set_table, element->info.char_set);
+		else if (element->kind == rk_grouping)
+			collect_grammar_rules(element->info.rules);
+		if (element->condition == equal_string)
+		{
+			/* Only keywords, not context keywords */
+			ident_string(element->condition_argument);
+			if (*keyword_state == 1)
+				pointer_table_index(&grammar_keyword_table, element->condition_argument);
+		}
+		if (element->add_seq_function_data != NULL)
+			pointer_table_index(&grammar_tree_param_table, element->add_seq_function_data);
+		if (element->chain_rule != NULL)
+			collect_grammar_elements(element->chain_rule);
+	}
+}
+
+void emit_grammar_function(FILE *f, const char *field, any_function_p function)
+{
+	if (function == NULL)
+		return;
+	for (int i = 0; i < sizeof(grammar_functions)/sizeof(grammar_functions[0]); i++)
+		if (grammar_functions[i].function == function)
+		{
+			fprintf(f, ", .%s = %s", field, grammar_functions[i].name);
+			return;
+		}
+	fprintf(stderr, "ERROR: function for %s is not in grammar_functions\n", field);
+	grammar_tables_ok = FALSE;
+}
+
+void emit_grammar_ref(FILE *f, const char *field, const char *type, const char *table_name, pointer_table_p table, const void *item)
+{
+	if (item != NULL)
+		fprintf(f, ", .%s = (%s)&%s[%d]", field, type, table_name, pointer_table_index(table, item));
+}
+
+void emit_grammar_char(FILE *f, char ch, char quote)
+{
+	switch (ch)
+	{
+		case '\0': fprintf(f, "\\0"); break;
+		case '\n': fprintf(f, "\\n"); break;
+		case '\r': fprintf(f, "\\r"); break;
+		case '\t': fprintf(f, "\\t"); break;
+		case '\\': fprintf(f, "\\\\"); break;
+		default:
+			if (ch == quote)
+				fprintf(f, "\\%c", ch);
+			else if ((byte)ch < ' ' || (byte)ch >= 127)
+				fprintf(f, "\\%03o", (byte)ch);
+			else
+				fprintf(f, "%c", ch);
+	}
+}
+
+void emit_grammar_string(FILE *f, const char *s)
+{
+	fprintf(f, "\"");
+	for (; *s != '\0'; s++)
+		emit_grammar_char(f, *s, '"');
+	fprintf(f, "\"");
+}
+
+void emit_grammar_rule(FILE *f, rule_p rule)
+{
+	if (rule->elements == NULL)
+		fprintf(f, "\t{ .elements = NULL");
+	else
+		fprintf(f, "\t{ .elements = (element_p)&grammar_elements[%d]", pointer_table_index(&grammar_element_table, rule->elements));
+	emit_grammar_function(f, "end_function", (any_function_p)rule->end_function);
+	emit_grammar_ref(f, "end_function_data", "void*", "grammar_tree_params", &grammar_tree_param_table, rule->end_function_data);
+	emit_grammar_function(f, "rec_start_function", (any_function_p)rule->rec_start_function);
+	emit_grammar_ref(f, "next", "rule_p", "grammar_rules", &grammar_rule_table, rule->next);
+	fprintf(f, " },\n");
+}
+
+void emit_grammar_element(FILE *f, element_p element)
+{
+	static const char *kind_names[] = { "rk_nt", "rk_grouping", "rk_char", "rk_charset", "rk_end", "rk_term" };
+	fprintf(f, "\t{ .kind = %s", kind_names[element->kind]);
+	if (element->optional)
+		fprintf(f, ", .optional = TRUE");
+	if (element->sequence)
+		fprintf(f, ", .sequence = TRUE");
+	if (element->back_tracking)
+		fprintf(f, ", .back_tracking = TRUE");
+	if (element->avoid)
+		fprintf(f, ", .avoid = TRUE");
+	emit_grammar_ref(f, "chain_rule", "element_p", "grammar_elements", &grammar_element_table, element->chain_rule);
+	switch (element->kind)
+	{
+		case rk_nt:
+			fprintf(f, ", .info.non_terminal = &grammar_nts[%d].elem", element->info.non_terminal->id);
+			break;
+		case rk_grouping:
+			emit_grammar_ref(f, "info.rules", "rule_p", "grammar_rules", &grammar_rule_table, element->info.rules);
+			break;
+		case rk_char:
+			fprintf(f, ", .info.ch = '");
+			emit_grammar_char(f, element->info.ch, '\'');
+			fprintf(f, "'");
+			break;
+		case rk_charset:
+			emit_grammar_ref(f, "info.char_set", "char_set_p", "grammar_char_sets", &grammar_char_set_table, element->info.char_set);
+			break;
+		case rk_term:
+			emit_grammar_function(f, "info.terminal_function", (any_function_p)element->info.terminal_function);
+			break;
+		case rk_end:
+			break;
+	}
+	emit_grammar_function(f, "add_char_function", (any_function_p)element->add_char_function);
+	emit_grammar_function(f, "condition", (any_function_p)element->condition);
+	if (element->condition == equal_string)
+	{
+		fprintf(f, ", .condition_argument = ");
+		emit_grammar_string(f, (const char*)element->condition_argument);
+	}
+	else if (element->condition_argument != NULL)
+	{
+		fprintf(stderr, "ERROR: unsupported condition argument\n");
+		grammar_tables_ok = FALSE;
+	}
+	emit_grammar_function(f, "add_function", (any_function_p)element->add_function);
+	emit_grammar_function(f, "add_skip_function", (any_function_p)element->add_skip_function);
+	emit_grammar_function(f, "begin_seq_function", (any_function_p)element->begin_seq_function);
+	emit_grammar_function(f, "add_seq_function", (any_function_p)element->add_seq_function);
+	emit_grammar_ref(f, "add_seq_function_data", "void*", "grammar_tree_params", &grammar_tree_param_table, element->add_seq_function_data);
+	emit_grammar_function(f, "set_pos", (any_function_p)element->set_pos);
+	emit_grammar_ref(f, "next", "element_p", "grammar_elements", &grammar_element_table, element->next);
+	fprintf(f, " },\n");
+}
+
+bool emit_grammar_tables(const char *file_name, non_terminal_dict_p all_nt)
+{
+	for (non_terminal_dict_p nt_dict = all_nt; nt_dict != NULL; nt_dict = nt_dict->next)
+	{
+		pointer_table_index(&grammar_nt_table, &nt_dict->elem);
+		collect_grammar_rules(nt_dict->elem.normal);
+		collect_grammar_rules(nt_dict->elem.recursive);
+	}
+
+	FILE *f = fopen(file_name, "w");
+	if (f == NULL)
+		return FALSE;
+
+	fprintf(f, "/* Grammar tables generated by tcposc --emit-grammar-tables. Do not edit. */\n\n");
+	fprintf(f, "static struct non_terminal_dict grammar_nts[%d];\n", grammar_nt_table.nr);
+	fprintf(f, "static const struct rule grammar_rules[%d];\n", grammar_rule_table.nr);
+	fprintf(f, "static const struct element grammar_elements[%d];\n\n", grammar_element_table.nr);
+
+	fprintf(f, "static const struct char_set grammar_char_sets[%d] =\n{\n", grammar_char_set_table.nr);
+	for (int i = 0; i < grammar_char_set_table.nr; i++)
+	{
+		const struct char_set *char_set = (const struct char_set*)grammar_char_set_table.items[i];
+		fprintf(f, "\t{{");
+		for (int j = 0; j < 32; j++)
+			fprintf(f, "%s0x%02x", j == 0 ? " " : ",", char_set->bitvec[j]);
+		fprintf(f, " }},\n");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static const tree_param_t grammar_tree_params[%d] =\n{\n", grammar_tree_param_table.nr);
+	for (int i = 0; i < grammar_tree_param_table.nr; i++)
+	{
+		const tree_param_t *tree_param = (const tree_param_t*)grammar_tree_param_table.items[i];
+		fprintf(f, "\t{ ");
+		if (tree_param->name == list_type)
+			fprintf(f, "list_type");
+		else
+			emit_grammar_string(f, tree_param->name);
+		fprintf(f, ", ");
+		emit_grammar_string(f, tree_param->fmt);
+		fprintf(f, " },\n");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static struct non_terminal_dict grammar_nts[%d] =\n{\n", grammar_nt_table.nr);
+	for (int i = 0; i < grammar_nt_table.nr; i++)
+	{
+		non_terminal_p nt = (non_terminal_p)grammar_nt_table.items[i];
+		fprintf(f, "\t{ { .name = \"%s\", .id = %d, .memo = %s", nt->name, nt->id,
+				nt->memo == memo_always ? "memo_always" : nt->memo == memo_never ? "memo_never" : "memo_auto");
+		emit_grammar_ref(f, "normal", "rule_p", "grammar_rules", &grammar_rule_table, nt->normal);
+		emit_grammar_ref(f, "recursive", "rule_p", "grammar_rules", &grammar_rule_table, nt->recursive);
+		fprintf(f, " }, %s", i + 1 < grammar_nt_table.nr ? "" : "NULL },\n");
+		if (i + 1 < grammar_nt_table.nr)
+			fprintf(f, "&grammar_nts[%d] },\n", i + 1);
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static const struct rule grammar_rules[%d] =\n{\n", grammar_rule_table.nr);
+	for (int i = 0; i < grammar_rule_table.nr; i++)
+		emit_grammar_rule(f, (rule_p)grammar_rule_table.items[i]);
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static const struct element grammar_elements[%d] =\n{\n", grammar_element_table.nr);
+	for (int i = 0; i < grammar_element_table.nr; i++)
+		emit_grammar_element(f, (element_p)grammar_element_table.items[i]);
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static const char *grammar_keywords[%d] =\n{\n", grammar_keyword_table.nr);
+	for (int i = 0; i < grammar_keyword_table.nr; i++)
+	{
+		fprintf(f, "\t");
+		emit_grammar_string(f, (const char*)grammar_keyword_table.items[i]);
+		fprintf(f, ",\n");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "non_terminal_dict_p grammar_tables_init(void)\n{\n");
+	fprintf(f, "\tfor (int i = 0; i < %d; i++)\n", grammar_keyword_table.nr);
+	fprintf(f, "\t{\n\t\tident_string(grammar_keywords[i]);\n\t\t*keyword_state = 1;\n\t}\n");
+	fprintf(f, "\treturn &grammar_nts[0];\n}\n");
+	fclose(f);
+	return grammar_tables_ok;
+}
+
+
+/*
+	Fixed string output stream
+	~~~~~~~~~~~~~~~~~~~~~~~~~~
+*/
+
+typedef struct fixed_string_ostream fixed_string_ostream_t, *fixed_string_ostream_p;
+struct fixed_string_ostream
+{
+	ostream_t ostream;
+	char *buffer;
+	unsigned int i;
+	unsigned int len;
+};
+
+void fixed_string_ostream_put(ostream_p ostream, char ch)
+{
+	if (((fixed_string_ostream_p)ostream)->i < ((fixed_string_ostream_p)ostream)->len)
+		((fixed_string_ostream_p)ostream)->buffer[((fixed_string_ostream_p)ostream)->i++] = ch;
+}
+
+void fixed_string_ostream_init(fixed_string_ostream_p ostream, char *buffer, unsigned int len)
+{
+	ostream->ostream.put = fixed_string_ostream_put;
+	ostream->buffer = buffer;
+	ostream->i = 0;
+	ostream->len = len - 1;
+}
+
+void fixed_string_ostream_finish(fixed_string_ostream_p ostream)
+{
+	ostream->buffer[ostream->i] = '\0';
+}
+
+
+
+
+void test_parse_grammar(non_terminal_dict_p *all_nt, const char *nt, const char *input, const char *exp_output)
+{
+	ENTER_RESULT_CONTEXT
+
+	text_buffer_t text_buffer;
+	text_buffer_assign_string(&text_buffer, input);
+	
+	solutions_t solutions;
+	solutions_init(&solutions, &text_buffer);
+	
+	parser_t parser;
+	parser_init(&parser, &text_buffer);
+	parser.cache_hit_function = solutions_find;
+	parser.cache = &solutions;
+	
+	DECL_RESULT(result);
+	if (parse_nt(&parser, find_nt(nt, all_nt), &result) && text_buffer_end(&text_buffer))
+	{
+		if (result.data == NULL)
+			fprintf(stderr, "ERROR: parsing '%s' did not return result\n", input);
+		else
+		{
+			char output[200];
+			fixed_string_ostream_t fixed_string_ostream;
+			fixed_string_ostream_init(&fixed_string_ostream, output, 200);
+			result_print(&result, &fixed_string_ostream.ostream);
+			fixed_string_ostream_finish(&fixed_string_ostream);
+			if (strcmp(output, exp_output) != 0)
+			{
+				fprintf(stderr, "ERROR: parsed value '%s' from '%s' instead of expected '%s'\n",
+						output, input, exp_output);
+			}
+			else
+				fprintf(stderr, "OK: parsed '%s' to '%s'\n", input, output);
+		}
+	}
+	else
+	{
+		fprintf(stderr, "ERROR: failed to parse ident from '%s'\n", input);
+	}
+	DISP_RESULT(result);
+	
+	solutions_free(&solutions);
+
+	EXIT_RESULT_CONTEXT
+}
+
+void test_c_grammar(non_terminal_dict_p *all_nt)
+{
+	test_parse_grammar(all_nt, "expr", "a", "list(a)");
+	test_parse_grammar(all_nt, "expr", "a*b", "list(times(a,b))");
+}
+
+/*
+	File output stream
+	~~~~~~~~~~~~~~~~~~
+*/
+
+typedef struct file_ostream file_ostream_t, *file_ostream_p;
+struct file_ostream
+{
+	ostream_t ostream;
+	FILE *f;
+};
+
+void file_ostream_put(ostream_p ostream, char ch)
+{
+	if (((file_ostream_p)ostream)->f != NULL)
+		fputc(ch, ((file_ostream_p)ostream)->f);
+}
+
+void file_ostream_init(file_ostream_p ostream, FILE *f)
+{
+	ostream->ostream.put = file_ostream_put;
+	ostream->f = f;
+}
+
+/*
+	Expect
+*/
+
+#define MAX_EXP_SYM 200
+
+struct nt_stack
+{
+	const char *name;
+	unsigned long int ref_count;
+	text_pos_t pos;
+	nt_stack_p parent;
+};
+
+nt_stack_p nt_stack_push(const char *name, parser_p parser)
+{
+	nt_stack_p child = MALLOC(struct nt_stack);
+	ALLOC_TYPE_NEW(at_nt_stack)
+	child->name = name;
+	child->ref_count = 1;
+	child->pos = parser->text_buffer->pos;
+	child->parent = parser->nt_stack;
+	if (parser->nt_stack != 0)
+		parser->nt_stack->ref_count++;
+	//DEBUG_TAB; DEBUG_P1("push %s\n", child->name);
+	return child;
+}
+
+void nt_stack_dispose(nt_stack_p nt_stack)
+{
+	while (nt_stack != NULL && --nt_stack->ref_count == 0)
+	{
+		nt_stack_p parent = nt_stack->parent;
+		FREE(nt_stack);
+		ALLOC_TYPE_RELEASE(at_nt_stack)
+		nt_stack = parent;
+	}
+}
+
+nt_stack_p nt_stack_pop(nt_stack_p cur)
+{
+	//DEBUG_TAB; DEBUG_P1("pop %s\n", cur == NULL ? "<NULL>" : cur->name);
+	nt_stack_p parent = cur->parent;
+	nt_stack_dispose(cur);
+	return parent;
+}
+
+__thread text_pos_t highest_pos;
+typedef struct
+{
+	nt_stack_p nt_stack;
+	element_p element;
+} expect_t;
+__thread expect_t expected[MAX_EXP_SYM];
+__thread int nr_expected;
+
+void init_expected()
+{
+	highest_pos.pos = 0;
+	nr_expected = 0;
+}
+
+void expect_element(parser_p parser, element_p element)
+{
+	if (parser->text_buffer->pos.pos < highest_pos.pos) return;
+	
+	if (parser->text_buffer->pos.pos > highest_pos.pos)
+	{
+		highest_pos = parser->text_buffer->pos;
+		//for (int i = 0; i < nr_expected; i++)
+		//	nt_stack_dispose(expected[i].nt_stack);
+		nr_expected = 0;
+	}
+	for (int i = 0; i < nr_expected; i++)
+		if (expected[i].nt_stack == parser->nt_stack && expected[i].element == element)
+			return;
+	if (nr_expected < MAX_EXP_SYM)
+	{
+		parser->nt_stack->ref_count++;
+		expected[nr_expected].nt_stack = parser->nt_stack;
+		expected[nr_expected].element = element;
+		nr_expected++;
+	}
+}
+
+
+
+void print_expected(FILE *fout)
+{
+	fprintf(fout, "Expect at %d.%d:\n", highest_pos.cur_line, highest_pos.cur_column);
+	for (int i = 0; i < nr_expected; i++)
+	{
+		element_p element = expected[i].element;
+		fprintf(fout, "- expect ");
+		element_print(fout, element);
+		for (nt_stack_p nt_stack = expected[i].nt_stack; nt_stack != NULL; nt_stack = nt_stack->parent)
+			fprintf(fout, " in %s at %d.%d", nt_stack->name, nt_stack->pos.cur_line, nt_stack->pos.cur_column);
+		fprintf(fout, "\n");
+	}
+}
+
+int indent = 0;
+bool start_line = FALSE;
+bool need_sp = FALSE;
+
+void unparse_nl(ostream_p ostream)
+{
+	if (start_line)
+	{
+		ostream_put(ostream, '\n');
+		for (int i = 0; i < indent; i++)
+			ostream_puts(ostream, "    ");
+		start_line = FALSE;
+		need_sp = FALSE;
+	}
+}
+
+void unparse(result_p result, ostream_p ostream)
+{
+	if (result->data == NULL)
+		; //ostream_puts(ostream, "[NULL]");
+	else
+	{
+		node_p node = CAST(node_p, result->data);
+		if (node->type_name == tree_node_type)
+		{
+			tree_p tree = (tree_p)node;
+			if (tree->tree_param == NULL)
+				ostream_puts(ostream, "[tree_param NULL]");
+			else if (tree->tree_param->name == list_type)
+			{
+				for (int i = 0; i < tree->nr_children; i++)
+				{
+					if (i > 0 && tree->tree_param->fmt[0] != '\0')
+					{
+						ostream_puts(ostream, tree->tree_param->fmt);
+						need_sp = FALSE;
+					}
+					unparse(&tree->children[i], ostream);
+				}
+			}
+			else
+			{
+				int i = 0;
+				bool is_alphanum = FALSE;
+				for (const char *s = tree->tree_param->fmt; *s != '\0'; s++)
+					if (*s == '%')
+					{
+						if (s[1] == '*')
+						{
+							if (is_alphanum)
+							{
+								need_sp = TRUE;
+								is_alphanum = FALSE;
+							}
+							if (i < tree->nr_children)
+								unparse(&tree->children[i++], ostream);
+							else
+							{
+								ostream_puts(ostream, "(ERR1:");
+								ostream_puts(ostream, tree->tree_param->name);
+								ostream_puts(ostream, " ");
+								ostream_puts(ostream, tree->tree_param->fmt);
+								ostream_puts(ostream, ")");
+							}
+							s++;
+						}
+						else if (s[1] == '%')
+						{
+							ostream_put(ostream, '%');
+							s++;
+						}
+						else if (s[1] == '<')
+						{
+							//ostream_puts(ostream, "[-]");
+							indent--;
+							s++;
+						}
+						else if (s[1] == '>')
+						{
+							//ostream_puts(ostream, "[+]");
+							indent++;
+							s++;
+						}
+						else
+						{
+							ostream_puts(ostream, "[ERR3:");
+							ostream_put(ostream, s[1]);
+							ostream_put(ostream, ']');
+						}
+					}
+					else if (*s == '\n')
+					{
+						if (start_line)
+							ostream_put(ostream, '\n');
+						start_line = TRUE;
+						need_sp = FALSE;
+						is_alphanum = FALSE;
+					}
+					else
+					{
+						unparse_nl(ostream);
+						is_alphanum = ('a' <= *s && *s <= 'z') || ('A' <= *s && *s <= 'Z') || ('0' <= *s && *s <= '9') || *s == '_';
+						if (need_sp && is_alphanum)
+							ostream_put(ostream, ' ');
+						ostream_put(ostream, *s);
+						need_sp = FALSE;
+					}
+				if (is_alphanum)
+					need_sp = TRUE;
+				if (i < tree->nr_children)
+				{
+					ostream_puts(ostream, "(ERR2:");
+					ostream_puts(ostream, tree->tree_param->name);
+					ostream_puts(ostream, " ");
+					ostream_puts(ostream, tree->tree_param->fmt);
+					ostream_puts(ostream, ")");
+				}
+			}
+		}
+		else if (result->print != NULL)
+		{
+			unparse_nl(ostream);
+			if (need_sp)
+				ostream_put(ostream, ' ');
+			result->print(result->data, ostream);
+			need_sp = TRUE;
+		}
+		else
+		{
+			ostream_puts(ostream, "(type_name:");
+			ostream_puts(ostream, node->type_name);
+			ostream_puts(ostream, ")");
+		}
+			
+	//if (result->print == 0 || result->data == NULL)
+	//	ostream_puts(ostream, "<>");
+	}
+}
+
+
+
+typedef struct result_list *result_list_p;
+struct result_list
+{
+	ref_counted_base_t _base;
+	result_t value;
+	result_t next;
+};
+
+DEFINE_BASE_TYPE(result_list_p)
+
+void result_list_release(void *data)
+{
+	result_list_p result_list = CAST(result_list_p, data);
+	RESULT_RELEASE(&result_list->value);
+	RESULT_RELEASE(&result_list->next);
+	FREE(result_list);
+	ALLOC_TYPE_RELEASE(at_result_list)
+}
+
+void result_list_init(result_list_p result_list)
+{
+	result_list->_base.cnt = 1;
+	result_list->_base.release = result_list_release;
+	RESULT_INIT(&result_list->value);
+	RESULT_INIT(&result_list->next);
+}
+
+result_list_p malloc_result_list(void)
+{
+	result_list_p result_list = MALLOC(struct result_list);
+	ALLOC_TYPE_NEW(at_result_list)
+	result_list_init(result_list);
+	return result_list;
+}
+
+void result_list_print(void *data, ostream_p ostream)
+{
+	result_list_p result_list = CAST(result_list_p, data);
+	if (result_list != NULL)
+	{
+		if (result_list->value.data == NULL || result_list->value.print == NULL)
+			ostream_puts(ostream, "NULL");
+		else
+			result_list->value.print(result_list->value.data, ostream);
+		if (result_list->next.data == NULL || result_list->next.print == NULL)
+			ostream_puts(ostream, "NULL");
+		else
+		{
+			ostream_puts(ostream, ",\n");
+			result_list->next.print(result_list->next.data, ostream);
+		}
+	}
+}
+
+void make_result_list(const result_p result, result_p value, result_p next)
+{
+	result_list_p result_list = malloc_result_list();
+	result_assign(&result_list->value, value);
+	result_assign(&result_list->next, next);
+	result_assign_ref_counted(result, &result_list->_base, result_list_print);
+	SET_TYPE(result_list_p, result_list);
+}	
+
+
+// ----------------------------------------------------------------------------------------
+
+
+
+char *strprintf(const char *fmt, ...)
+{
+	va_list arg_ptr;
+	va_start(arg_ptr, fmt);
+	static char buffer[1000];
+	vsnprintf(buffer, 999, fmt, arg_ptr);
+	va_end(arg_ptr);
+	buffer[999] = '\0';
+	char *str = (char *)malloc(strlen(buffer) + 1);
+	strcpy(str, buffer);
+	return str;
+}
+
+void ostream_printf(ostream_p ostream, const char *fmt, ...)
+{
+	va_list arg_ptr;
+	va_start(arg_ptr, fmt);
+	char buffer[1000];
+	vsnprintf(buffer, 999, fmt, arg_ptr);
+	va_end(arg_ptr);
+	buffer[999] = '\0';
+	ostream_puts(ostream, buffer);
+}
+
+/*  Errors in the input are reported with the position of the node. They
+	are counted, such that tcposc exits with a non-zero status. */
+
+int nr_errors = 0;
+
+void compile_error(node_p node, const char *fmt, ...)
+{
+	va_list arg_ptr;
+	va_start(arg_ptr, fmt);
+	fprintf(stderr, "%u.%u: ", node->line, node->column);
+	vfprintf(stderr, fmt, arg_ptr);
+	fprintf(stderr, "\n");
+	va_end(arg_ptr);
+	nr_errors++;
+}
+
+typedef struct tree_list *tree_list_p;
+struct tree_list
+{
+	tree_p tree;
+	tree_list_p next;
+};
+
+tree_list_p new_result_list(tree_p tree)
+{
+	tree_list_p tree_list = MALLOC(struct tree_list);
+	tree_list->tree = tree;
+	tree_list->next = NULL;
+	return tree_list;
+}
+
+typedef struct tree_iterator tree_iterator_t, *tree_iterator_p;
+struct tree_iterator
+{
+	const char *name;
+	int nr_children;
+	result_t *children;
+};
+
+node_p tree_child_node(tree_p tree, int nr)
+{
+	result_p result = tree_child(tree, nr);
+	return result != NULL ? CAST(node_p, result->data) : NULL;
+}
+
+tree_p tree_of_result(result_p result)
+{
+	if (result != NULL && result->data != NULL)
+	{
+		node_p node = CAST(node_p, result->data);
+		if (node->type_name == tree_node_type)
+			return CAST(tree_p, node);
+	}
+	return NULL;
+}
+
+tree_p tree_child_tree(tree_p tree, int nr) { return tree_of_result(tree_child(tree, nr)); }
+
+tree_p list_of_result(result_p result)
+{
+	if (result != NULL && result->data != NULL)
+	{
+		node_p node = CAST(node_p, result->data);
+		if (node->type_name == tree_node_type)
+		{
+			tree_p tree = CAST(tree_p, node);
+			return tree->tree_param->name == list_type ? tree : NULL;
+		}
+	}
+	return NULL;
+}
+
+tree_p tree_child_list(tree_p tree, int nr) { return list_of_result(tree_child(tree, nr)); }
+
+void tree_iterator_init(tree_iterator_p tree_iterator, result_p result)
+{
+	tree_iterator->name = "";
+	tree_iterator->nr_children = 0;
+	tree_p tree = tree_of_result(result);
+	if (tree != NULL)
+	{
+		tree_iterator->name = tree->tree_param->name;
+		tree_iterator->nr_children = tree->nr_children;
+		tree_iterator->children = tree->children;
+	}
+}
+#define TREE_ITERATOR(N,R) tree_iterator_t N; tree_iterator_init(&N, R)
+#define ITERATOR_TREE(C,I,N) tree_p C = tree_of_result(&I.children[N]);
+
+node_p node_of_result(result_p result)
+{
+	return result != 0 && result->data != 0 ? CAST(node_p, result->data) : NULL;
+}
+
+const char *tree_name(result_p result)
+{
+	if (result == 0)
+		return "<result_p is NULL>";
+	if (result->data == 0)
+		return "<result_p->data is NULL>";
+	node_p node = CAST(node_p, result->data);
+	if (node->type_name == ident_node_type)
+		return CAST(ident_node_p, node)->name;
+	if (node->type_name == tree_node_type)
+	{
+		tree_p tree = CAST(tree_p, node);
+		if (tree->tree_param == NULL || tree->tree_param->name == NULL)
+			return "<result->data->tree_param == NULL>";
+		return tree->tree_param->name;
+	}
+	return "<result_p->data has no name>";
+}
+
+void node_print(void *data, ostream_p ostream)
+{
+	node_p tree = CAST(node_p, data);
+	if (tree->type_name == ident_node_type)
+		ident_print(data, ostream);
+	else if (tree->type_name == char_node_type)
+		char_node_print(data, ostream);
+	else if (tree->type_name == string_node_type)
+		string_node_print(data, ostream);
+	else if (tree->type_name == int_node_type)
+		int_node_print(data, ostream);
+	else if (tree->type_name == tree_node_type)
+		tree_print(data, ostream);
+}
+
+node_p make_tree_for(tree_param_p tree_param, int nr, ...)
+{
+	tree_p tree = malloc_tree(tree_param);
+	tree->nr_children = nr;
+	va_list args;
+	va_start(args, nr);
+	tree->children = MALLOC_N(nr, result_t);
+	for (int i = 0; i < nr; i++)
+	{
+		RESULT_INIT(&tree->children[i]);
+		node_p node = va_arg(args, node_p);
+		//fprintf(stderr, "arg %d: %p\n", i, node);
+		
+		if (node != NULL)
+			result_assign_ref_counted(&tree->children[i], &node->_base, node_print);
+	}
+	va_end(args);
+	SET_TYPE(tree_p, tree);
+	//fprintf(stderr, "make_tree_for returns %p\n", &tree->_node);
+	return &tree->_node;
+}
+
+node_p make_ident_node(const char *name)
+{
+	ident_node_p ident = MALLOC(struct ident_node_t);
+	init_node(&ident->_node, ident_node_type, NULL);
+	ident->name = ident_string(name);
+	SET_TYPE(ident_node_p, ident);
+	return &ident->_node;
+}
+
+void replace_child_node(result_p child, node_p node)
+{
+	RESULT_RELEASE(child);
+	result_assign_ref_counted(child, &node->_base, node_print);
+}
+
+node_p copy_node(node_p node)
+/*  Returns a copy of the tree, in which the trees and the identifiers,
+	which are changed by the compiler, are copied, and the other nodes
+	are shared */
+{
+	if (node->type_name == ident_node_type)
+	{
+		ident_node_p ident = CAST(ident_node_p, node);
+		ident_node_p copy = MALLOC(struct ident_node_t);
+		init_node(&copy->_node, ident_node_type, NULL);
+		copy->_node.line = node->line;
+		copy->_node.column = node->column;
+		copy->_node.file = node->file;
+		copy->name = ident->name;
+		copy->is_keyword = ident->is_keyword;
+		SET_TYPE(ident_node_p, copy);
+		return &copy->_node;
+	}
+	tree_p tree = CAST(tree_p, node);
+	tree_p copy = malloc_tree(tree->tree_param);
+	copy->_node.line = node->line;
+	copy->_node.column = node->column;
+	copy->_node.file = node->file;
+	copy->nr_children = tree->nr_children;
+	copy->children = tree->nr_children > 0 ? MALLOC_N(tree->nr_children, result_t) : NULL;
+	for (int i = 0; i < tree->nr_children; i++)
+	{
+		RESULT_INIT(&copy->children[i]);
+		node_p child = node_of_result(&tree->children[i]);
+		if (child != NULL && (child->type_name == tree_node_type || child->type_name == ident_node_type))
+			result_assign_ref_counted(&copy->children[i], &copy_node(child)->_base, tree->children[i].print);
+		else
+			result_assign(&copy->children[i], &tree->children[i]);
+	}
+	SET_TYPE(tree_p, copy);
+	return &copy->_node;
+}
+
+void set_node_file(node_p node, const char *file)
+/*  Sets the file of the node and all nodes below it */
+{
+	if (node == NULL)
+		return;
+	node->file = file;
+	if (node->type_name == tree_node_type)
+	{
+		tree_p tree = CAST(tree_p, node);
+		for (int i = 0; i < tree->nr_children; i++)
+			set_node_file(node_of_result(&tree->children[i]), file);
+	}
+}
+
+node_p make_int_node(int value)
+{
+	int_node_p int_node = MALLOC(struct int_node_t);
+	init_node(&int_node->_node, int_node_type, NULL);
+	int_node->value = value;
+	SET_TYPE(int_node_p, int_node);
+	return &int_node->_node;
+}
+
+#define MAX_STEP_PARAMS 4
+
+typedef struct task_func *task_func_p;
+struct task_func
+{
+	const char *name;
+	result_t statement_trace;
+	task_func_p shared_with;                /* Step with the same body (and continuation) */
+	int nr_params;                          /* Number of entries in the per-task data table */
+	node_p params[MAX_STEP_PARAMS];         /* Leaves that differ from those of shared_with */
+	bool by_address[MAX_STEP_PARAMS];       /* Whether the step writes the parameter */
+	task_func_p next;
+};
+
+typedef struct task *task_p;
+struct task
+{
+	char *name;
+	int nr;
+	char *result_var_name;
+	int nr_local_vars;
+	struct var_context *local_vars;
+	struct var_context **ref_next_local_var;
+	int nr_funcs;
+	task_func_p task_funcs;
+	task_func_p *ref_next_task_func;
+	struct task_group *group;
+	node_p body;
+	long cost;             /* Estimated cost of the first step, when the body has been released */
+	task_p next;
+};
+task_p tasks = NULL;
+task_p *ref_next_task = &tasks;
+int nr_tasks = 0;
+
+/* The sizes of the tables of the runtime, which should be equal to those
+   in TinyCoPoOS.c. The last task ids are used as the sentinels of the
+   queues other than the main queue (see QUEUE_SENTINEL), and the one
+   before them for the timers (see TIMER_TASK), and are not given to
+   tasks. */
+#define NR_TASKS 100
+#define NR_QUEUES 10
+#define MAX_TASK_ID (NR_TASKS - NR_QUEUES - 1)
+#define NR_TASK_GROUPS 4
+
+task_p cur_task = NULL;
+
+task_p add_task(char *name)
+{
+	task_p task = MALLOC(struct task);
+	task->name = name;
+	task->nr = ++nr_tasks; /* Task 0 is reserved for 'no task' */
+	task->result_var_name = NULL;
+	task->nr_local_vars = 0;
+	task->local_vars = NULL;
+	task->ref_next_local_var = &task->local_vars;
+	task->nr_funcs = 0;
+	task->task_funcs = NULL;
+	task->ref_next_task_func = &task->task_funcs;
+	task->group = NULL;
+	task->body = NULL;
+	task->cost = 0;
+	task->next = NULL;
+	*ref_next_task = task;
+	ref_next_task = &task->next;
+	return task;
+}
+
+void add_task_func(result_p statement_trace)
+{
+	task_func_p task_func = MALLOC(struct task_func);
+	task_func->name = strprintf("%s_step%d", cur_task->name, ++cur_task->nr_funcs);
+	RESULT_INIT(&task_func->statement_trace);
+	task_func->shared_with = NULL;
+	task_func->nr_params = 0;
+	for (int i = 0; i < MAX_STEP_PARAMS; i++)
+	{
+		task_func->params[i] = NULL;
+		task_func->by_address[i] = FALSE;
+	}
+	task_func->next = NULL;
+	result_assign(&task_func->statement_trace, statement_trace);
+	*cur_task->ref_next_task_func = task_func;
+	cur_task->ref_next_task_func = &task_func->next;
+}
+
+task_func_p find_task_func(result_p statement)
+{
+	for (task_func_p task_func = cur_task->task_funcs; task_func != NULL; task_func = task_func->next)
+		if (CAST(result_list_p, task_func->statement_trace.data)->value.data == statement->data)
+			return task_func;
+	return NULL;
+}
+
+task_p find_task(const char *name)
+{
+	for (task_p task = tasks; task != NULL; task = task->next)
+		if (strcmp(task->name, name) == 0)
+			return task;
+	return NULL;
+}
+
+typedef struct var_context *var_context_p;
+struct var_context
+{
+	char *name;
+	char *global_name;
+	tree_p type;
+	node_p decl_node;
+	int decl_step;         /* Step in which the variable is declared */
+	int last_step;         /* Last step in which the variable is used */
+	bool is_array;
+	int nr_elements;       /* Of an array, 1 for a scalar, 0 if unknown */
+	int scratch_offset;    /* Offset in the scratch arena, or -1 */
+	tree_list_p global_decl;
+	var_context_p prev;
+	var_context_p next_in_task;
+};
+
+var_context_p new_var_context(char *name, char *global_name, var_context_p prev)
+{
+	var_context_p var_context = MALLOC(struct var_context);
+	var_context->name = name;
+	var_context->global_name = global_name;
+	var_context->type = NULL;
+	var_context->decl_node = NULL;
+	var_context->decl_step = 0;
+	var_context->last_step = 0;
+	var_context->is_array = FALSE;
+	var_context->nr_elements = 1;
+	var_context->scratch_offset = -1;
+	var_context->global_decl = NULL;
+	var_context->prev = prev;
+	var_context->next_in_task = NULL;
+	return var_context;
+}
+
+char *var_context_global_name(var_context_p var_context, char *name)
+{
+	for (; var_context != 0; var_context = var_context->prev)
+		if (strcmp(var_context->name, name) == 0)	
+		{
+			/* Record that the variable is used in the current step */
+			var_context->last_step = cur_task->nr_funcs;
+			return var_context->global_name;
+		}
+	return name;
+}
+
+void var_context_used_in_step(var_context_p var_context, node_p node)
+{
+	if (node == NULL || node->type_name != ident_node_type)
+		return;
+	for (; var_context != 0; var_context = var_context->prev)
+		if (var_context->global_name == CAST(ident_node_p, node)->name)
+		{
+			var_context->last_step = cur_task->nr_funcs;
+			return;
+		}
+}
+
+tree_list_p new_global_vars = NULL;
+tree_list_p *ref_new_global_var = &new_global_vars;
+
+void remove_new_global_var(tree_list_p global_var)
+{
+	for (tree_list_p *ref = &new_global_vars; *ref != NULL; ref = &(*ref)->next)
+		if (*ref == global_var)
+		{
+			*ref = global_var->next;
+			if (ref_new_global_var == &global_var->next)
+				ref_new_global_var = ref;
+			return;
+		}
+}
+
+node_p decl_initializer(tree_p decl_init)
+/*  Returns the expression of the initializer, without the 'init' tree around it */
+{
+	node_p init = tree_child_node(decl_init, 2);
+	return node_is_tree(init, "init") ? tree_child_node(CAST(tree_p, init), 1) : init;
+}
+
+void pass1_expr(node_p node, var_context_p var_context, ostream_p ostream)
+{
+	if (node == NULL)
+		return;
+		
+	if (node->type_name == ident_node_type)
+	{
+		ident_node_p ident = CAST(ident_node_p, node);
+		printf("Replacing %s ", ident->name);
+		ident->name = var_context_global_name(var_context, ident->name);
+		printf("with %s\n", ident->name);
+	}
+	else if (node->type_name == tree_node_type)
+	{
+		tree_p tree = CAST(tree_p, node);
+		for (int i = 0; i < tree->nr_children; i++)
+			pass1_expr(CAST(node_p, tree->children[i].data), var_context, ostream);
+	}
+}
+
+bool is_call_to_task(node_p node)
+{
+	if (node_is_tree(node, "call"))
+	{
+		node_p func_name = tree_child_node(CAST(tree_p, node), 1);
+		if (func_name->type_name == ident_node_type)
+		{
+			ident_node_p ident = CAST(ident_node_p, func_name);
+			return find_task(ident->name) != NULL;
+		}
+	}
+	return FALSE;
+}
+
+task_p task_with_call(node_p node)
+{
+	node_p func_name = tree_child_node(CAST(tree_p, node), 1);
+	if (func_name->type_name == ident_node_type)
+	{
+		ident_node_p ident = CAST(ident_node_p, func_name);
+		return find_task(ident->name);
+	}
+	return NULL;
+}
+
+bool const_int_value(node_p node, long long *value);
+void check_queue_for(tree_p queue_for);
+void add_poll_backoff(tree_p backoff);
+
+void pass1_statement(result_p result, result_p parent_statement_trace, var_context_p var_context, ostream_p ostream)
+{
+	ENTER_RESULT_CONTEXT
+	
+	tree_p statement = tree_of_result(result);
+	for (int i = 0; i < indent; i++)
+		printf("  ");
+	if (statement == NULL)
+	{
+		printf("pass1_statement: NULL\n");
+		return;
+	}
+	indent++;
+	DECL_RESULT(statement_trace);
+	make_result_list(&statement_trace, result, parent_statement_trace);
+	if (tree_is(statement, "list") || tree_is(statement, "statements"))
+	{
+		printf("statements / list\n");
+		for (int i = 1; i <= statement->nr_children; i++)
+		{
+			tree_p child = tree_child_tree(statement, i);
+			if (child == NULL)
+			{}
+			else if (tree_is(child, "declaration"))
+			{
+				//result_print(tree_child(statement, i), ostream);
+				tree_p type = tree_child_tree(child, 1);
+				tree_p decl = tree_child_tree(child, 2);
+				//printf("%d", j);
+				tree_p decl_init = tree_child_tree(decl, 1);
+				node_p init = decl_initializer(decl_init);
+				pass1_expr(init, var_context, ostream);
+				node_p var_node = tree_child_node(decl_init, 1);
+				/* For an array, like 'uint8_t buf[16]', the identifier is the first child */
+				node_p ident_node = node_is_tree(var_node, "array") ? tree_child_node(CAST(tree_p, var_node), 1) : var_node;
+				if (ident_node != NULL && ident_node->type_name == ident_node_type)
+				{
+					ident_node_p ident = CAST(ident_node_p, ident_node);
+					char *loc_var_name = strprintf("%s_var%d_%s", cur_task->name, ++cur_task->nr_local_vars, ident->name);
+					// Add global var
+					var_context = new_var_context(ident->name, loc_var_name, var_context);
+					var_context->type = type;
+					var_context->decl_node = ident_node;
+					if (var_node != ident_node)
+					{
+						long long nr_elements;
+						var_context->is_array = TRUE;
+						var_context->nr_elements
+							= const_int_value(tree_child_node(CAST(tree_p, var_node), 2), &nr_elements) && nr_elements > 0
+							? (int)nr_elements : 0;
+					}
+					var_context->decl_step = cur_task->nr_funcs;
+					var_context->last_step = cur_task->nr_funcs;
+					*cur_task->ref_next_local_var = var_context;
+					cur_task->ref_next_local_var = &var_context->next_in_task;
+					ident->name = loc_var_name;
+					//printf("var_local %s => %s\n", ident->name, loc_var_name);
+					node_p declaration
+						= make_tree_for(&declaration_tp, 2,
+							type,
+							make_tree_for(&decl_tp, 1,
+								make_tree_for(&decl_init_tp, 2,
+									var_node != ident_node ? var_node : make_ident_node(loc_var_name),
+									tree_child_tree(decl_init, 2))));
+					var_context->global_decl = new_result_list((tree_p)declaration);
+					*ref_new_global_var = var_context->global_decl;
+					ref_new_global_var = &(*ref_new_global_var)->next;
+				}
+				else
+				{
+					printf("ERROR var decl: ");
+					result_print(tree_child(decl_init, 1), ostream);
+					printf("\n");
+				}
+				if (is_call_to_task(init))
+				{
+					DECL_RESULT(child_trace);
+					make_result_list(&child_trace, tree_child(statement, i), &statement_trace);
+					add_task_func(&child_trace);
+					DISP_RESULT(child_trace);
+					/* The variable receives the result of the task in the next step */
+					var_context_used_in_step(var_context, ident_node);
+				}
+				printf("\n");
+			}
+			else
+				pass1_statement(tree_child(statement, i), &statement_trace, var_context, ostream);
+		}
+	}
+	else if (tree_is(statement, "if"))
+	{
+		pass1_expr(tree_child_node(statement, 1), var_context, ostream);
+		pass1_statement(tree_child(statement, 2), &statement_trace, var_context, ostream);
+		pass1_statement(tree_child(tree_child_tree(statement, 3), 1),  &statement_trace, var_context, ostream);
+	}
+	else if (tree_is(statement, "queuefor"))
+	{
+		check_queue_for(statement);
+		add_task_func(&statement_trace);
+		tree_p index_opt = tree_child_tree(statement, 2);
+		if (index_opt != NULL)
+			pass1_expr(tree_child_node(index_opt, 1), var_context, ostream);
+		pass1_statement(tree_child(statement, 3), &statement_trace, var_context, ostream);
+	}
+	else if (tree_is(statement, "poll"))
+	{
+		add_task_func(&statement_trace);
+		tree_p backoff_opt = tree_child_tree(statement, 1);
+		if (backoff_opt != NULL)
+			add_poll_backoff(backoff_opt);
+		pass1_statement(tree_child(statement, 2), &statement_trace, var_context, ostream);
+		tree_p atmost_opt = tree_child_tree(statement, 3);
+		if (atmost_opt != NULL)
+		{
+			DECL_RESULT(atmost_statement_trace);
+			make_result_list(&atmost_statement_trace, tree_child(statement, 3), &statement_trace);
+			add_task_func(&atmost_statement_trace);
+			pass1_expr(tree_child_node(atmost_opt, 1), var_context, ostream);
+			pass1_statement(tree_child(atmost_opt, 2), &atmost_statement_trace, var_context, ostream);
+			DISP_RESULT(atmost_statement_trace);
+		}
+	}		
+	else if (tree_is(statement, "wait"))
+	{
+		/* The task continues in the next step, when the events are set */
+		pass1_expr(tree_child_node(statement, 2), var_context, ostream);
+		pass1_expr(tree_child_node(statement, 3), var_context, ostream);
+		add_task_func(&statement_trace);
+	}
+	else if (tree_is(statement, "semi"))
+	{
+		pass1_expr(tree_child_node(statement, 1), var_context, ostream);
+		node_p node = tree_child_node(statement, 1);
+		if (is_call_to_task(node))
+			add_task_func(&statement_trace);
+		else if (   node_is_tree(node, "assignment")
+				 && is_call_to_task(tree_child_node(CAST(tree_p, node), 3)))
+		{
+			add_task_func(&statement_trace);
+			/* The variable receives the result of the task in the next step */
+			var_context_used_in_step(var_context, tree_child_node(CAST(tree_p, node), 1));
+		}
+	}
+	else if (tree_is(statement, "ret"))
+	{
+		pass1_expr(tree_child_node(statement, 1), var_context, ostream);
+	}
+	else
+	{
+		printf("pass1_statement: ");
+		tree_print(statement, ostream);
+		printf("\n");
+	}
+	DISP_RESULT(statement_trace);
+	indent--;
+}
+
+void prepend_child_node(result_p children, node_p node)
+{
+	ENTER_RESULT_CONTEXT
+	DECL_RESULT(child_result)
+	result_assign_ref_counted(&child_result, &node->_base, tree_print);
+	prepend_child(children, &child_result);
+	DISP_RESULT(child_result)
+	EXIT_RESULT_CONTEXT
+}
+
+
+typedef struct poll_backoff *poll_backoff_p;
+poll_backoff_p find_poll_backoff(tree_p backoff);
+
+node_p make_poll_backoff_again(poll_backoff_p poll_backoff);
+node_p make_poll_backoff_done(poll_backoff_p poll_backoff);
+
+void add_poll_backoff_done(result_p result, poll_backoff_p poll_backoff)
+/*  Replaces each break that leaves the poll by a call to PollBackoffDone
+	followed by the break. A break in a nested loop or switch does not
+	leave the poll. */
+{
+	tree_p tree = tree_of_result(result);
+	if (tree == NULL)
+		return;
+	if (tree_is(tree, "break"))
+	{
+		tree_p done = CAST(tree_p, make_tree_for(&statements_tp, 2, make_poll_backoff_done(poll_backoff), NULL));
+		result_assign(&done->children[1], result);
+		replace_child_node(result, &done->_node);
+	}
+	else if (   !tree_is(tree, "while") && !tree_is(tree, "do") && !tree_is(tree, "for")
+			 && !tree_is(tree, "switch") && !tree_is(tree, "poll"))
+		for (int i = 0; i < tree->nr_children; i++)
+			add_poll_backoff_done(&tree->children[i], poll_backoff);
+}
+
+void pass2_statement(result_p result, result_p children, ostream_p ostream)
+{
+	//ENTER_RESULT_CONTEXT
+	
+	tree_p statement = tree_of_result(result);
+	for (int i = 0; i < indent; i++)
+		printf("  ");
+	if (statement == NULL)
+	{
+		printf("pass2_statement: NULL\n");
+		return;
+	}
+	indent++;
+	if (tree_is(statement, "list") || tree_is(statement, "statements"))
+	{
+		printf("statements / list\n");
+		for (int i = 1; i <= statement->nr_children; i++)
+		{
+			tree_p child = tree_child_tree(statement, i);
+			if (child == NULL)
+			{}
+			else if (tree_is(child, "declaration"))
+			{
+				//result_print(tree_child(statement, i), ostream);
+				//tree_p type = tree_child_tree(child, 1);
+				tree_p decl = tree_child_tree(child, 2);
+
+				tree_p decl_init = tree_child_tree(decl, 1);
+				node_p init = decl_initializer(decl_init);
+				//pass1_expr(init, var_context, ostream);
+				//node_p var_node = tree_child_node(decl_init, 1);
+				if (init != NULL)
+				{
+					if (is_call_to_task(init))
+					{
+						task_p task_called = task_with_call(init);
+						task_func_p task_func = find_task_func(&statement->children[i]);
+						// Create call to task
+						prepend_child_node(children,
+							make_tree_for(&semi_tp, 1,
+								make_tree_for(&call_tp, 2,
+									make_ident_node("os_call_task"),
+									make_tree_for(&list_tp, 3,
+										make_int_node(task_called->nr),
+										make_int_node(cur_task->nr),
+										make_ident_node(task_func->name)
+										))));
+					}
+					else
+					{
+						
+						// Create assignment from declaration
+						prepend_child_node(children,
+							make_tree_for(&semi_tp, 1,
+								make_tree_for(&assignment_tp, 3,
+									tree_child_node(decl_init, 1),
+									make_tree_for(&ass_tp, 0),
+									init)));
+					}
+				}
+				printf("\n");
+			}
+			else
+			{
+				pass2_statement(tree_child(statement, i), children, ostream);
+			}
+		}
+	}
+	else if (tree_is(statement, "if"))
+	{
+		//pass2_expr(tree_child_node(statement, 1), var_context, ostream);
+		//pass2_statement(tree_child(statement, 2), &statement_trace, var_context, ostream);
+		//pass2_statement(tree_child(tree_child_tree(statement, 3), 1),  &statement_trace, var_context, ostream);
+	}
+	else if (tree_is(statement, "queuefor"))
+	{
+		// Create call to os_query_for;
+		//add_task_func(&statement_trace, NULL);
+		//pass2_statement(tree_child(statement, 2), &statement_trace, var_context, ostream);
+	}
+	else if (tree_is(statement, "poll"))
+	{
+		tree_p backoff_opt = tree_child_tree(statement, 1);
+		poll_backoff_p poll_backoff = backoff_opt != NULL ? find_poll_backoff(backoff_opt) : NULL;
+		if (poll_backoff != NULL)
+		{
+			// Create call to PollBackoffDone before each break that leaves the poll
+			add_poll_backoff_done(tree_child(statement, 2), poll_backoff);
+			// Create call to PollBackoffAgain, which runs the step again after the interval, instead of queueing it again
+			prepend_child_node(children, make_poll_backoff_again(poll_backoff));
+		}
+		//add_task_func(&statement_trace, NULL);
+		//pass2_statement(tree_child(statement, 2), &statement_trace, var_context, ostream);
+		//tree_p atmost_opt = tree_child_tree(statement, 3);
+		//if (atmost_opt != NULL)
+		//{
+		//	DECL_RESULT(atmost_statement_trace);
+		//	make_result_list(&atmost_statement_trace, tree_child(statement, 3), &statement_trace);
+		//	add_task_func(&atmost_statement_trace, NULL);
+		//	//pass2_expr(tree_child_node(atmost_opt, 1), var_context, ostream);
+		//	pass2_statement(tree_child(atmost_opt, 2), &atmost_statement_trace, var_context, ostream);
+		//	DISP_RESULT(atmost_statement_trace);
+		//}
+	}
+	else if (tree_is(statement, "semi"))
+	{
+		//for (int i = 1; i <= statement->nr_children; i++)
+		//	pass2_expr(tree_child_node(statement, i), var_context, ostream);
+		if (statement->nr_children == 1)
+		{
+			node_p node = tree_child_node(statement, 1);
+			if (   is_call_to_task(node)
+				|| (   node_is_tree(node, "assignment")
+					&& is_call_to_task(tree_child_node(CAST(tree_p, node), 3))))
+			{
+				// Create call to task
+				//add_task_func(&statement_trace, NULL);
+			}
+		}
+	}
+	else if (tree_is(statement, "wait"))
+	{
+		// Create call to EventGroupWait, which runs the next step when the events are set
+		task_func_p task_func = find_task_func(result);
+		prepend_child_node(children,
+			make_tree_for(&semi_tp, 1,
+				make_tree_for(&call_tp, 2,
+					make_ident_node("EventGroupWait"),
+					make_tree_for(&list_tp, 5,
+						tree_child_node(statement, 2),
+						tree_child_node(statement, 3),
+						make_ident_node(tree_is(tree_child_tree(statement, 1), "all") ? "true" : "false"),
+						make_int_node(cur_task->nr),
+						make_ident_node(task_func->name)
+						))));
+	}
+	else if (tree_is(statement, "ret"))
+	{
+		// Create statement to retun
+		//pass1_expr(tree_child_node(statement, 1), var_context, ostream);
+	}
+	else
+	{
+		//printf("pass1_statement: ");
+		//tree_print(statement, ostream);
+		//printf("\n");
+	}
+	indent--;
+}
+
+
+/*
+	Scratch arena
+	~~~~~~~~~~~~~
+	Local variables that are not live across a suspension point are only
+	used within a single step. Instead of a global variable of their own,
+	they get a place in the scratch arena of the runtime, which is reused
+	by every step. Offsets are assigned per step, thus the size needed for
+	the arena is determined by the step that needs the most. The global
+	declaration of a placed variable is removed and its references are
+	replaced by SCRATCH_VAR or SCRATCH_ARRAY of the runtime. Its declaration
+	in the step is replaced by an assignment of the initializer, if any.
+	Variables of which the size is not known, like those of a struct or
+	typedef type, static variables, arrays without a constant size and
+	initialized arrays stay global. The offsets are based on the sizes of
+	the target, for which a _Static_assert is emitted for every type that
+	is placed, such that a build with other sizes (like a 64-bit host with
+	an 8 byte long) fails instead of overlapping variables.
+*/
+
+struct
+{
+	const char *name;
+	int size;
+} type_sizes[] = {
+	{ "char", 1 }, { "bool", 1 }, { "int8_t", 1 }, { "uint8_t", 1 },
+	{ "short", 2 }, { "int16_t", 2 }, { "uint16_t", 2 },
+	{ "int", 4 }, { "long", 4 }, { "float", 4 }, { "int32_t", 4 }, { "uint32_t", 4 },
+	{ "double", 8 }, { "int64_t", 8 }, { "uint64_t", 8 },
+	{ NULL, 0 }
+};
+
+int type_size(tree_p type)
+/*  Returns the size of the type, or 0 when it is not known */
+{
+	int size = 0;
+	int nr_longs = 0;
+	bool sign = FALSE;
+	for (int i = 1; type != NULL && i <= type->nr_children; i++)
+	{
+		const char *name = tree_name(tree_child(type, i));
+		if (strcmp(name, "long") == 0)
+			nr_longs++;
+		else if (strcmp(name, "signed") == 0 || strcmp(name, "unsigned") == 0)
+			sign = TRUE;
+		else if (strcmp(name, "const") == 0 || (size > 0 && strcmp(name, "int") == 0))
+			; /* 'short int' and 'long int' */
+		else
+		{
+			int j = 0;
+			while (type_sizes[j].name != NULL && strcmp(type_sizes[j].name, name) != 0)
+				j++;
+			if (type_sizes[j].name == NULL)
+				return 0; /* Like struct, a typedef name or static */
+			size = type_sizes[j].size;
+		}
+	}
+	if (nr_longs > 0)
+		return size == 8 || nr_longs > 1 ? 8 : 4; /* 'long double' and 'long long' */
+	return size == 0 && sign ? 4 : size;
+}
+
+int scratch_arena_peak = 0;
+
+typedef struct scratch_type *scratch_type_p;
+struct scratch_type
+{
+	char *name;
+	int size;
+	scratch_type_p next;
+};
+scratch_type_p scratch_types = NULL;
+
+void add_scratch_type(char *name, int size)
+/*  Records the size assumed for the type */
+{
+	scratch_type_p *ref = &scratch_types;
+	for (; *ref != NULL; ref = &(*ref)->next)
+		if (strcmp((*ref)->name, name) == 0)
+			return;
+	*ref = MALLOC(struct scratch_type);
+	(*ref)->name = name;
+	(*ref)->size = size;
+	(*ref)->next = NULL;
+}
+
+void replace_scratch_refs(node_p node, var_context_p var, const char *access)
+{
+	if (node == NULL || node->type_name != tree_node_type)
+		return;
+	tree_p tree = CAST(tree_p, node);
+	for (int i = 1; i <= tree->nr_children; i++)
+	{
+		node_p child = tree_child_node(tree, i);
+		if (   child != NULL && child->type_name == ident_node_type && child != var->decl_node
+			&& strcmp(CAST(ident_node_p, child)->name, var->global_name) == 0)
+		{
+			node_p ref = make_ident_node(access);
+			ref->line = child->line;
+			ref->column = child->column;
+			replace_child_node(tree_child(tree, i), ref);
+		}
+		else
+			replace_scratch_refs(child, var, access);
+	}
+}
+
+char *scratch_access(var_context_p var)
+{
+	char type_name[200] = "";
+	for (int i = 1; i <= var->type->nr_children; i++)
+		snprintf(type_name + strlen(type_name), sizeof(type_name) - strlen(type_name), "%s%s", i > 1 ? " " : "", tree_name(tree_child(var->type, i)));
+	add_scratch_type(strprintf("%s", type_name), type_size(var->type));
+	return !var->is_array
+		? strprintf("SCRATCH_VAR(%s, %d)", type_name, var->scratch_offset)
+		: strprintf("SCRATCH_ARRAY(%s, %d, %d)", type_name, var->nr_elements, var->scratch_offset);
+}
+
+tree_p find_declaration_of(node_p node, node_p decl_node, int *index)
+/*  Returns the statement list with the declaration of the identifier, and
+	the index of the declaration in it */
+{
+	if (node == NULL || node->type_name != tree_node_type)
+		return NULL;
+	tree_p tree = CAST(tree_p, node);
+	for (int i = 1; i <= tree->nr_children; i++)
+	{
+		tree_p child = tree_child_tree(tree, i);
+		tree_p decl_init = tree_is(child, "declaration") ? tree_child_tree(tree_child_tree(child, 2), 1) : NULL;
+		node_p var_node = decl_init != NULL ? tree_child_node(decl_init, 1) : NULL;
+		if (   var_node != NULL
+			&& (var_node == decl_node || (node_is_tree(var_node, "array") && tree_child_node(CAST(tree_p, var_node), 1) == decl_node)))
+		{
+			*index = i;
+			return tree;
+		}
+		tree_p found = find_declaration_of(&child->_node, decl_node, index);
+		if (found != NULL)
+			return found;
+	}
+	return NULL;
+}
+
+void replace_scratch_declaration(tree_p statements, int index, const char *access)
+/*  Replaces the declaration by the assignment of its initializer to the
+	scratch variable, or removes it, when it has no initializer */
+{
+	tree_p decl_init = tree_child_tree(tree_child_tree(tree_child_tree(statements, index), 2), 1);
+	node_p init = decl_initializer(decl_init);
+	if (init == NULL)
+	{
+		RESULT_RELEASE(&statements->children[index - 1]);
+		for (int i = index; i < statements->nr_children; i++)
+			statements->children[i - 1] = statements->children[i];
+		statements->nr_children--;
+		return;
+	}
+	/* The initializer is shared, as make_tree_for does not increment */
+	tree_p assignment = CAST(tree_p, make_tree_for(&assignment_tp, 3, make_ident_node(access), make_tree_for(&ass_tp, 0), NULL));
+	result_assign(&assignment->children[2], node_is_tree(tree_child_node(decl_init, 2), "init") ? tree_child(tree_child_tree(decl_init, 2), 1) : tree_child(decl_init, 2));
+	node_p semi = make_tree_for(&semi_tp, 1, &assignment->_node);
+	semi->line = node_of_result(tree_child(statements, index))->line;
+	semi->column = node_of_result(tree_child(statements, index))->column;
+	replace_child_node(tree_child(statements, index), semi);
+}
+
+void place_scratch_vars(task_p task, node_p body)
+{
+	for (int step = 0; step <= task->nr_funcs; step++)
+	{
+		int offset = 0;
+		for (var_context_p var = task->local_vars; var != NULL; var = var->next_in_task)
+			if (var->decl_step == step && var->last_step == step)
+			{
+				int size = type_size(var->type) * var->nr_elements;
+				int index;
+				tree_p statements = find_declaration_of(body, var->decl_node, &index);
+				if (size == 0 || statements == NULL)
+					continue;
+				tree_p decl_init = tree_child_tree(tree_child_tree(tree_child_tree(statements, index), 2), 1);
+				if (var->is_array && decl_initializer(decl_init) != NULL)
+					continue;
+				int align = size < 8 ? size : 8;
+				offset = (offset + align - 1) / align * align;
+				var->scratch_offset = offset;
+				offset += size;
+				if (step == 0)
+					printf("Scratch %s at offset %d (%d bytes) in %s\n", var->global_name, var->scratch_offset, size, task->name);
+				else
+					printf("Scratch %s at offset %d (%d bytes) in %s_step%d\n", var->global_name, var->scratch_offset, size, task->name, step);
+				remove_new_global_var(var->global_decl);
+				char *access = scratch_access(var);
+				replace_scratch_declaration(statements, index, access);
+				replace_scratch_refs(body, var, access);
+			}
+		if (offset > scratch_arena_peak)
+			scratch_arena_peak = offset;
+	}
+}
+
+void emit_scratch_arena(ostream_p ostream)
+{
+	ostream_printf(ostream, "\nconst uint32_t scratchArenaStatic = %d;\n", scratch_arena_peak);
+	ostream_printf(ostream, "_Static_assert(%d <= SCRATCH_ARENA_SIZE, \"The scratch arena is too small for the step-local variables\");\n", scratch_arena_peak);
+	for (scratch_type_p type = scratch_types; type != NULL; type = type->next)
+		ostream_printf(ostream, "_Static_assert(sizeof(%s) == %d, \"The scratch offsets assume a size of %d for %s\");\n",
+					   type->name, type->size, type->size, type->name);
+}
+
+/*
+	Sharing step functions
+	~~~~~~~~~~~~~~~~~~~~~~
+	Tasks that perform the same sequence of actions on different devices
+	result in step functions that only differ in some constants and in the
+	(renamed) local variables. A step is identified by its statement trace:
+	the statement where the step starts and the statements enclosing it.
+	Two steps can share one function when their statements and their
+	continuations (the statements following them in the enclosing lists)
+	are structurally equal. Differing integer constants and identifiers,
+	not being the name of a called function or a type, become parameters
+	of the shared function, taken from a small per-task data table. A
+	variable that the step writes, like 'temp2' in 'temp2 = I2CRead();',
+	or of which it takes the address, is put in the table by address, and
+	the shared function accesses it through the pointer.
+*/
+
+typedef struct
+{
+	int nr_params;
+	node_p params[MAX_STEP_PARAMS];        /* Leaves of the step being compared */
+	node_p shared_params[MAX_STEP_PARAMS]; /* Corresponding leaves of the shared step */
+	bool by_address[MAX_STEP_PARAMS];
+} step_params_t, *step_params_p;
+
+bool leaf_equal(node_p node, node_p other)
+{
+	if (node->type_name != other->type_name)
+		return FALSE;
+	if (node->type_name == ident_node_type)
+		return strcmp(CAST(ident_node_p, node)->name, CAST(ident_node_p, other)->name) == 0;
+	if (node->type_name == int_node_type)
+		return CAST(int_node_p, node)->value == CAST(int_node_p, other)->value;
+	if (node->type_name == char_node_type)
+		return CAST(char_node_p, node)->ch == CAST(char_node_p, other)->ch;
+	if (node->type_name == string_node_type)
+		return strcmp(CAST(string_node_p, node)->str, CAST(string_node_p, other)->str) == 0;
+	return FALSE;
+}
+
+bool step_add_param(step_params_p step_params, node_p node, node_p shared_node, bool written)
+{
+	for (int i = 0; i < step_params->nr_params; i++)
+		if (leaf_equal(step_params->params[i], node) && leaf_equal(step_params->shared_params[i], shared_node))
+		{
+			step_params->by_address[i] = step_params->by_address[i] || written;
+			return TRUE;
+		}
+	if (step_params->nr_params == MAX_STEP_PARAMS)
+		return FALSE;
+	step_params->params[step_params->nr_params] = node;
+	step_params->shared_params[step_params->nr_params] = shared_node;
+	step_params->by_address[step_params->nr_params] = written;
+	step_params->nr_params++;
+	return TRUE;
+}
+
+bool writes_child(tree_p tree, int i, bool written)
+/*  Returns whether the child (0-based) of the tree is written, when the
+	tree is written or not */
+{
+	if (i != 0)
+		return FALSE;
+	return    tree_is(tree, "assignment") || tree_is(tree, "address_of")
+		   || tree_is(tree, "pre_inc") || tree_is(tree, "pre_dec") || tree_is(tree, "post_inc") || tree_is(tree, "post_dec")
+		   || (written && (tree_is(tree, "field") || tree_is(tree, "arrayexp") || tree_is(tree, "brackets")));
+}
+
+bool step_nodes_equal(node_p node, node_p other, bool exact, bool written, step_params_p step_params)
+{
+	if (node == NULL || other == NULL)
+		return node == other;
+	if (node->type_name != other->type_name)
+		return FALSE;
+	if (node->type_name == tree_node_type)
+	{
+		tree_p tree = CAST(tree_p, node);
+		tree_p other_tree = CAST(tree_p, other);
+		if (   strcmp(tree->tree_param->name, other_tree->tree_param->name) != 0
+			|| tree->nr_children != other_tree->nr_children)
+			return FALSE;
+		/* Called functions and types must be the same */
+		bool exact_first = tree_is(tree, "call") || tree_is(tree, "declaration");
+		exact = exact || tree_is(tree, "sizeof") || tree_is(tree, "cast");
+		for (int i = 0; i < tree->nr_children; i++)
+			if (!step_nodes_equal(node_of_result(&tree->children[i]), node_of_result(&other_tree->children[i]),
+								  exact || (exact_first && i == 0), writes_child(tree, i, written), step_params))
+				return FALSE;
+		return TRUE;
+	}
+	if (leaf_equal(node, other))
+		return TRUE;
+	if (exact || (node->type_name != ident_node_type && node->type_name != int_node_type))
+		return FALSE;
+	return step_add_param(step_params, node, other, written);
+}
+
+int tree_child_index(tree_p tree, node_p child)
+{
+	for (int i = 0; i < tree->nr_children; i++)
+		if (tree->children[i].data == child)
+			return i;
+	return -1;
+}
+
+bool step_traces_equal(result_p trace, result_p other_trace, step_params_p step_params)
+{
+	result_list_p list = CAST(result_list_p, trace->data);
+	result_list_p other_list = CAST(result_list_p, other_trace->data);
+	node_p child = node_of_result(&list->value);
+	node_p other_child = node_of_result(&other_list->value);
+	if (!step_nodes_equal(child, other_child, FALSE, FALSE, step_params))
+		return FALSE;
+	for (;;)
+	{
+		list = CAST(result_list_p, list->next.data);
+		other_list = CAST(result_list_p, other_list->next.data);
+		if (list == NULL || other_list == NULL)
+			return list == other_list;
+		tree_p parent = tree_of_result(&list->value);
+		tree_p other_parent = tree_of_result(&other_list->value);
+		if (parent == NULL || other_parent == NULL)
+			return parent == other_parent;
+		if (   (tree_is(parent, "list") || tree_is(parent, "statements"))
+			&& strcmp(parent->tree_param->name, other_parent->tree_param->name) == 0)
+		{
+			/* Only the statements following the child are part of the continuation */
+			int i = tree_child_index(parent, child);
+			int j = tree_child_index(other_parent, other_child);
+			if (i < 0 || j < 0 || parent->nr_children - i != other_parent->nr_children - j)
+				return FALSE;
+			for (i++, j++; i < parent->nr_children; i++, j++)
+				if (!step_nodes_equal(node_of_result(&parent->children[i]), node_of_result(&other_parent->children[j]), FALSE, FALSE, step_params))
+					return FALSE;
+		}
+		else if (!step_nodes_equal(&parent->_node, &other_parent->_node, FALSE, FALSE, step_params))
+			return FALSE;
+		child = &parent->_node;
+		other_child = &other_parent->_node;
+	}
+}
+
+bool share_step(task_func_p task_func, task_func_p shared)
+{
+	step_params_t step_params;
+	step_params.nr_params = 0;
+	if (!step_traces_equal(&task_func->statement_trace, &shared->statement_trace, &step_params))
+		return FALSE;
+
+	/* The parameters of the shared step are the union of the differences with all steps sharing it */
+	int index[MAX_STEP_PARAMS];
+	int nr_params = shared->nr_params;
+	for (int i = 0; i < step_params.nr_params; i++)
+	{
+		index[i] = -1;
+		for (int j = 0; j < shared->nr_params; j++)
+			if (shared->params[j] == step_params.shared_params[i])
+				index[i] = j;
+		if (index[i] == -1)
+		{
+			if (nr_params == MAX_STEP_PARAMS)
+				return FALSE;
+			index[i] = nr_params++;
+		}
+	}
+	for (int i = 0; i < step_params.nr_params; i++)
+	{
+		shared->params[index[i]] = step_params.shared_params[i];
+		shared->by_address[index[i]] = shared->by_address[index[i]] || step_params.by_address[i];
+		task_func->params[index[i]] = step_params.params[i];
+	}
+	shared->nr_params = nr_params;
+	task_func->shared_with = shared;
+	return TRUE;
+}
+
+bool stream_mode = FALSE; /* Steps are not shared (see Streaming compilation) */
+
+void share_task_steps(task_p task)
+{
+	if (stream_mode)
+		return;
+	for (task_func_p task_func = task->task_funcs; task_func != NULL; task_func = task_func->next)
+	{
+		for (task_p other_task = tasks; other_task != NULL && task_func->shared_with == NULL; other_task = other_task->next)
+		{
+			for (task_func_p other_func = other_task->task_funcs; other_func != NULL && other_func != task_func; other_func = other_func->next)
+				if (other_func->shared_with == NULL && share_step(task_func, other_func))
+					break;
+			if (other_task == task)
+				break;
+		}
+	}
+}
+
+void print_shared_step(task_func_p task_func, ostream_p ostream)
+{
+	task_func_p shared = task_func->shared_with;
+	printf("\nTask func %s shares %s", task_func->name, shared->name);
+	for (int i = 0; i < shared->nr_params; i++)
+	{
+		printf(i == 0 ? " with data " : ", ");
+		if (shared->by_address[i])
+			printf("&");
+		node_p param = task_func->params[i] != NULL ? task_func->params[i] : shared->params[i];
+		node_print(param, ostream);
+	}
+	printf("\n");
+}
+
+/*
+	Deferred logging
+	~~~~~~~~~~~~~~~~
+	A call like 'Log("temp %d\n", temp)' is replaced by a call to one of
+	the LogWrite<N> macros of the runtime, with the id of the format string
+	instead of the string itself. The runtime only stores the id, the time
+	tick and the raw arguments in a ring. The id table with the format
+	strings is written to a file, such that the dumped ring can be decoded
+	on the host with tcposlog. Because each argument is stored in 32 bits,
+	only the integer conversions, %c, %p and the float conversions (of
+	which the argument is passed through LogFloatBits, which keeps the
+	bits of the float) are allowed, without the 64-bit length modifiers.
+	A string cannot be logged with %s, because only its address would be
+	stored.
+*/
+
+#define MAX_LOG_ARGS 4
+
+typedef struct log_format *log_format_p;
+struct log_format
+{
+	const char *format;
+	int id;
+	int nr_args;
+	log_format_p next;
+};
+log_format_p log_formats = NULL;
+log_format_p *ref_next_log_format = &log_formats;
+int nr_log_formats = 0;
+
+log_format_p log_format_id(const char *format, int nr_args)
+{
+	for (log_format_p log_format = log_formats; log_format != NULL; log_format = log_format->next)
+		if (strcmp(log_format->format, format) == 0 && log_format->nr_args == nr_args)
+			return log_format;
+	log_format_p log_format = MALLOC(struct log_format);
+	log_format->format = format;
+	log_format->id = nr_log_formats++;
+	log_format->nr_args = nr_args;
+	log_format->next = NULL;
+	*ref_next_log_format = log_format;
+	ref_next_log_format = &log_format->next;
+	return log_format;
+}
+
+int log_format_conversions(node_p callee, const char *format, bool *is_float)
+/*  Returns the number of conversions in the format and sets is_float for
+	each of them, or returns -1 after reporting an unsupported conversion */
+{
+	int nr_conversions = 0;
+	for (const char *s = format; *s != '\0'; s++)
+	{
+		if (*s != '%')
+			continue;
+		if (*++s == '%')
+			continue;
+		while (*s != '\0' && strchr("-+ #0123456789.", *s) != NULL)
+			s++;
+		int nr_longs = 0;
+		for (; *s != '\0' && strchr("hlLjztq", *s) != NULL; s++)
+			nr_longs += *s == 'l' ? 1 : *s == 'h' ? 0 : 2;
+		if (*s == '\0' || strchr("diouxXcpfFeEgGaA", *s) == NULL || nr_longs > 1)
+		{
+			if (*s == 's')
+				compile_error(callee, "Log cannot store the string of %%s, only its address");
+			else if (nr_longs > 1)
+				compile_error(callee, "Log only stores 32-bit arguments");
+			else
+				compile_error(callee, "Log does not support the conversion at offset %d of its format", (int)(s - format));
+			return -1;
+		}
+		if (nr_conversions < MAX_LOG_ARGS)
+			is_float[nr_conversions] = strchr("fFeEgGaA", *s) != NULL;
+		nr_conversions++;
+	}
+	return nr_conversions;
+}
+
+void collect_log_formats(node_p node)
+{
+	if (node == NULL || node->type_name != tree_node_type)
+		return;
+	tree_p tree = CAST(tree_p, node);
+	for (int i = 0; i < tree->nr_children; i++)
+		collect_log_formats(node_of_result(&tree->children[i]));
+
+	if (!tree_is(tree, "call") || strcmp(tree_name(tree_child(tree, 1)), "Log") != 0)
+		return;
+	node_p callee = tree_child_node(tree, 1);
+	tree_p args = tree_child_list(tree, 2);
+	node_p format = args != NULL ? tree_child_node(args, 1) : NULL;
+	if (format == NULL || format->type_name != string_node_type)
+	{
+		compile_error(callee, "Log requires a format string as first argument");
+		return;
+	}
+	int nr_args = args->nr_children - 1;
+	if (nr_args > MAX_LOG_ARGS)
+	{
+		compile_error(callee, "Log supports at most %d arguments", MAX_LOG_ARGS);
+		return;
+	}
+	bool is_float[MAX_LOG_ARGS];
+	int nr_conversions = log_format_conversions(callee, CAST(string_node_p, format)->str, is_float);
+	if (nr_conversions < 0)
+		return;
+	if (nr_conversions != nr_args)
+	{
+		compile_error(callee, "Log format has %d conversions for %d arguments", nr_conversions, nr_args);
+		return;
+	}
+	for (int i = 0; i < nr_args; i++)
+		if (is_float[i])
+		{
+			/* The argument is shared, as make_tree_for does not increment */
+			tree_p list = CAST(tree_p, make_tree_for(&list_tp, 1, NULL));
+			result_assign(&list->children[0], tree_child(args, i + 2));
+			replace_child_node(tree_child(args, i + 2),
+				make_tree_for(&call_tp, 2, make_ident_node("LogFloatBits"), &list->_node));
+		}
+	log_format_p log_format = log_format_id(CAST(string_node_p, format)->str, nr_args);
+	replace_child_node(tree_child(tree, 1), make_ident_node(strprintf("LogWrite%d", nr_args)));
+	replace_child_node(tree_child(args, 1), make_int_node(log_format->id));
+}
+
+bool write_log_formats(const char *file_name)
+{
+	FILE *f = fopen(file_name, "w");
+	if (f == NULL)
+		return FALSE;
+	file_ostream_t file_ostream;
+	file_ostream_init(&file_ostream, f);
+	for (log_format_p log_format = log_formats; log_format != NULL; log_format = log_format->next)
+	{
+		fprintf(f, "%d %d \"", log_format->id, log_format->nr_args);
+		for (const char *s = log_format->format; *s != '\0'; s++)
+			print_single_char(*s, '"', &file_ostream.ostream);
+		fprintf(f, "\"\n");
+	}
+	fclose(f);
+	return TRUE;
+}
+
+/*
+	Task groups
+	~~~~~~~~~~~
+	A group declaration like 'group sensors budget (2) per (10) { get_temp };'
+	gives the listed tasks a shared budget of ticks per period, which is
+	enforced by a deferrable server in the runtime. Group 0 is used for
+	the tasks without a budget, such that NR_TASK_GROUPS - 1 groups can
+	be declared.
+*/
+
+typedef struct task_group *task_group_p;
+struct task_group
+{
+	const char *name;
+	int nr;
+	long long budget;
+	long long period;
+	task_group_p next;
+};
+task_group_p task_groups = NULL;
+task_group_p *ref_next_task_group = &task_groups;
+int nr_task_groups = 0;
+
+bool const_int_value(node_p node, long long *value)
+{
+	if (node == NULL || node->type_name != int_node_type)
+		return FALSE;
+	*value = CAST(int_node_p, node)->value;
+	return TRUE;
+}
+
+void add_task_group(tree_p group_tree)
+{
+	node_p name = tree_child_node(group_tree, 1);
+	if (nr_task_groups == NR_TASK_GROUPS - 1)
+	{
+		compile_error(name, "group %s exceeds the %d groups of the runtime", ident_name(tree_child(group_tree, 1)), NR_TASK_GROUPS - 1);
+		return;
+	}
+	task_group_p group = MALLOC(struct task_group);
+	group->name = ident_name(tree_child(group_tree, 1));
+	group->nr = ++nr_task_groups;
+	group->next = NULL;
+	if (   !const_int_value(tree_child_node(group_tree, 2), &group->budget)
+		|| !const_int_value(tree_child_node(group_tree, 3), &group->period))
+	{
+		compile_error(name, "budget and period of group %s must be constants", group->name);
+		group->budget = group->period = 0;
+	}
+	else if (group->budget <= 0 || group->period < group->budget)
+		compile_error(name, "group %s needs 0 < budget <= period", group->name);
+	*ref_next_task_group = group;
+	ref_next_task_group = &group->next;
+
+	tree_p members = tree_child_list(group_tree, 4);
+	for (int i = 1; members != NULL && i <= members->nr_children; i++)
+	{
+		node_p member = tree_child_node(members, i);
+		task_p task = find_task(ident_name(tree_child(members, i)));
+		if (task == NULL)
+			compile_error(member, "%s in group %s is not a task", ident_name(tree_child(members, i)), group->name);
+		else if (task->group != NULL)
+			compile_error(member, "task %s is already in group %s", task->name, task->group->name);
+		else
+			task->group = group;
+	}
+}
+
+void emit_task_groups(ostream_p ostream)
+{
+	if (task_groups == NULL)
+		return;
+	ostream_printf(ostream, "\nvoid TaskGroupsInit(void)\n{\n");
+	for (task_group_p group = task_groups; group != NULL; group = group->next)
+		ostream_printf(ostream, "\tTaskGroupInit(%d, %lld, %lld); // %s\n", group->nr, group->budget, group->period, group->name);
+	for (task_p task = tasks; task != NULL; task = task->next)
+		if (task->group != NULL)
+			ostream_printf(ostream, "\ttasks[%d].group = %d; // %s\n", task->nr, task->group->nr, task->name);
+	ostream_printf(ostream, "}\n");
+}
+
+/*
+	Counting resources
+	~~~~~~~~~~~~~~~~~~
+	A declaration like 'resource dma (3);' declares a pool of identical
+	resources, which can be held by three tasks at the same time. The
+	statement 'queue for dma [channel] ...' waits for one of them and
+	assigns the index of the resource that is acquired to 'channel'. The
+	index is optional, and only allowed for resources, as a 'queue for' of
+	a critical section can only have one holder.
+*/
+
+#define MAX_RESOURCE_COUNT 8
+#define NR_COUNTING_SECTIONS 2 /* Equal to that of the runtime */
+
+typedef struct resource *resource_p;
+struct resource
+{
+	const char *name;
+	int nr;
+	long long count;
+	resource_p next;
+};
+resource_p resources = NULL;
+resource_p *ref_next_resource = &resources;
+int nr_resources = 0;
+
+resource_p find_resource(const char *name)
+{
+	for (resource_p resource = resources; resource != NULL; resource = resource->next)
+		if (strcmp(resource->name, name) == 0)
+			return resource;
+	return NULL;
+}
+
+void add_resource(tree_p resource_tree)
+{
+	node_p name = tree_child_node(resource_tree, 1);
+	if (nr_resources == NR_COUNTING_SECTIONS)
+	{
+		compile_error(name, "resource %s exceeds the %d counting sections of the runtime", ident_name(tree_child(resource_tree, 1)), NR_COUNTING_SECTIONS);
+		return;
+	}
+	resource_p resource = MALLOC(struct resource);
+	resource->name = ident_name(tree_child(resource_tree, 1));
+	resource->nr = nr_resources++;
+	resource->next = NULL;
+	if (find_resource(resource->name) != NULL)
+		compile_error(name, "resource %s is already declared", resource->name);
+	if (!const_int_value(tree_child_node(resource_tree, 2), &resource->count))
+	{
+		compile_error(name, "count of resource %s must be a constant", resource->name);
+		resource->count = 1;
+	}
+	else if (resource->count < 1 || resource->count > MAX_RESOURCE_COUNT)
+		compile_error(name, "resource %s needs a count from 1 to %d", resource->name, MAX_RESOURCE_COUNT);
+	*ref_next_resource = resource;
+	ref_next_resource = &resource->next;
+}
+
+void check_queue_for(tree_p queue_for)
+{
+	node_p name = tree_child_node(queue_for, 1);
+	if (tree_child_node(queue_for, 2) != NULL && find_resource(ident_name(tree_child(queue_for, 1))) == NULL)
+		compile_error(name, "queue for %s with an index requires a resource", ident_name(tree_child(queue_for, 1)));
+}
+
+void emit_resources(ostream_p ostream)
+{
+	if (resources == NULL)
+		return;
+	ostream_printf(ostream, "\nvoid ResourcesInit(void)\n{\n");
+	for (resource_p resource = resources; resource != NULL; resource = resource->next)
+		ostream_printf(ostream, "\tCountingSectionInit(%d, %lld); // %s\n", resource->nr, resource->count, resource->name);
+	ostream_printf(ostream, "}\n");
+}
+
+/*
+	Topics
+	~~~~~~
+	A declaration like 'topic temps (uint16_t) { logger, display };'
+	declares a topic with samples of the given type, to which the listed
+	tasks are subscribed. A publisher writes a sample in a slot of the pool
+	of the topic, and every subscriber gets a reference to it, without
+	copying, and is queued when it is waiting on the topic. As a
+	subscriber holds at most the sample it is processing and the next
+	pending sample, and the publisher one that it is writing, a pool with
+	twice the number of subscribers plus one slot never runs out. The
+	pools are emitted with TopicsInit, which also sets the function of the
+	subscribers, as they are queued by the first publish.
+*/
+
+#define MAX_TOPIC_SUBSCRIBERS 8
+#define NR_TOPICS 4 /* Equal to that of the runtime */
+
+typedef struct topic *topic_p;
+struct topic
+{
+	const char *name;
+	int nr;
+	tree_p type;
+	int nr_subscribers;
+	task_p subscribers[MAX_TOPIC_SUBSCRIBERS];
+	topic_p next;
+};
+topic_p topics = NULL;
+topic_p *ref_next_topic = &topics;
+int nr_topics = 0;
+
+#define TOPIC_POOL_SIZE(T) (2 * (T)->nr_subscribers + 1)
+
+void add_topic(tree_p topic_tree)
+{
+	node_p name = tree_child_node(topic_tree, 1);
+	if (nr_topics == NR_TOPICS)
+	{
+		compile_error(name, "topic %s exceeds the %d topics of the runtime", ident_name(tree_child(topic_tree, 1)), NR_TOPICS);
+		return;
 	}
-	else
-		child = MALLOC(struct nt_stack);
-	child->name = name;
-	child->ref_count = 1;
-	child->pos = parser->text_buffer->pos;
-	child->parent = parser->nt_stack;
-	if (parser->nt_stack != 0)
-		parser->nt_stack->ref_count++;
-	//DEBUG_TAB; DEBUG_P1("push %s\n", child->name);
-	return child;
+	topic_p topic = MALLOC(struct topic);
+	topic->name = ident_name(tree_child(topic_tree, 1));
+	topic->nr = nr_topics++;
+	topic->type = tree_child_list(topic_tree, 2);
+	topic->nr_subscribers = 0;
+	topic->next = NULL;
+	tree_p subscribers = tree_child_list(topic_tree, 3);
+	for (int i = 1; subscribers != NULL && i <= subscribers->nr_children; i++)
+	{
+		node_p subscriber = tree_child_node(subscribers, i);
+		task_p task = find_task(ident_name(tree_child(subscribers, i)));
+		if (task == NULL)
+			compile_error(subscriber, "subscriber %s of topic %s is not a task", ident_name(tree_child(subscribers, i)), topic->name);
+		else if (topic->nr_subscribers == MAX_TOPIC_SUBSCRIBERS)
+			compile_error(name, "topic %s has more than %d subscribers", topic->name, MAX_TOPIC_SUBSCRIBERS);
+		else
+			topic->subscribers[topic->nr_subscribers++] = task;
+	}
+	*ref_next_topic = topic;
+	ref_next_topic = &topic->next;
 }
 
-void nt_stack_dispose(nt_stack_p nt_stack)
+bool started_by_timer(task_p task);
+
+bool subscribed_to_topic(task_p task)
 {
-	while (nt_stack != NULL && --nt_stack->ref_count == 0)
+	for (topic_p topic = topics; topic != NULL; topic = topic->next)
+		for (int i = 0; i < topic->nr_subscribers; i++)
+			if (topic->subscribers[i] == task)
+				return TRUE;
+	return FALSE;
+}
+
+void emit_topics(ostream_p ostream)
+{
+	if (topics == NULL)
+		return;
+	ostream_printf(ostream, "\n");
+	for (topic_p topic = topics; topic != NULL; topic = topic->next)
 	{
-		nt_stack_p parent = nt_stack->parent;
-		nt_stack->parent = nt_stack_allocated;
-		nt_stack_allocated = nt_stack;
-		nt_stack = parent;
+		for (int i = 1; topic->type != NULL && i <= topic->type->nr_children; i++)
+			ostream_printf(ostream, "%s ", tree_name(tree_child(topic->type, i)));
+		ostream_printf(ostream, "%s_pool[%d];\n", topic->name, TOPIC_POOL_SIZE(topic));
+		ostream_printf(ostream, "const TaskId %s_subscribers[%d] = {", topic->name, topic->nr_subscribers);
+		for (int i = 0; i < topic->nr_subscribers; i++)
+			ostream_printf(ostream, "%s %d", i > 0 ? "," : "", topic->subscribers[i]->nr);
+		ostream_printf(ostream, " };\n");
 	}
+	/* The functions of the tasks started by a timer are already declared */
+	for (task_p task = tasks; task != NULL; task = task->next)
+		if (subscribed_to_topic(task) && !started_by_timer(task))
+			ostream_printf(ostream, "void %s(void);\n", task->name);
+	ostream_printf(ostream, "\nvoid TopicsInit(void)\n{\n");
+	for (task_p task = tasks; task != NULL; task = task->next)
+		if (subscribed_to_topic(task))
+			ostream_printf(ostream, "\ttasks[%d].function = %s;\n", task->nr, task->name);
+	for (topic_p topic = topics; topic != NULL; topic = topic->next)
+		ostream_printf(ostream, "\tTopicInit(%d, %s_pool, sizeof(%s_pool[0]), %d, %s_subscribers, %d);\n",
+					   topic->nr, topic->name, topic->name, TOPIC_POOL_SIZE(topic), topic->name, topic->nr_subscribers);
+	ostream_printf(ostream, "}\n");
 }
 
-nt_stack_p nt_stack_pop(nt_stack_p cur)
+/*
+	Time literals
+	~~~~~~~~~~~~~
+	A time literal, like '10ms', '250us' or '2s', is replaced by a number
+	of ticks, where the duration of a tick is set with the --tick-us option.
+	A time that is not a whole number of ticks is an error. The constant
+	periods of 'every', 'at most' and TimerStart should be at least one
+	tick and less than MAX_TIME_TICK of the runtime, which is set with the
+	--max-time-tick option, such that they can be armed with TIMER_ON_CONST,
+	which does not need a modulo, as TimersInit does for 'every'. A
+	TimerStart with a time literal that is not a whole number of ticks,
+	like the settle time of '150us', is replaced by a HrTimerStart, which
+	uses a high-resolution timer with the time in microseconds.
+*/
+
+long long tick_us = 1000;
+long long max_time_tick = 1000;
+
+void check_period(node_p node, const char *what)
 {
-	//DEBUG_TAB; DEBUG_P1("pop %s\n", cur == NULL ? "<NULL>" : cur->name);
-	nt_stack_p parent = cur->parent;
-	nt_stack_dispose(cur);
-	return parent;
+	long long period;
+	if (const_int_value(node, &period) && (period < 1 || period >= max_time_tick))
+		compile_error(node, "period of %lld ticks of %s cannot be represented, it should be from 1 to %lld ticks", period, what, max_time_tick - 1);
 }
 
-text_pos_t highest_pos;
-typedef struct
+#define MAX_HR_TIME_US 0x7FFFFFFF
+
+long long time_literal_us(tree_p tree)
+/*  Returns the time in microseconds, or -1 if it is not a time literal */
 {
-	nt_stack_p nt_stack;
-	element_p element;
-} expect_t;
-expect_t expected[MAX_EXP_SYM];
-int nr_expected;
+	long long unit_us = tree_is(tree, "time_us") ? 1 : tree_is(tree, "time_ms") ? 1000 : tree_is(tree, "time_s") ? 1000000 : 0;
+	return unit_us > 0 ? CAST(int_node_p, tree_child_node(tree, 1))->value * unit_us : -1;
+}
 
-void init_expected()
+void replace_by_int(result_p child, long long value)
 {
-	highest_pos.pos = 0;
-	nr_expected = 0;
+	node_p old_node = node_of_result(child);
+	node_p node = make_int_node(value);
+	node->line = old_node->line;
+	node->column = old_node->column;
+	replace_child_node(child, node);
 }
 
-void expect_element(parser_p parser, element_p element)
+void fold_time_literals(node_p node)
 {
-	if (parser->text_buffer->pos.pos < highest_pos.pos) return;
-	
-	if (parser->text_buffer->pos.pos > highest_pos.pos)
+	if (node == NULL || node->type_name != tree_node_type)
+		return;
+	tree_p tree = CAST(tree_p, node);
+
+	if (tree_is(tree, "call") && strcmp(tree_name(tree_child(tree, 1)), "TimerStart") == 0)
 	{
-		highest_pos = parser->text_buffer->pos;
-		//for (int i = 0; i < nr_expected; i++)
-		//	nt_stack_dispose(expected[i].nt_stack);
-		nr_expected = 0;
+		tree_p args = tree_child_list(tree, 2);
+		long long time_us = args != NULL && args->nr_children == 2 ? time_literal_us(tree_child_tree(args, 2)) : -1;
+		if (time_us >= 0 && time_us % tick_us != 0)
+		{
+			node_p time = tree_child_node(args, 2);
+			if (time_us == 0 || time_us > MAX_HR_TIME_US)
+				compile_error(time, "%lld us cannot be represented by a high-resolution timer", time_us);
+			replace_child_node(tree_child(tree, 1), make_ident_node("HrTimerStart"));
+			replace_by_int(tree_child(args, 2), time_us);
+		}
 	}
-	for (int i = 0; i < nr_expected; i++)
-		if (expected[i].nt_stack == parser->nt_stack && expected[i].element == element)
-			return;
-	if (nr_expected < MAX_EXP_SYM)
+
+	for (int i = 1; i <= tree->nr_children; i++)
 	{
-		parser->nt_stack->ref_count++;
-		expected[nr_expected].nt_stack = parser->nt_stack;
-		expected[nr_expected].element = element;
-		nr_expected++;
+		long long time_us = time_literal_us(tree_child_tree(tree, i));
+		if (time_us < 0)
+		{
+			fold_time_literals(tree_child_node(tree, i));
+			continue;
+		}
+		node_p time = tree_child_node(tree, i);
+		if (time_us % tick_us != 0)
+			compile_error(time, "%lld us is not a whole number of ticks of %lld us", time_us, tick_us);
+		replace_by_int(tree_child(tree, i), time_us / tick_us);
+	}
+
+	if (tree_is(tree, "every"))
+		check_period(tree_child_node(tree, 1), "every");
+	else if (tree_is(tree, "atmost"))
+		check_period(tree_child_node(tree, 1), "at most");
+	else if (tree_is(tree, "call") && strcmp(tree_name(tree_child(tree, 1)), "TimerStart") == 0)
+	{
+		tree_p args = tree_child_list(tree, 2);
+		if (args != NULL && args->nr_children == 2)
+			check_period(tree_child_node(args, 2), "TimerStart");
 	}
 }
 
+/*  A timer that is started with HrTimerStart in a declaration, is also
+	tested with HrTimerDone and stopped with HrTimerCancel instead of
+	TimerDone and TimerReset. A timer that is started with both a tick and
+	a microsecond time is an error. */
 
+typedef struct hr_timer_use *hr_timer_use_p;
+struct hr_timer_use
+{
+	const char *name;
+	bool tick_start;
+	bool hr_start;
+	hr_timer_use_p next;
+};
 
-void print_expected(FILE *fout)
+const char *timer_call_name(tree_p tree)
+/*  Returns the name of the timer of a call to one of the timer functions,
+	or NULL when it is not such a call, or the timer is not a variable */
 {
-	fprintf(fout, "Expect at %d.%d:\n", highest_pos.cur_line, highest_pos.cur_column);
-	for (int i = 0; i < nr_expected; i++)
+	if (!tree_is(tree, "call"))
+		return NULL;
+	const char *function = tree_name(tree_child(tree, 1));
+	if (   strcmp(function, "TimerStart") != 0 && strcmp(function, "HrTimerStart") != 0
+		&& strcmp(function, "TimerDone") != 0 && strcmp(function, "TimerReset") != 0)
+		return NULL;
+	tree_p args = tree_child_list(tree, 2);
+	node_p timer = args != NULL ? tree_child_node(args, 1) : NULL;
+	return timer != NULL && timer->type_name == ident_node_type ? ident_name(tree_child(args, 1)) : NULL;
+}
+
+void collect_timer_starts(node_p node, hr_timer_use_p *ref_uses)
+{
+	if (node == NULL || node->type_name != tree_node_type)
+		return;
+	tree_p tree = CAST(tree_p, node);
+	for (int i = 1; i <= tree->nr_children; i++)
+		collect_timer_starts(tree_child_node(tree, i), ref_uses);
+
+	const char *name = timer_call_name(tree);
+	const char *function = tree_is(tree, "call") ? tree_name(tree_child(tree, 1)) : "";
+	if (name == NULL || (strcmp(function, "TimerStart") != 0 && strcmp(function, "HrTimerStart") != 0))
+		return;
+	hr_timer_use_p use = *ref_uses;
+	while (use != NULL && strcmp(use->name, name) != 0)
+		use = use->next;
+	if (use == NULL)
 	{
-		element_p element = expected[i].element;
-		fprintf(fout, "- expect ");
-		element_print(fout, element);
-		for (nt_stack_p nt_stack = expected[i].nt_stack; nt_stack != NULL; nt_stack = nt_stack->parent)
-			fprintf(fout, " in %s at %d.%d", nt_stack->name, nt_stack->pos.cur_line, nt_stack->pos.cur_column);
-		fprintf(fout, "\n");
+		use = MALLOC(struct hr_timer_use);
+		use->name = name;
+		use->tick_start = use->hr_start = FALSE;
+		use->next = *ref_uses;
+		*ref_uses = use;
 	}
+	bool was_mixed = use->tick_start && use->hr_start;
+	if (strcmp(function, "HrTimerStart") == 0)
+		use->hr_start = TRUE;
+	else
+		use->tick_start = TRUE;
+	if (!was_mixed && use->tick_start && use->hr_start)
+		compile_error(tree_child_node(tree, 1), "timer %s is started with both a tick and a microsecond time", name);
 }
 
-int indent = 0;
-bool start_line = FALSE;
-bool need_sp = FALSE;
+void rewrite_hr_timer_calls(node_p node, hr_timer_use_p uses)
+{
+	if (node == NULL || node->type_name != tree_node_type)
+		return;
+	tree_p tree = CAST(tree_p, node);
+	for (int i = 1; i <= tree->nr_children; i++)
+		rewrite_hr_timer_calls(tree_child_node(tree, i), uses);
 
-void unparse_nl(ostream_p ostream)
+	const char *name = timer_call_name(tree);
+	if (name == NULL)
+		return;
+	hr_timer_use_p use = uses;
+	while (use != NULL && strcmp(use->name, name) != 0)
+		use = use->next;
+	if (use == NULL || !use->hr_start)
+		return;
+	const char *function = tree_name(tree_child(tree, 1));
+	if (strcmp(function, "TimerDone") == 0)
+		replace_child_node(tree_child(tree, 1), make_ident_node("HrTimerDone"));
+	else if (strcmp(function, "TimerReset") == 0)
+		replace_child_node(tree_child(tree, 1), make_ident_node("HrTimerCancel"));
+}
+
+void use_hr_timers(node_p decl)
 {
-	if (start_line)
+	hr_timer_use_p uses = NULL;
+	collect_timer_starts(decl, &uses);
+	rewrite_hr_timer_calls(decl, uses);
+	while (uses != NULL)
 	{
-		ostream_put(ostream, '\n');
-		for (int i = 0; i < indent; i++)
-			ostream_puts(ostream, "    ");
-		start_line = FALSE;
-		need_sp = FALSE;
+		hr_timer_use_p next = uses->next;
+		FREE(uses);
+		uses = next;
 	}
 }
 
-void unparse(result_p result, ostream_p ostream)
+/*
+	Periodic timers and preinitialized state
+	~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+	The 'every' statements in the body of the boot function (set with the
+	--boot-function option) arm a periodic timer for a task at start up.
+	They are given the timers at the end of the timer table, as are the
+	polls with a back-off, such that the application can use the timers
+	from 0. TimersInit arms them at run time, and sets the function of the
+	tasks they start, as such a task is started without being called. With
+	the --preinit option, the scheduler state that would be set up at boot
+	by TaskGroupsInit, ResourcesInit and TimersInit is emitted as
+	initialized data instead, with the timers already armed for a boot at
+	time tick 0. Only the queues of groups and resources are known to
+	tcposc: the main run queue is empty when it is all zeros, and the
+	queues of the critical sections are still initialized at run time. The
+	runtime is to be compiled with TCPOS_PREINITIALIZED, such that it does
+	not define the tables itself.
+*/
+
+const char *boot_function_name = "run";
+bool preinit_mode = FALSE;
+
+typedef struct periodic_timer *periodic_timer_p;
+struct periodic_timer
 {
-	if (result->data == NULL)
-		; //ostream_puts(ostream, "[NULL]");
-	else
+	task_p task;
+	int nr;                /* Counted from the end of the timer table */
+	long long period;
+	periodic_timer_p next;
+};
+periodic_timer_p periodic_timers = NULL;
+periodic_timer_p *ref_next_periodic_timer = &periodic_timers;
+int nr_reserved_timers = 0;
+
+void add_periodic_timers(tree_p function)
+{
+	tree_p body = tree_child_tree(function, 3);
+	if (!tree_is(function, "new_style") || strcmp(ident_name(tree_child(function, 1)), boot_function_name) != 0 || !tree_is(body, "body"))
+		return;
+	tree_p statements = tree_child_list(body, 1);
+	for (int i = 1; statements != NULL && i <= statements->nr_children; i++)
 	{
-		node_p node = CAST(node_p, result->data);
-		if (node->type_name == tree_node_type)
+		tree_p every = tree_child_tree(statements, i);
+		if (!tree_is(every, "every"))
+			continue;
+		node_p name = tree_child_node(every, 2);
+		periodic_timer_p timer = MALLOC(struct periodic_timer);
+		timer->task = find_task(ident_name(tree_child(every, 2)));
+		timer->nr = ++nr_reserved_timers;
+		timer->next = NULL;
+		if (timer->task == NULL)
+			compile_error(name, "every starts %s, which is not a task", ident_name(tree_child(every, 2)));
+		if (!const_int_value(tree_child_node(every, 1), &timer->period))
 		{
-			tree_p tree = (tree_p)node;
-			if (tree->tree_param == NULL)
-				ostream_puts(ostream, "[tree_param NULL]");
-			else if (tree->tree_param->name == list_type)
-			{
-				for (int i = 0; i < tree->nr_children; i++)
-				{
-					if (i > 0 && tree->tree_param->fmt[0] != '\0')
-					{
-						ostream_puts(ostream, tree->tree_param->fmt);
-						need_sp = FALSE;
-					}
-					unparse(&tree->children[i], ostream);
-				}
-			}
-			else
-			{
-				int i = 0;
-				bool is_alphanum = FALSE;
-				for (const char *s = tree->tree_param->fmt; *s != '\0'; s++)
-					if (*s == '%')
-					{
-						if (s[1] == '*')
-						{
-							if (is_alphanum)
-							{
-								need_sp = TRUE;
-								is_alphanum = FALSE;
-							}
-							if (i < tree->nr_children)
-								unparse(&tree->children[i++], ostream);
-							else
-							{
-								ostream_puts(ostream, "(ERR1:");
-								ostream_puts(ostream, tree->tree_param->name);
-								ostream_puts(ostream, " ");
-								ostream_puts(ostream, tree->tree_param->fmt);
-								ostream_puts(ostream, ")");
-							}
-							s++;
-						}
-						else if (s[1] == '%')
-						{
-							ostream_put(ostream, '%');
-							s++;
-						}
-						else if (s[1] == '<')
-						{
-							//ostream_puts(ostream, "[-]");
-							indent--;
-							s++;
-						}
-						else if (s[1] == '>')
-						{
-							//ostream_puts(ostream, "[+]");
-							indent++;
-							s++;
-						}
-						else
-						{
-							ostream_puts(ostream, "[ERR3:");
-							ostream_put(ostream, s[1]);
-							ostream_put(ostream, ']');
-						}
-					}
-					else if (*s == '\n')
-					{
-						if (start_line)
-							ostream_put(ostream, '\n');
-						start_line = TRUE;
-						need_sp = FALSE;
-						is_alphanum = FALSE;
-					}
-					else
-					{
-						unparse_nl(ostream);
-						is_alphanum = ('a' <= *s && *s <= 'z') || ('A' <= *s && *s <= 'Z') || ('0' <= *s && *s <= '9') || *s == '_';
-						if (need_sp && is_alphanum)
-							ostream_put(ostream, ' ');
-						ostream_put(ostream, *s);
-						need_sp = FALSE;
-					}
-				if (is_alphanum)
-					need_sp = TRUE;
-				if (i < tree->nr_children)
-				{
-					ostream_puts(ostream, "(ERR2:");
-					ostream_puts(ostream, tree->tree_param->name);
-					ostream_puts(ostream, " ");
-					ostream_puts(ostream, tree->tree_param->fmt);
-					ostream_puts(ostream, ")");
-				}
-			}
+			compile_error(name, "period of every in %s must be a constant", boot_function_name);
+			timer->period = 1;
 		}
-		else if (result->print != NULL)
+		*ref_next_periodic_timer = timer;
+		ref_next_periodic_timer = &timer->next;
+	}
+}
+
+bool started_by_timer(task_p task)
+{
+	for (periodic_timer_p timer = periodic_timers; timer != NULL; timer = timer->next)
+		if (timer->task == task)
+			return TRUE;
+	return FALSE;
+}
+
+void emit_timer_task_declarations(ostream_p ostream)
+/*  The tasks that are started by a timer, need the function of the task */
+{
+	for (task_p task = tasks; task != NULL; task = task->next)
+		if (started_by_timer(task))
+			ostream_printf(ostream, "void %s(void);\n", task->name);
+}
+
+void emit_periodic_timers(ostream_p ostream)
+{
+	if (periodic_timers == NULL)
+		return;
+	ostream_printf(ostream, "\n");
+	emit_timer_task_declarations(ostream);
+	ostream_printf(ostream, "\nvoid TimersInit(void)\n{\n");
+	for (task_p task = tasks; task != NULL; task = task->next)
+		if (started_by_timer(task))
+			ostream_printf(ostream, "\ttasks[%d].function = %s;\n", task->nr, task->name);
+	for (periodic_timer_p timer = periodic_timers; timer != NULL; timer = timer->next)
+		if (timer->task != NULL)
+			ostream_printf(ostream, "\tTimerStartPeriodic(NR_TIMERS - %d, TIMER_ON_CONST(%lld), %lld, %d); // %s\n",
+						   timer->nr, timer->period, timer->period, timer->task->nr, timer->task->name);
+	ostream_printf(ostream, "}\n");
+}
+
+long long armed_at_boot(long long period)
+/*  Returns the time of TIMER_ON(period) at time tick 0 */
+{
+	return 1 + (period - 1) % max_time_tick;
+}
+
+void emit_table_end(int nr_entries, ostream_p ostream)
+/*  An empty initializer list is not allowed in C */
+{
+	ostream_printf(ostream, nr_entries == 0 ? "\t{ 0 }\n};\n" : "};\n");
+}
+
+void emit_preinitialized_state(ostream_p ostream)
+{
+	int nr_entries = 0;
+	ostream_printf(ostream, "\n// Preinitialized scheduler state, for a runtime compiled with TCPOS_PREINITIALIZED\n");
+	emit_timer_task_declarations(ostream);
+	ostream_printf(ostream, "Task tasks[NR_TASKS] =\n{\n");
+	for (task_p task = tasks; task != NULL; task = task->next)
+		if (task->group != NULL || started_by_timer(task))
 		{
-			unparse_nl(ostream);
-			if (need_sp)
-				ostream_put(ostream, ' ');
-			result->print(result->data, ostream);
-			need_sp = TRUE;
+			ostream_printf(ostream, "\t[%d] = { .function = %s, .group = %d }, // %s\n",
+						   task->nr, started_by_timer(task) ? task->name : "0", task->group != NULL ? task->group->nr : 0, task->name);
+			nr_entries++;
 		}
-		else
+	emit_table_end(nr_entries, ostream);
+
+	nr_entries = 0;
+	ostream_printf(ostream, "Timer timers[NR_TIMERS] =\n{\n");
+	for (periodic_timer_p timer = periodic_timers; timer != NULL; timer = timer->next)
+		if (timer->task != NULL)
 		{
-			ostream_puts(ostream, "(type_name:");
-			ostream_puts(ostream, node->type_name);
-			ostream_puts(ostream, ")");
+			ostream_printf(ostream, "\t[NR_TIMERS - %d] = { %lld, %d, %lld }, // %s\n",
+						   timer->nr, armed_at_boot(timer->period), timer->task->nr, timer->period, timer->task->name);
+			nr_entries++;
 		}
-			
-	//if (result->print == 0 || result->data == NULL)
-	//	ostream_puts(ostream, "<>");
-	}
+	emit_table_end(nr_entries, ostream);
+
+	ostream_printf(ostream, "Queue queues[NR_QUEUES] =\n{\n");
+	ostream_printf(ostream, "\t[MAIN_RUN_QUEUE] = { 0, 0 },\n");
+	for (task_group_p group = task_groups; group != NULL; group = group->next)
+		ostream_printf(ostream, "\t[TASK_GROUP_QUEUE(%d)] = { QUEUE_SENTINEL(TASK_GROUP_QUEUE(%d)), QUEUE_SENTINEL(TASK_GROUP_QUEUE(%d)) }, // %s\n",
+					   group->nr, group->nr, group->nr, group->name);
+	for (resource_p resource = resources; resource != NULL; resource = resource->next)
+		ostream_printf(ostream, "\t[COUNTING_SECTION_QUEUE(%d)] = { QUEUE_SENTINEL(COUNTING_SECTION_QUEUE(%d)), QUEUE_SENTINEL(COUNTING_SECTION_QUEUE(%d)) }, // %s\n",
+					   resource->nr, resource->nr, resource->nr, resource->name);
+	ostream_printf(ostream, "};\n");
+
+	ostream_printf(ostream, "TaskGroup taskGroups[NR_TASK_GROUPS] =\n{\n");
+	for (task_group_p group = task_groups; group != NULL; group = group->next)
+		ostream_printf(ostream, "\t[%d] = { %lld, %lld, %lld, %lld }, // %s\n",
+					   group->nr, group->budget, group->period, group->budget, armed_at_boot(group->period), group->name);
+	emit_table_end(nr_task_groups, ostream);
+
+	ostream_printf(ostream, "CountingSection countingSections[NR_COUNTING_SECTIONS] =\n{\n");
+	for (resource_p resource = resources; resource != NULL; resource = resource->next)
+		ostream_printf(ostream, "\t[%d] = { %lld }, // %s\n", resource->nr, resource->count, resource->name);
+	emit_table_end(nr_resources, ostream);
 }
 
+/*
+	Poll back-off
+	~~~~~~~~~~~~~
+	A poll of a condition that has no interrupt, like 'poll backoff (1..32)
+	{ if (DeviceReady()) break; }', does not queue its step again after
+	every pass that finds the condition false. Instead, the pass calls
+	PollBackoffAgain, which arms the timer of the poll with an interval
+	that starts at the minimum and is doubled on every pass up to the
+	maximum (in ticks), and leaving the poll calls PollBackoffDone. Each
+	such poll is given one of the timers at the end of the timer table,
+	which is recorded for the code generation of the poll in pass2 (see
+	find_poll_backoff).
+*/
 
-
-typedef struct result_list *result_list_p;
-struct result_list
+struct poll_backoff
 {
-	ref_counted_base_t _base;
-	result_t value;
-	result_t next;
+	tree_p backoff;        /* The backoff of the poll statement */
+	task_p task;
+	int timer_nr;          /* Counted from the end of the timer table */
+	long long min;
+	long long max;
+	poll_backoff_p next;
 };
+poll_backoff_p poll_backoffs = NULL;
+poll_backoff_p *ref_next_poll_backoff = &poll_backoffs;
 
-DEFINE_BASE_TYPE(result_list_p)
-
-result_list_p old_result_lists = NULL;
-
-void result_list_release(void *data)
+void add_poll_backoff(tree_p backoff)
 {
-	result_list_p result_list = CAST(result_list_p, data);
-	RESULT_RELEASE(&result_list->value);
-	RESULT_RELEASE(&result_list->next);
-	*(result_list_p*)result_list = old_result_lists;
-	old_result_lists = result_list;
+	node_p min_node = tree_child_node(backoff, 1);
+	long long min, max;
+	if (!const_int_value(min_node, &min) || !const_int_value(tree_child_node(backoff, 2), &max))
+	{
+		compile_error(min_node, "bounds of backoff must be constants");
+		return;
+	}
+	if (min < 1 || max < min || max >= max_time_tick)
+	{
+		compile_error(min_node, "backoff (%lld..%lld) needs 1 <= minimum <= maximum < %lld ticks", min, max, max_time_tick);
+		return;
+	}
+	poll_backoff_p poll_backoff = MALLOC(struct poll_backoff);
+	poll_backoff->backoff = backoff;
+	poll_backoff->task = cur_task;
+	poll_backoff->timer_nr = ++nr_reserved_timers;
+	poll_backoff->min = min;
+	poll_backoff->max = max;
+	poll_backoff->next = NULL;
+	*ref_next_poll_backoff = poll_backoff;
+	ref_next_poll_backoff = &poll_backoff->next;
+	printf("Poll in %s backs off from %lld to %lld ticks with timer NR_TIMERS - %d\n", cur_task->name, min, max, poll_backoff->timer_nr);
+}
+
+poll_backoff_p find_poll_backoff(tree_p backoff)
+{
+	for (poll_backoff_p poll_backoff = poll_backoffs; poll_backoff != NULL; poll_backoff = poll_backoff->next)
+		if (poll_backoff->backoff == backoff)
+			return poll_backoff;
+	return NULL;
 }
 
-void result_list_init(result_list_p result_list)
+node_p make_poll_backoff_timer(poll_backoff_p poll_backoff)
+/*  Returns the expression 'NR_TIMERS - nr' for the timer of the poll */
 {
-	result_list->_base.cnt = 1;
-	result_list->_base.release = result_list_release;
-	RESULT_INIT(&result_list->value);
-	RESULT_INIT(&result_list->next);
+	return make_tree_for(&sub_tp, 2, make_ident_node("NR_TIMERS"), make_int_node(poll_backoff->timer_nr));
 }
 
-result_list_p malloc_result_list(void)
+node_p make_poll_backoff_again(poll_backoff_p poll_backoff)
 {
-	result_list_p result_list;
-	if (old_result_lists)
-	{   result_list = old_result_lists;
-		old_result_lists = *(result_list_p*)old_result_lists;
-	}
-	else
-		result_list = MALLOC(struct result_list);
-	result_list_init(result_list);
-	return result_list;
+	return make_tree_for(&semi_tp, 1,
+		make_tree_for(&call_tp, 2,
+			make_ident_node("PollBackoffAgain"),
+			make_tree_for(&list_tp, 4,
+				make_poll_backoff_timer(poll_backoff),
+				make_int_node(poll_backoff->task->nr),
+				make_int_node((int)poll_backoff->min),
+				make_int_node((int)poll_backoff->max)
+				)));
 }
 
-void result_list_print(void *data, ostream_p ostream)
+node_p make_poll_backoff_done(poll_backoff_p poll_backoff)
 {
-	result_list_p result_list = CAST(result_list_p, data);
-	if (result_list != NULL)
-	{
-		if (result_list->value.data == NULL || result_list->value.print == NULL)
-			ostream_puts(ostream, "NULL");
-		else
-			result_list->value.print(result_list->value.data, ostream);
-		if (result_list->next.data == NULL || result_list->next.print == NULL)
-			ostream_puts(ostream, "NULL");
-		else
-		{
-			ostream_puts(ostream, ",\n");
-			result_list->next.print(result_list->next.data, ostream);
-		}
-	}
+	return make_tree_for(&semi_tp, 1,
+		make_tree_for(&call_tp, 2,
+			make_ident_node("PollBackoffDone"),
+			make_tree_for(&list_tp, 1, make_poll_backoff_timer(poll_backoff))));
 }
 
-void make_result_list(const result_p result, result_p value, result_p next)
-{
-	result_list_p result_list = malloc_result_list();
-	result_assign(&result_list->value, value);
-	result_assign(&result_list->next, next);
-	result_assign_ref_counted(result, &result_list->_base, result_list_print);
-	SET_TYPE(result_list_p, result_list);
-}	
+/*
+	Performance lint
+	~~~~~~~~~~~~~~~~
+	With the --lint option, the task code is checked for constructs that
+	are known to cost performance on the target:
+	- a poll without an 'at most' timeout or a backoff, which can busy
+	  poll forever,
+	- a poll body calling a task or an expensive function, which is
+	  executed on every pass of the poll,
+	- a task call inside a loop, which suspends on every iteration,
+	- a local variable that is used in steps far apart (the steps are
+	  counted in program order, not by liveness), for which RAM is
+	  needed during the whole life time of the task,
+	- an 'every' period that is shorter than the estimated cost of the
+	  first step of the task that is started, which is the step that runs
+	  each period.
+	The cost of code is estimated by counting operations, where calls and
+	loops have a higher weight. Functions can be marked as expensive with
+	the --lint-expensive option.
+*/
 
+bool lint_mode = FALSE;
+const char *input_file_name = "";
+long lint_ops_per_tick = 1000;
+int lint_max_live_steps = 2;
+int nr_lint_warnings = 0;
 
-// ----------------------------------------------------------------------------------------
+#define LINT_CALL_COST 10
+#define LINT_LOOP_FACTOR 10
+#define LINT_EXPENSIVE_COST 200
+
+typedef struct lint_function *lint_function_p;
+struct lint_function
+{
+	const char *name;
+	node_p body;
+	bool expensive;
+	lint_function_p next;
+};
+lint_function_p lint_functions = NULL;
+lint_function_p lint_expensive_functions = NULL; /* Marked with --lint-expensive */
 
+void lint_mark_expensive(const char *name)
+{
+	lint_function_p function = MALLOC(struct lint_function);
+	function->name = name;
+	function->body = NULL;
+	function->expensive = TRUE;
+	function->next = lint_functions;
+	lint_functions = function;
+	lint_expensive_functions = function;
+}
 
+lint_function_p lint_find_function(const char *name)
+{
+	for (lint_function_p function = lint_functions; function != NULL; function = function->next)
+		if (strcmp(function->name, name) == 0)
+			return function;
+	return NULL;
+}
 
-char *strprintf(const char *fmt, ...)
+void lint_warning(node_p node, const char *fmt, ...)
 {
 	va_list arg_ptr;
 	va_start(arg_ptr, fmt);
-	static char buffer[1000];
-	vsnprintf(buffer, 999, fmt, arg_ptr);
+	fprintf(stderr, "%s:%u:%u: warning: ", node->file != NULL ? node->file : input_file_name, node->line, node->column);
+	vfprintf(stderr, fmt, arg_ptr);
+	fprintf(stderr, "\n");
 	va_end(arg_ptr);
-	buffer[999] = '\0';
-	char *str = (char *)malloc(strlen(buffer) + 1);
-	strcpy(str, buffer);
-	return str;
+	nr_lint_warnings++;
 }
 
-typedef struct tree_list *tree_list_p;
-struct tree_list
-{
-	tree_p tree;
-	tree_list_p next;
-};
-
-tree_list_p new_result_list(tree_p tree)
+long estimate_cost(node_p node)
 {
-	tree_list_p tree_list = MALLOC(struct tree_list);
-	tree_list->tree = tree;
-	tree_list->next = NULL;
-	return tree_list;
+	if (node == NULL)
+		return 0;
+	if (node->type_name != tree_node_type)
+		return 1;
+	tree_p tree = CAST(tree_p, node);
+	long cost = 1;
+	for (int i = 0; i < tree->nr_children; i++)
+		cost += estimate_cost(node_of_result(&tree->children[i]));
+	if (tree_is(tree, "while") || tree_is(tree, "do") || tree_is(tree, "for"))
+		cost *= LINT_LOOP_FACTOR;
+	else if (tree_is(tree, "call"))
+	{
+		lint_function_p function = lint_find_function(tree_name(tree_child(tree, 1)));
+		cost += function != NULL && function->expensive ? LINT_EXPENSIVE_COST : LINT_CALL_COST;
+	}
+	return cost;
 }
 
-typedef struct tree_iterator tree_iterator_t, *tree_iterator_p;
-struct tree_iterator
+bool lint_ends_step(tree_p statement)
+/*  Returns whether the statement ends a step, like a poll or a call to a task */
 {
-	const char *name;
-	int nr_children;
-	result_t *children;
-};
+	if (tree_is(statement, "poll") || tree_is(statement, "wait") || tree_is(statement, "queuefor"))
+		return TRUE;
+	if (tree_is(statement, "semi"))
+	{
+		node_p node = tree_child_node(statement, 1);
+		return    is_call_to_task(node)
+			   || (node_is_tree(node, "assignment") && is_call_to_task(tree_child_node(CAST(tree_p, node), 3)));
+	}
+	if (tree_is(statement, "declaration") && tree_is(tree_child_tree(statement, 2), "decl"))
+		return is_call_to_task(decl_initializer(tree_child_tree(tree_child_tree(statement, 2), 1)));
+	return FALSE;
+}
 
-node_p tree_child_node(tree_p tree, int nr)
+bool lint_contains_step_end(node_p node)
 {
-	result_p result = tree_child(tree, nr);
-	return result != NULL ? CAST(node_p, result->data) : NULL;
+	if (node == NULL || node->type_name != tree_node_type)
+		return FALSE;
+	tree_p tree = CAST(tree_p, node);
+	if (lint_ends_step(tree))
+		return TRUE;
+	for (int i = 0; i < tree->nr_children; i++)
+		if (lint_contains_step_end(node_of_result(&tree->children[i])))
+			return TRUE;
+	return FALSE;
 }
 
-tree_p tree_of_result(result_p result)
+long estimate_first_step_cost(node_p node, bool *ends_step)
+/*  Returns the estimated cost of the code up to the first statement that
+	ends the step, where a loop is counted once. Sets ends_step when the
+	step always ends in the code. */
 {
-	if (result != NULL && result->data != NULL)
+	*ends_step = FALSE;
+	if (!lint_contains_step_end(node))
+		return estimate_cost(node);
+	tree_p tree = CAST(tree_p, node);
+	if (lint_ends_step(tree))
 	{
-		node_p node = CAST(node_p, result->data);
-		if (node->type_name == tree_node_type)
-			return CAST(tree_p, node);
+		*ends_step = TRUE;
+		return 1;
 	}
-	return NULL;
+	if (tree_is(tree, "if"))
+	{
+		bool else_ends_step;
+		tree_p else_opt = tree_child_tree(tree, 3);
+		long cost = 1 + estimate_cost(tree_child_node(tree, 1));
+		long then_cost = estimate_first_step_cost(tree_child_node(tree, 2), ends_step);
+		long else_cost = estimate_first_step_cost(else_opt != NULL ? tree_child_node(else_opt, 1) : NULL, &else_ends_step);
+		*ends_step = *ends_step && else_ends_step;
+		return cost + (then_cost > else_cost ? then_cost : else_cost);
+	}
+	long cost = 1;
+	for (int i = 0; i < tree->nr_children && !*ends_step; i++)
+		cost += estimate_first_step_cost(node_of_result(&tree->children[i]), ends_step);
+	return cost;
 }
 
-tree_p tree_child_tree(tree_p tree, int nr) { return tree_of_result(tree_child(tree, nr)); }
+void lint_poll_body(node_p node)
+{
+	if (node == NULL || node->type_name != tree_node_type)
+		return;
+	tree_p tree = CAST(tree_p, node);
+	for (int i = 0; i < tree->nr_children; i++)
+		lint_poll_body(node_of_result(&tree->children[i]));
+	if (!tree_is(tree, "call"))
+		return;
+	const char *name = tree_name(tree_child(tree, 1));
+	lint_function_p function = lint_find_function(name);
+	if (is_call_to_task(node))
+		lint_warning(node, "poll body calls task %s on every pass", name);
+	else if (function != NULL && function->expensive)
+		lint_warning(node, "poll body calls expensive function %s on every pass", name);
+}
 
-tree_p list_of_result(result_p result)
+void lint_node(node_p node, int loop_depth)
 {
-	if (result != NULL && result->data != NULL)
+	if (node == NULL || node->type_name != tree_node_type)
+		return;
+	tree_p tree = CAST(tree_p, node);
+	if (tree_is(tree, "poll"))
 	{
-		node_p node = CAST(node_p, result->data);
-		if (node->type_name == tree_node_type)
+		if (tree_child_node(tree, 1) == NULL && tree_child_node(tree, 3) == NULL)
+			lint_warning(node, "poll without 'at most' timeout or backoff can busy poll without bound");
+		lint_poll_body(tree_child_node(tree, 2));
+	}
+	else if (tree_is(tree, "while") || tree_is(tree, "do") || tree_is(tree, "for"))
+		loop_depth++;
+	else if (tree_is(tree, "call") && loop_depth > 0 && is_call_to_task(node))
+		lint_warning(node, "call to task %s in a loop suspends on every iteration", tree_name(tree_child(tree, 1)));
+	else if (tree_is(tree, "every"))
+	{
+		long long period;
+		task_p task = find_task(tree_name(tree_child(tree, 2)));
+		if (task != NULL && const_int_value(tree_child_node(tree, 1), &period))
 		{
-			tree_p tree = CAST(tree_p, node);
-			return tree->tree_param->name == list_type ? tree : NULL;
+			bool ends_step;
+			long cost = task->body != NULL ? estimate_first_step_cost(task->body, &ends_step) : task->cost;
+			if (cost > period * lint_ops_per_tick)
+				lint_warning(node, "period of %lld ticks is shorter than the estimated cost of the first step of task %s (%ld operations)",
+							 period, task->name, cost);
 		}
 	}
-	return NULL;
+	for (int i = 0; i < tree->nr_children; i++)
+		lint_node(node_of_result(&tree->children[i]), loop_depth);
 }
 
-tree_p tree_child_list(tree_p tree, int nr) { return list_of_result(tree_child(tree, nr)); }
+lint_function_p lint_add_function(tree_p decl)
+/*  Adds the function defined by the declaration, if it is one */
+{
+	tree_p new_style = tree_is(decl, "declaration") ? tree_child_tree(decl, 2) : NULL;
+	if (!tree_is(new_style, "new_style") || !tree_is(tree_child_tree(new_style, 3), "body"))
+		return NULL;
+	lint_function_p function = MALLOC(struct lint_function);
+	function->name = ident_name(tree_child(new_style, 1));
+	function->body = tree_child_node(new_style, 3);
+	function->expensive = FALSE;
+	function->next = lint_functions;
+	lint_functions = function;
+	return function;
+}
 
-void tree_iterator_init(tree_iterator_p tree_iterator, result_p result)
+void lint_task_locals(task_p task)
 {
-	tree_iterator->name = "";
-	tree_iterator->nr_children = 0;
-	tree_p tree = tree_of_result(result);
-	if (tree != NULL)
+	for (var_context_p var = task->local_vars; var != NULL; var = var->next_in_task)
+		if (var->last_step - var->decl_step >= lint_max_live_steps)
+		{
+			int size = type_size(var->type);
+			if (size > 0)
+				lint_warning(var->decl_node, "local %s of task %s is used from step %d to step %d and needs %d bytes of RAM",
+							 var->name, task->name, var->decl_step, var->last_step, size);
+			else
+				lint_warning(var->decl_node, "local %s of task %s is used from step %d to step %d and needs RAM for the whole task",
+							 var->name, task->name, var->decl_step, var->last_step);
+		}
+}
+
+void lint(result_p result)
+{
+	/* Functions defined in the file, that are too expensive to call while polling */
+	TREE_ITERATOR(decls, result);
+	for (int i = 0; i < decls.nr_children; i++)
 	{
-		tree_iterator->name = tree->tree_param->name;
-		tree_iterator->nr_children = tree->nr_children;
-		tree_iterator->children = tree->children;
+		ITERATOR_TREE(decl, decls, i);
+		lint_add_function(decl);
 	}
+	for (lint_function_p function = lint_functions; function != NULL; function = function->next)
+		if (function->body != NULL && estimate_cost(function->body) > LINT_EXPENSIVE_COST)
+			function->expensive = TRUE;
+
+	lint_node(node_of_result(result), 0);
+
+	for (task_p task = tasks; task != NULL; task = task->next)
+		lint_task_locals(task);
+
+	fprintf(stderr, "%d lint warning(s)\n", nr_lint_warnings);
 }
-#define TREE_ITERATOR(N,R) tree_iterator_t N; tree_iterator_init(&N, R)
-#define ITERATOR_TREE(C,I,N) tree_p C = tree_of_result(&I.children[N]);
 
-node_p node_of_result(result_p result)
+void lint_declaration(result_p decl_result, task_p task)
+/*  Lints one declaration, for the streaming compiler. Only the functions
+	defined before the declaration are known, and the body of the function
+	is released after the declaration has been compiled. */
 {
-	return result != 0 && result->data != 0 ? CAST(node_p, result->data) : NULL;
+	lint_function_p function = lint_add_function(tree_of_result(decl_result));
+	if (function != NULL && estimate_cost(function->body) > LINT_EXPENSIVE_COST)
+		function->expensive = TRUE;
+	lint_node(node_of_result(decl_result), 0);
+	if (function != NULL)
+		function->body = NULL;
+	if (task != NULL)
+		lint_task_locals(task);
 }
 
-const char *tree_name(result_p result)
+/*
+	Include files
+	~~~~~~~~~~~~~
+	A declaration like '#include "drivers.h"' is replaced by the
+	declarations of the file, where a relative path is taken relative to
+	the directory of the including file. A file is parsed at most once per
+	run of the compiler: the declarations are kept in a cache, keyed by
+	the path, the modification time and the size, and are reused for every
+	input file that includes it. When the modification time or the size
+	has changed, the file is read, and only parsed again when the hash of
+	its contents has changed. As the compiler changes the declarations,
+	each input file gets a copy of the cached declarations. Within one
+	input file, a file is included only once.
+*/
+
+typedef struct header *header_p;
+struct header
 {
-	if (result == 0)
-		return "<result_p is NULL>";
-	if (result->data == 0)
-		return "<result_p->data is NULL>";
-	node_p node = CAST(node_p, result->data);
-	if (node->type_name == ident_node_type)
-		return CAST(ident_node_p, node)->name;
-	if (node->type_name == tree_node_type)
+	char *path;
+	time_t mtime;
+	off_t size;
+	uint64_t hash;
+	result_t decls;
+	int included_in;       /* Number of the input file that included it last */
+	header_p next;
+};
+header_p headers = NULL;
+non_terminal_p header_root = NULL;
+int nr_input_file = 0;
+int nr_headers_parsed = 0;
+int nr_headers_reused = 0;
+
+uint64_t hash_text(const char *text, size_t len)
+{
+	/* FNV-1a */
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+	return hash;
+}
+
+char *include_path(const char *including_file, const char *name)
+{
+	const char *slash = strrchr(including_file, '/');
+	if (name[0] == '/' || slash == NULL)
+		return strprintf("%s", name);
+	return strprintf("%.*s/%s", (int)(slash - including_file), including_file, name);
+}
+
+header_p find_header(char *path)
+/*  Returns the header for the path, which is parsed when it is not in the
+	cache, or when it has been modified. Returns NULL if it cannot be read. */
+{
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return NULL;
+	header_p *ref_header = &headers;
+	while (*ref_header != NULL && strcmp((*ref_header)->path, path) != 0)
+		ref_header = &(*ref_header)->next;
+	header_p header = *ref_header;
+	if (header != NULL && header->mtime == st.st_mtime && header->size == st.st_size)
 	{
-		tree_p tree = CAST(tree_p, node);
-		if (tree->tree_param == NULL || tree->tree_param->name == NULL)
-			return "<result->data->tree_param == NULL>";
-		return tree->tree_param->name;
+		nr_headers_reused++;
+		return header;
 	}
-	return "<result_p->data has no name>";
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return NULL;
+	text_buffer_t text_buffer;
+	text_buffer_from_file(&text_buffer, f);
+	fclose(f);
+	uint64_t hash = hash_text(text_buffer.buffer, text_buffer.buffer_len);
+	if (header != NULL && header->hash == hash)
+	{
+		/* Only touched */
+		header->mtime = st.st_mtime;
+		header->size = st.st_size;
+		FREE((char*)text_buffer.buffer);
+		nr_headers_reused++;
+		return header;
+	}
+	if (header == NULL)
+	{
+		header = MALLOC(struct header);
+		header->path = path;
+		RESULT_INIT(&header->decls);
+		header->included_in = 0;
+		header->next = NULL;
+		*ref_header = header;
+	}
+	else
+		RESULT_RELEASE(&header->decls);
+	header->mtime = st.st_mtime;
+	header->size = st.st_size;
+	header->hash = hash;
+
+	solutions_t solutions;
+	solutions_init(&solutions, &text_buffer);
+	parser_t parser;
+	parser_init(&parser, &text_buffer);
+	parser.cache_hit_function = solutions_find;
+	parser.cache = &solutions;
+	if (!parse_nt(&parser, header_root, &header->decls) || !text_buffer_end(&text_buffer))
+	{
+		fprintf(stderr, "ERROR: failed to parse %s\n", path);
+		print_expected(stdout);
+		nr_errors++;
+		RESULT_RELEASE(&header->decls);
+	}
+	else
+		set_node_file(node_of_result(&header->decls), header->path);
+	solutions_free(&solutions);
+	FREE((char*)text_buffer.buffer);
+	nr_headers_parsed++;
+	return header;
 }
 
-void node_print(void *data, ostream_p ostream)
+header_p included_header(tree_p include, const char *file_name)
+/*  Returns the header for the include declaration, or NULL when it was
+	already included in the current input file */
 {
-	node_p tree = CAST(node_p, data);
-	if (tree->type_name == ident_node_type)
-		ident_print(data, ostream);
-	else if (tree->type_name == char_node_type)
-		char_node_print(data, ostream);
-	else if (tree->type_name == string_node_type)
-		string_node_print(data, ostream);
-	else if (tree->type_name == int_node_type)
-		int_node_print(data, ostream);
+	node_p name = tree_child_node(include, 1);
+	char *path = include_path(file_name, CAST(string_node_p, name)->str);
+	header_p header = find_header(path);
+	if (header == NULL)
+	{
+		fprintf(stderr, "%s:%u:%u: error: cannot open include file %s\n", file_name, name->line, name->column, path);
+		nr_errors++;
+		free(path);
+		return NULL;
+	}
+	if (header->path != path)
+		free(path);
+	if (header->included_in == nr_input_file)
+		return NULL;
+	header->included_in = nr_input_file;
+	return header;
 }
 
-node_p make_tree_for(tree_param_p tree_param, int nr, ...)
+typedef struct
 {
-	tree_p tree = malloc_tree(tree_param);
-	tree->nr_children = nr;
-	va_list args;
-	va_start(args, nr);
-	tree->children = MALLOC_N(nr, result_t);
-	for (int i = 0; i < nr; i++)
+	result_t *items;
+	int nr;
+	int max;
+} decl_array_t, *decl_array_p;
+
+void collect_declarations(result_p decls, const char *file_name, bool copy, decl_array_p array)
+/*  The declarations of included files are copied, as they are cached */
+{
+	TREE_ITERATOR(iter, decls);
+	for (int i = 0; i < iter.nr_children; i++)
 	{
-		RESULT_INIT(&tree->children[i]);
-		node_p node = va_arg(args, node_p);
-		//fprintf(stderr, "arg %d: %p\n", i, node);
-		
-		if (node != NULL)
-			result_assign_ref_counted(&tree->children[i], &node->_base, node_print);
-	}
-	va_end(args);
-	//fprintf(stderr, "make_tree_for returns %p\n", &tree->_node);
-	return &tree->_node;
+		ITERATOR_TREE(decl, iter, i);
+		if (tree_is(decl, "include"))
+		{
+			header_p header = included_header(decl, file_name);
+			if (header != NULL)
+				collect_declarations(&header->decls, header->path, TRUE, array);
+			continue;
+		}
+		if (array->nr == array->max)
+		{
+			array->max = array->max == 0 ? 64 : 2 * array->max;
+			result_t *items = MALLOC_N(array->max, result_t);
+			for (int j = 0; j < array->nr; j++)
+				items[j] = array->items[j];
+			FREE(array->items);
+			array->items = items;
+		}
+		result_p item = &array->items[array->nr++];
+		RESULT_INIT(item);
+		if (copy)
+			result_assign_ref_counted(item, &copy_node(&decl->_node)->_base, iter.children[i].print);
+		else
+			result_assign(item, &iter.children[i]);
+	}
 }
 
-node_p make_ident_node(const char *name)
+void expand_includes(result_p decls, const char *file_name, result_p result)
+/*  Assigns the declarations with the included declarations in place of
+	the include declarations to result */
 {
-	ident_node_p ident = MALLOC(struct ident_node_t);
-	init_node(&ident->_node, ident_node_type, NULL);
-	ident->name = ident_string(name);
-	return &ident->_node;
-}
+	tree_p list = list_of_result(decls);
+	bool has_includes = FALSE;
+	for (int i = 1; list != NULL && i <= list->nr_children; i++)
+		if (tree_is(tree_child_tree(list, i), "include"))
+			has_includes = TRUE;
+	if (!has_includes)
+	{
+		result_assign(result, decls);
+		return;
+	}
 
-node_p make_int_node(int value)
-{
-	int_node_p int_node = MALLOC(struct int_node_t);
-	init_node(&int_node->_node, int_node_type, NULL);
-	int_node->value = value;
-	return &int_node->_node;
+	decl_array_t array = { NULL, 0, 0 };
+	collect_declarations(decls, file_name, FALSE, &array);
+	tree_p tree = malloc_tree(list->tree_param);
+	tree->nr_children = array.nr;
+	tree->children = MALLOC_N(array.nr, result_t);
+	for (int i = 0; i < array.nr; i++)
+	{
+		RESULT_INIT(&tree->children[i]);
+		result_assign(&tree->children[i], &array.items[i]);
+		RESULT_RELEASE(&array.items[i]);
+	}
+	FREE(array.items);
+	tree_set_pos_from_children(tree);
+	result_assign_ref_counted(result, &tree->_node._base, tree_print);
+	SET_TYPE(tree_p, tree);
 }
 
-typedef struct task_func *task_func_p;
-struct task_func
-{
-	const char *name;
-	result_t statement_trace;
-	task_func_p next;
-};
+/*
+	Phase timing
+	~~~~~~~~~~~~
+	With the --time-report option, the wall time, the CPU time and the
+	number of allocated bytes are reported for each phase of the compiler,
+	together with the peak resident set size of the process (ru_maxrss) at
+	the end of the phase. The latter is process-wide and never decreases,
+	thus it is not the memory used by the phase itself.
+*/
 
-typedef struct task *task_p;
-struct task
-{
-	char *name;
-	int nr;
-	char *result_var_name;
-	int nr_local_vars;
-	int nr_funcs;
-	task_func_p task_funcs;
-	task_func_p *ref_next_task_func;
-	task_p next;
-};
-task_p tasks = NULL;
-task_p *ref_next_task = &tasks;
-int nr_tasks = 0;
+enum time_phase_t { tp_read, tp_grammar, tp_parse, tp_discovery, tp_pass1, tp_pass2, tp_emission, tp_lint, tp_teardown, NR_TIME_PHASES };
 
-task_p cur_task = NULL;
+bool time_report = FALSE;
 
-void add_task_func(result_p statement_trace)
+struct
 {
-	task_func_p task_func = MALLOC(struct task_func);
-	task_func->name = strprintf("%s_step%d", cur_task->name, ++cur_task->nr_funcs);
-	RESULT_INIT(&task_func->statement_trace);
-	task_func->next = NULL;
-	result_assign(&task_func->statement_trace, statement_trace);
-	*cur_task->ref_next_task_func = task_func;
-	cur_task->ref_next_task_func = &task_func->next;
-}
+	const char *name;
+	bool run;
+	double wall;
+	double cpu;
+	unsigned long bytes;
+	long max_rss;
+	double start_wall;
+	double start_cpu;
+	unsigned long start_bytes;
+} time_phases[NR_TIME_PHASES] =
+	{ { "file read" }, { "grammar" }, { "parse" }, { "discovery" }, { "pass1" }, { "pass2" }, { "emission" }, { "lint" }, { "teardown" } };
 
-task_func_p find_task_func(result_p statement)
+double wall_seconds(void)
 {
-	for (task_func_p task_func = cur_task->task_funcs; task_func != NULL; task_func = task_func->next)
-		if (CAST(result_list_p, task_func->statement_trace.data)->value.data == statement->data)
-			return task_func;
-	return NULL;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-task_p find_task(const char *name)
+double cpu_seconds(struct rusage *usage)
 {
-	for (task_p task = tasks; task != NULL; task = task->next)
-		if (strcmp(task->name, name) == 0)
-			return task;
-	return NULL;
+	return   usage->ru_utime.tv_sec + usage->ru_utime.tv_usec * 1e-6
+		   + usage->ru_stime.tv_sec + usage->ru_stime.tv_usec * 1e-6;
 }
 
-typedef struct var_context *var_context_p;
-struct var_context
-{
-	char *name;
-	char *global_name;
-	var_context_p prev;
-};
-
-var_context_p new_var_context(char *name, char *global_name, var_context_p prev)
+void time_phase_begin(enum time_phase_t phase)
 {
-	var_context_p var_context = MALLOC(struct var_context);
-	var_context->name = name;
-	var_context->global_name = global_name;
-	var_context->prev = prev;
-	return var_context;
+	if (!time_report)
+		return;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	time_phases[phase].start_wall = wall_seconds();
+	time_phases[phase].start_cpu = cpu_seconds(&usage);
+	time_phases[phase].start_bytes = slab_allocated_bytes;
 }
 
-char *var_context_global_name(var_context_p var_context, char *name)
+void time_phase_end(enum time_phase_t phase)
 {
-	for (; var_context != 0; var_context = var_context->prev)
-		if (strcmp(var_context->name, name) == 0)	
-			return var_context->global_name;
-	return name;
+	if (!time_report)
+		return;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	time_phases[phase].run = TRUE;
+	time_phases[phase].wall += wall_seconds() - time_phases[phase].start_wall;
+	time_phases[phase].cpu += cpu_seconds(&usage) - time_phases[phase].start_cpu;
+	time_phases[phase].bytes += slab_allocated_bytes - time_phases[phase].start_bytes;
+	time_phases[phase].max_rss = usage.ru_maxrss;
+}
+
+void print_time_report(FILE *fout)
+{
+	fprintf(fout, "%-10s %10s %10s %12s %16s\n", "phase", "wall ms", "cpu ms", "allocated", "process rss kB");
+	for (int phase = 0; phase < NR_TIME_PHASES; phase++)
+		if (time_phases[phase].run)
+			fprintf(fout, "%-10s %10.3f %10.3f %12lu %16ld\n", time_phases[phase].name, time_phases[phase].wall * 1000.0,
+					time_phases[phase].cpu * 1000.0, time_phases[phase].bytes, time_phases[phase].max_rss);
+		else
+			fprintf(fout, "%-10s %10s\n", time_phases[phase].name, "not run");
+	fprintf(fout, "process rss: peak resident set size of the whole process (ru_maxrss) at the end of the phase\n");
 }
 
-tree_list_p new_global_vars = NULL;
-tree_list_p *ref_new_global_var = &new_global_vars;
+/*  - Compiler phases */
 
-void pass1_expr(node_p node, var_context_p var_context, ostream_p ostream)
+bool is_task_declaration(tree_p decl)
 {
-	if (node == NULL)
-		return;
-		
-	if (node->type_name == ident_node_type)
-	{
-		ident_node_p ident = CAST(ident_node_p, node);
-		printf("Replacing %s ", ident->name);
-		ident->name = var_context_global_name(var_context, ident->name);
-		printf("with %s\n", ident->name);
-	}
-	else if (node->type_name == tree_node_type)
-	{
-		tree_p tree = CAST(tree_p, node);
-		for (int i = 0; i < tree->nr_children; i++)
-			pass1_expr(CAST(node_p, tree->children[i].data), var_context, ostream);
-	}
+	if (!tree_is(decl, "declaration"))
+		return FALSE;
+	tree_p types = tree_child_list(decl, 1);
+	return types != 0 && tree_is(tree_child_tree(types, 1), "task");
 }
 
-bool is_call_to_task(node_p node)
+task_p compile_discover_task(tree_p decl)
+/*  Returns the task for a task declaration, otherwise NULL. The task can
+	already have been added by the pre-scan of the streaming compiler.
+	Resources are also added, such that 'queue for' can refer to them. */
 {
-	if (node_is_tree(node, "call"))
+	if (tree_is(decl, "resource"))
+		add_resource(decl);
+	if (!is_task_declaration(decl))
+		return NULL;
+	tree_p types = tree_child_list(decl, 1);
+	char *task_name = ident_name(tree_child(tree_child_tree(decl, 2), 1));
+	result_p result_type = tree_child(types, 2);
+	const char *result_type_name = tree_name(result_type);
+	char *result_var_name = strprintf("%s_result", task_name);
+	task_p task = find_task(task_name);
+	if (task == NULL)
+		task = add_task(task_name);
+	if (task->nr > MAX_TASK_ID)
+		compile_error(tree_child_node(tree_child_tree(decl, 2), 1), "task %s cannot be given an id, the runtime has ids up to %d for tasks",
+					  task_name, MAX_TASK_ID);
+	task->result_var_name = result_var_name;
+	task->body = tree_child_node(tree_child_tree(decl, 2), 3);
+	printf("task %s %s\n", task_name, result_type_name);
+	if (strcmp(result_type_name, "void") != 0)
 	{
-		node_p func_name = tree_child_node(CAST(tree_p, node), 1);
-		if (func_name->type_name == ident_node_type)
-		{
-			ident_node_p ident = CAST(ident_node_p, func_name);
-			return find_task(ident->name) != NULL;
-		}
+		// Add global var
+		node_p declaration 
+			= make_tree_for(&declaration_tp, 2,
+				make_tree_for(&list_tp, 1, node_of_result(result_type)),
+				make_tree_for(&decl_tp, 1,
+					make_tree_for(&list_tp, 1,
+						make_tree_for(&decl_init_tp, 2,
+							make_ident_node(result_var_name),
+							NULL))));
+		*ref_new_global_var = new_result_list((tree_p)declaration);
+		ref_new_global_var = &(*ref_new_global_var)->next;
 	}
-	return FALSE;
+	return task;
 }
 
-task_p task_with_call(node_p node)
+void compile_discover_tasks(result_p result)
 {
-	node_p func_name = tree_child_node(CAST(tree_p, node), 1);
-	if (func_name->type_name == ident_node_type)
+	TREE_ITERATOR(decls0, result);
+	for (int i = 0; i < decls0.nr_children; i++)
 	{
-		ident_node_p ident = CAST(ident_node_p, func_name);
-		return find_task(ident->name);
+		ITERATOR_TREE(decl, decls0, i);
+		compile_discover_task(decl);
 	}
-	return NULL;
 }
 
-void pass1_statement(result_p result, result_p parent_statement_trace, var_context_p var_context, ostream_p ostream)
+void compile_pass1_declaration(result_p decl_result, ostream_p ostream)
 {
 	ENTER_RESULT_CONTEXT
-	
-	tree_p statement = tree_of_result(result);
-	for (int i = 0; i < indent; i++)
-		printf("  ");
-	if (statement == NULL)
-	{
-		printf("pass1_statement: NULL\n");
-		return;
-	}
-	indent++;
-	DECL_RESULT(statement_trace);
-	make_result_list(&statement_trace, result, parent_statement_trace);
-	if (tree_is(statement, "list") || tree_is(statement, "statements"))
+	tree_p decl = tree_of_result(decl_result);
+	if (tree_is(decl, "declaration"))
 	{
-		printf("statements / list\n");
-		for (int i = 1; i <= statement->nr_children; i++)
+		printf("\n");
+		if (is_task_declaration(decl))
 		{
-			tree_p child = tree_child_tree(statement, i);
-			if (child == NULL)
-			{}
-			else if (tree_is(child, "declaration"))
+			cur_task = find_task(ident_name(tree_child(tree_child_tree(decl, 2), 1)));
+			DECL_RESULT(statement_trace);
+			pass1_statement(tree_child(tree_child_tree(tree_child_tree(decl, 2), 3), 1), &statement_trace, NULL, ostream);
+			DISP_RESULT(statement_trace);
+			place_scratch_vars(cur_task, tree_child_node(tree_child_tree(decl, 2), 3));
+			share_task_steps(cur_task);
+			
+			for (task_func_p task_func = cur_task->task_funcs; task_func != 0; task_func = task_func->next)
 			{
-				//result_print(tree_child(statement, i), ostream);
-				tree_p type = tree_child_tree(child, 1);
-				tree_p decl = tree_child_tree(child, 2);
-				//printf("%d", j);
-				tree_p decl_init = tree_child_tree(decl, 1);
-				node_p init = tree_child_node(decl_init, 2);
-				pass1_expr(init, var_context, ostream);
-				node_p var_node = tree_child_node(decl_init, 1);
-				if (var_node->type_name == ident_node_type)
-				{
-					ident_node_p ident = CAST(ident_node_p, var_node);
-					char *loc_var_name = strprintf("%s_var%d_%s", cur_task->name, ++cur_task->nr_local_vars, ident->name);
-					// Add global var
-					var_context = new_var_context(ident->name, loc_var_name, var_context);
-					ident->name = loc_var_name;
-					//printf("var_local %s => %s\n", ident->name, loc_var_name);
-					node_p declaration
-						= make_tree_for(&declaration_tp, 2,
-							type,
-							make_tree_for(&decl_tp, 1,
-								make_tree_for(&decl_init_tp, 2,
-									make_ident_node(loc_var_name),
-									tree_child_tree(decl_init, 2))));
-					*ref_new_global_var = new_result_list((tree_p)declaration);
-					ref_new_global_var = &(*ref_new_global_var)->next;
-				}
-				else
-				{
-					printf("ERROR var decl: ");
-					result_print(tree_child(decl_init, 1), ostream);
-					printf("\n");
-				}
-				if (is_call_to_task(init))
+				if (task_func->shared_with != NULL)
 				{
-					DECL_RESULT(child_trace);
-					make_result_list(&child_trace, tree_child(statement, i), &statement_trace);
-					add_task_func(&child_trace);
-					DISP_RESULT(child_trace);
+					print_shared_step(task_func, ostream);
+					continue;
 				}
+				printf("\nTask func %s : ", task_func->name);
+				result_print(&task_func->statement_trace, ostream);
 				printf("\n");
 			}
-			else
-				pass1_statement(tree_child(statement, i), &statement_trace, var_context, ostream);
 		}
-	}
-	else if (tree_is(statement, "if"))
-	{
-		pass1_expr(tree_child_node(statement, 1), var_context, ostream);
-		pass1_statement(tree_child(statement, 2), &statement_trace, var_context, ostream);
-		pass1_statement(tree_child(tree_child_tree(statement, 3), 1),  &statement_trace, var_context, ostream);
-	}
-	else if (tree_is(statement, "queuefor"))
-	{
-		add_task_func(&statement_trace);
-		pass1_statement(tree_child(statement, 2), &statement_trace, var_context, ostream);
-	}
-	else if (tree_is(statement, "poll"))
-	{
-		add_task_func(&statement_trace);
-		pass1_statement(tree_child(statement, 1), &statement_trace, var_context, ostream);
-		tree_p atmost_opt = tree_child_tree(statement, 2);
-		if (atmost_opt != NULL)
+		else
 		{
-			DECL_RESULT(atmost_statement_trace);
-			make_result_list(&atmost_statement_trace, tree_child(statement, 2), &statement_trace);
-			add_task_func(&atmost_statement_trace);
-			pass1_expr(tree_child_node(atmost_opt, 1), var_context, ostream);
-			pass1_statement(tree_child(atmost_opt, 2), &atmost_statement_trace, var_context, ostream);
-			DISP_RESULT(atmost_statement_trace);
+			if (tree_is(tree_child_tree(decl, 2), "decl"))
+				printf("global variable ");
+			else
+				add_periodic_timers(tree_child_tree(decl, 2));
+			result_print(decl_result, ostream);
 		}
-	}		
-	else if (tree_is(statement, "semi"))
-	{
-		pass1_expr(tree_child_node(statement, 1), var_context, ostream);
-		node_p node = tree_child_node(statement, 1);
-		if (   is_call_to_task(node)
-			|| (   node_is_tree(node, "assignment")
-				&& is_call_to_task(tree_child_node(CAST(tree_p, node), 3))))
-			add_task_func(&statement_trace);
+		printf("\n");
 	}
-	else if (tree_is(statement, "ret"))
+	else if (tree_is(decl, "group"))
+		add_task_group(decl);
+	else if (tree_is(decl, "resource"))
+		{} /* Added during discovery */
+	else if (tree_is(decl, "topic"))
+		add_topic(decl);
+	else
+		printf("other\n");
+	EXIT_RESULT_CONTEXT
+}
+
+void compile_pass1(result_p result, ostream_p ostream)
+{
+	TREE_ITERATOR(decls, result);
+	for (int i = 0; i < decls.nr_children; i++)
+		compile_pass1_declaration(&decls.children[i], ostream);
+}
+
+void compile_emit(ostream_p ostream)
+{
+	printf("Scratch arena peak: %d bytes\n", scratch_arena_peak);
+	emit_scratch_arena(ostream);
+	if (preinit_mode)
+		emit_preinitialized_state(ostream);
+	else
 	{
-		pass1_expr(tree_child_node(statement, 1), var_context, ostream);
+		emit_task_groups(ostream);
+		emit_resources(ostream);
+		emit_periodic_timers(ostream);
 	}
-	else
+	emit_topics(ostream);
+}
+
+void compile(result_p decls, ostream_p ostream)
+{
+	ENTER_RESULT_CONTEXT
+	DECL_RESULT(result);
+	expand_includes(decls, input_file_name, &result);
+	fold_time_literals(node_of_result(&result));
+	TREE_ITERATOR(hr_decls, &result);
+	for (int i = 0; i < hr_decls.nr_children; i++)
+		use_hr_timers(node_of_result(&hr_decls.children[i]));
+	collect_log_formats(node_of_result(&result));
+
+	time_phase_begin(tp_discovery);
+	compile_discover_tasks(&result);
+	time_phase_end(tp_discovery);
+
+	time_phase_begin(tp_pass1);
+	compile_pass1(&result, ostream);
+	time_phase_end(tp_pass1);
+
+	/* pass2 is not yet part of the compiler, hence tp_pass2 is reported as not run */
+
+	time_phase_begin(tp_emission);
+	compile_emit(ostream);
+	time_phase_end(tp_emission);
+
+	if (lint_mode)
 	{
-		printf("pass1_statement: ");
-		tree_print(statement, ostream);
-		printf("\n");
+		time_phase_begin(tp_lint);
+		lint(&result);
+		time_phase_end(tp_lint);
 	}
-	DISP_RESULT(statement_trace);
-	indent--;
+	DISP_RESULT(result);
+	EXIT_RESULT_CONTEXT
 }
 
-void prepend_child_node(result_p children, node_p node)
+void compile_reset(void)
+/*  Resets the state of the compiler for the next input file. The log
+	formats are shared by all input files. */
+{
+	tasks = NULL;
+	ref_next_task = &tasks;
+	nr_tasks = 0;
+	cur_task = NULL;
+	new_global_vars = NULL;
+	ref_new_global_var = &new_global_vars;
+	task_groups = NULL;
+	ref_next_task_group = &task_groups;
+	nr_task_groups = 0;
+	resources = NULL;
+	ref_next_resource = &resources;
+	nr_resources = 0;
+	topics = NULL;
+	ref_next_topic = &topics;
+	nr_topics = 0;
+	periodic_timers = NULL;
+	ref_next_periodic_timer = &periodic_timers;
+	poll_backoffs = NULL;
+	ref_next_poll_backoff = &poll_backoffs;
+	nr_reserved_timers = 0;
+	scratch_arena_peak = 0;
+	scratch_types = NULL;
+	lint_functions = lint_expensive_functions;
+	nr_lint_warnings = 0;
+}
+
+/*
+	Parallel parsing
+	~~~~~~~~~~~~~~~~
+	With the --jobs <n> option, the input is split into n chunks, which are
+	parsed concurrently, each with its own parser and cache. The chunks
+	are split at top-level boundaries, which are found by scanning for a
+	';' at depth zero or a '}' that closes a body that started after a
+	')' (like a function definition), skipping comments, strings and
+	character literals. Each chunk is parsed with the root non-terminal and
+	the lists of declarations are merged into one list. When parsing one
+	of the chunks fails, the input is parsed serially, to report the error
+	in the usual manner.
+*/
+
+#define MAX_PARSE_JOBS 64
+
+typedef struct
 {
-	ENTER_RESULT_CONTEXT
-	DECL_RESULT(child_result)
-	result_assign_ref_counted(&child_result, &node->_base, tree_print);
-	prepend_child(children, &child_result);
-	DISP_RESULT(child_result)
-	EXIT_RESULT_CONTEXT
-}
+	text_buffer_t text_buffer;
+	non_terminal_p root;
+	result_t result;
+	bool parsed;
+	unsigned long work_budget; /* Zero for no budget */
+	parser_t parser;
+	pthread_t thread;
+} parse_job_t, *parse_job_p;
 
+/*  - Function to find the top-level boundaries, returns the number of boundaries found */
 
-void pass2_statement(result_p result, result_p children, ostream_p ostream)
+size_t find_top_level_boundaries(const char *buffer, size_t len, size_t *boundaries, size_t max_boundaries)
 {
-	//ENTER_RESULT_CONTEXT
-	
-	tree_p statement = tree_of_result(result);
-	for (int i = 0; i < indent; i++)
-		printf("  ");
-	if (statement == NULL)
+	size_t nr_boundaries = 0;
+	int depth = 0;
+	bool body_after_bracket = FALSE;
+	char last = '\0'; /* Last character that is not white space */
+	for (size_t i = 0; i < len && nr_boundaries < max_boundaries; i++)
 	{
-		printf("pass2_statement: NULL\n");
-		return;
-	}
-	indent++;
-	if (tree_is(statement, "list") || tree_is(statement, "statements"))
-	{
-		printf("statements / list\n");
-		for (int i = 1; i <= statement->nr_children; i++)
+		char ch = buffer[i];
+		if (ch == '/' && i + 1 < len && buffer[i+1] == '/')
 		{
-			tree_p child = tree_child_tree(statement, i);
-			if (child == NULL)
-			{}
-			else if (tree_is(child, "declaration"))
-			{
-				//result_print(tree_child(statement, i), ostream);
-				//tree_p type = tree_child_tree(child, 1);
-				tree_p decl = tree_child_tree(child, 2);
-
-				tree_p decl_init = tree_child_tree(decl, 1);
-				node_p init = tree_child_node(decl_init, 2);
-				//pass1_expr(init, var_context, ostream);
-				//node_p var_node = tree_child_node(decl_init, 1);
-				if (init != NULL)
-				{
-					if (is_call_to_task(init))
-					{
-						task_p task_called = task_with_call(init);
-						task_func_p task_func = find_task_func(&statement->children[i]);
-						// Create call to task
-						prepend_child_node(children,
-							make_tree_for(&semi_tp, 1,
-								make_tree_for(&call_tp, 2,
-									make_ident_node("os_call_task"),
-									make_tree_for(&list_tp, 3,
-										make_int_node(task_called->nr),
-										make_int_node(cur_task->nr),
-										make_ident_node(task_func->name)
-										))));
-					}
-					else
-					{
-						
-						// Create assignment from declaration
-						prepend_child_node(children,
-							make_tree_for(&semi_tp, 1,
-								make_tree_for(&assignment_tp, 3,
-									tree_child_node(decl_init, 1),
-									make_tree_for(&ass_tp, 0),
-									init)));
-					}
-				}
-				printf("\n");
-			}
-			else
+			while (i < len && buffer[i] != '\n')
+				i++;
+			continue;
+		}
+		if (ch == '/' && i + 1 < len && buffer[i+1] == '*')
+		{
+			for (i += 2; i + 1 < len && !(buffer[i] == '*' && buffer[i+1] == '/'); i++)
+				;
+			i++;
+			continue;
+		}
+		if (ch == '"' || ch == '\'')
+		{
+			for (i++; i < len && buffer[i] != ch; i++)
+				if (buffer[i] == '\\')
+					i++;
+			last = ch;
+			continue;
+		}
+		if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r')
+			continue;
+		if (ch == '#' && depth == 0)
+		{
+			/* A directive, like '#include "file"', ends at the end of the line */
+			while (i < len && buffer[i] != '\n')
+				i++;
+			boundaries[nr_boundaries++] = i;
+			continue;
+		}
+		if (ch == '{' || ch == '(' || ch == '[')
+		{
+			if (ch == '{' && depth == 0)
+				body_after_bracket = last == ')';
+			depth++;
+		}
+		else if (ch == '}' || ch == ')' || ch == ']')
+		{
+			if (--depth < 0)
+				return 0;
+			if (ch == '}' && depth == 0 && body_after_bracket)
 			{
-				pass2_statement(tree_child(statement, i), children, ostream);
+				/* Not when followed by ';' as in 'group' declarations */
+				size_t j = i + 1;
+				while (j < len && (buffer[j] == ' ' || buffer[j] == '\t' || buffer[j] == '\n' || buffer[j] == '\r'))
+					j++;
+				if (j == len || buffer[j] != ';')
+					boundaries[nr_boundaries++] = i + 1;
 			}
 		}
+		else if (ch == ';' && depth == 0)
+			boundaries[nr_boundaries++] = i + 1;
+		last = ch;
 	}
-	else if (tree_is(statement, "if"))
+	return nr_boundaries;
+}
+
+void parse_job_init(parse_job_p job, text_buffer_p text_buffer, text_buffer_p scan, size_t start, size_t end, non_terminal_p root)
+/*  Copies the text from start to end for the job. The scan is used to
+	determine the line and column of the start. */
+{
+	while (scan->pos.pos < start)
+		text_buffer_next(scan);
+	size_t len = end - start;
+	char *chunk = MALLOC_N(len + 1, char);
+	memcpy(chunk, text_buffer->buffer + start, len);
+	chunk[len] = '\0';
+	job->text_buffer = *text_buffer;
+	job->text_buffer.buffer = chunk;
+	job->text_buffer.buffer_len = len;
+	job->text_buffer.info = chunk;
+	job->text_buffer.pos.pos = 0;
+	job->text_buffer.pos.cur_line = scan->pos.cur_line;
+	job->text_buffer.pos.cur_column = scan->pos.cur_column;
+	job->root = root;
+	RESULT_INIT(&job->result);
+	job->parsed = FALSE;
+	job->work_budget = 0;
+}
+
+void *parse_job_run(void *data)
+{
+	parse_job_p job = (parse_job_p)data;
+
+	solutions_t solutions;
+	solutions_init(&solutions, &job->text_buffer);
+
+	/* The parser is kept, such that the work can be reported */
+	parser_p parser = &job->parser;
+	parser_init(parser, &job->text_buffer);
+	parser->cache_hit_function = solutions_find;
+	parser->cache = &solutions;
+	parser->collect_statistics = FALSE;
+	parser->work_budget = job->work_budget;
+
+	job->parsed = parse_nt(parser, job->root, &job->result) && text_buffer_end(&job->text_buffer);
+
+	solutions_free(&solutions);
+	slab_flush_magazines();
+	return NULL;
+}
+
+bool parse_parallel(text_buffer_p text_buffer, non_terminal_p root, int nr_jobs, result_p result)
+{
+	if (nr_jobs > MAX_PARSE_JOBS)
+		nr_jobs = MAX_PARSE_JOBS;
+
+	/* Select the boundaries closest after equal parts of the input */
+	size_t *boundaries = MALLOC_N(text_buffer->buffer_len + 1, size_t);
+	size_t nr_boundaries = find_top_level_boundaries(text_buffer->buffer, text_buffer->buffer_len, boundaries, text_buffer->buffer_len + 1);
+	size_t cuts[MAX_PARSE_JOBS + 1];
+	int nr_cuts = 0;
+	cuts[nr_cuts++] = 0;
+	size_t b = 0;
+	for (int k = 1; k < nr_jobs; k++)
 	{
-		//pass2_expr(tree_child_node(statement, 1), var_context, ostream);
-		//pass2_statement(tree_child(statement, 2), &statement_trace, var_context, ostream);
-		//pass2_statement(tree_child(tree_child_tree(statement, 3), 1),  &statement_trace, var_context, ostream);
+		size_t target = k * text_buffer->buffer_len / nr_jobs;
+		while (b < nr_boundaries && (boundaries[b] < target || boundaries[b] <= cuts[nr_cuts-1]))
+			b++;
+		if (b < nr_boundaries && boundaries[b] < text_buffer->buffer_len)
+			cuts[nr_cuts++] = boundaries[b];
 	}
-	else if (tree_is(statement, "queuefor"))
+	cuts[nr_cuts] = text_buffer->buffer_len;
+	FREE(boundaries);
+	if (nr_cuts < 2)
+		return FALSE;
+
+	/* Start a job for each chunk, with the line and column of its start */
+	parse_job_t jobs[MAX_PARSE_JOBS];
+	text_buffer_t scan = *text_buffer;
+	for (int i = 0; i < nr_cuts; i++)
 	{
-		// Create call to os_query_for;
-		//add_task_func(&statement_trace, NULL);
-		//pass2_statement(tree_child(statement, 2), &statement_trace, var_context, ostream);
+		parse_job_init(&jobs[i], text_buffer, &scan, cuts[i], cuts[i+1], root);
+		if (pthread_create(&jobs[i].thread, NULL, parse_job_run, &jobs[i]) != 0)
+			parse_job_run(&jobs[i]);
 	}
-	else if (tree_is(statement, "poll"))
+
+	/* Merge the lists of declarations */
+	tree_param_p tree_param = NULL;
+	int nr_children = 0;
+	bool parsed = TRUE;
+	for (int i = 0; i < nr_cuts; i++)
 	{
-		// Create
-		//add_task_func(&statement_trace, NULL);
-		//pass2_statement(tree_child(statement, 1), &statement_trace, var_context, ostream);
-		//tree_p atmost_opt = tree_child_tree(statement, 2);
-		//if (atmost_opt != NULL)
-		//{
-		//	DECL_RESULT(atmost_statement_trace);
-		//	make_result_list(&atmost_statement_trace, tree_child(statement, 2), &statement_trace);
-		//	add_task_func(&atmost_statement_trace, NULL);
-		//	//pass2_expr(tree_child_node(atmost_opt, 1), var_context, ostream);
-		//	pass2_statement(tree_child(atmost_opt, 2), &atmost_statement_trace, var_context, ostream);
-		//	DISP_RESULT(atmost_statement_trace);
-		//}
+		pthread_join(jobs[i].thread, NULL);
+		FREE((char*)jobs[i].text_buffer.buffer);
+		/* A chunk with only white space and comments has no result */
+		tree_p list = tree_of_result(&jobs[i].result);
+		if (!jobs[i].parsed || (list == NULL && jobs[i].result.data != NULL) || (list != NULL && list->tree_param->name != list_type))
+			parsed = FALSE;
+		else if (list != NULL)
+		{
+			nr_children += list->nr_children;
+			tree_param = list->tree_param;
+		}
 	}
-	else if (tree_is(statement, "semi"))
+	if (parsed && tree_param != NULL)
 	{
-		//for (int i = 1; i <= statement->nr_children; i++)
-		//	pass2_expr(tree_child_node(statement, i), var_context, ostream);
-		if (statement->nr_children == 1)
+		tree_p tree = malloc_tree(tree_param);
+		tree->nr_children = nr_children;
+		tree->children = MALLOC_N(nr_children, result_t);
+		int j = 0;
+		for (int i = 0; i < nr_cuts; i++)
 		{
-			node_p node = tree_child_node(statement, 1);
-			if (   is_call_to_task(node)
-				|| (   node_is_tree(node, "assignment")
-					&& is_call_to_task(tree_child_node(CAST(tree_p, node), 3))))
+			tree_p list = tree_of_result(&jobs[i].result);
+			for (int k = 0; list != NULL && k < list->nr_children; k++, j++)
 			{
-				// Create call to task
-				//add_task_func(&statement_trace, NULL);
+				RESULT_INIT(&tree->children[j]);
+				result_assign(&tree->children[j], &list->children[k]);
 			}
 		}
+		tree_set_pos_from_children(tree);
+		result_assign_ref_counted(result, &tree->_node._base, tree_print);
+		SET_TYPE(tree_p, tree);
 	}
-	else if (tree_is(statement, "ret"))
-	{
-		// Create statement to retun
-		//pass1_expr(tree_child_node(statement, 1), var_context, ostream);
-	}
-	else
+	for (int i = 0; i < nr_cuts; i++)
+		RESULT_RELEASE(&jobs[i].result);
+	return parsed;
+}
+
+/*
+	Streaming compilation
+	~~~~~~~~~~~~~~~~~~~~~
+	With the --stream option, the input is not parsed as a whole. It is cut
+	at the top-level boundaries and each part is parsed with its own cache,
+	compiled and released before the next part is parsed. In this way the
+	memory used for the parse tree and the cache is bounded by the largest
+	declaration instead of the size of the input. Because a task can be
+	called before it is declared, the names of the tasks are collected with
+	a scan of the text before the first part is parsed. Steps are not
+	shared between tasks in this mode, because that would need the
+	statements of all steps. The statements of the steps of a task are
+	released with its part.
+*/
+
+const char *skip_white_space_and_comments(const char *s, const char *end)
+{
+	for (;;)
 	{
-		//printf("pass1_statement: ");
-		//tree_print(statement, ostream);
-		//printf("\n");
+		while (s < end && (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r'))
+			s++;
+		if (s + 1 < end && s[0] == '/' && s[1] == '/')
+			while (s < end && *s != '\n')
+				s++;
+		else if (s + 1 < end && s[0] == '/' && s[1] == '*')
+		{
+			for (s += 2; s + 1 < end && !(s[0] == '*' && s[1] == '/'); s++)
+				;
+			s = s + 2 < end ? s + 2 : end;
+		}
+		else
+			return s;
 	}
-	indent--;
 }
 
+bool is_ident_char(char ch)
+{
+	return ('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z') || ('0' <= ch && ch <= '9') || ch == '_';
+}
 
-void compile(result_p result, ostream_p ostream)
+void prescan_task(const char *s, const char *end)
+/*  Adds the task, if the text is a task declaration, like 'task int f(void) {...}' */
 {
-	//result_list_p tasks = NULL;
-	//result_list_p *ref_next_task = &tasks;
-	ENTER_RESULT_CONTEXT
-	
-	TREE_ITERATOR(decls0, result);
-	for (int i = 0; i < decls0.nr_children; i++)
+	s = skip_white_space_and_comments(s, end);
+	if (end - s < 5 || strncmp(s, "task", 4) != 0 || is_ident_char(s[4]))
+		return;
+	const char *bracket = s + 4;
+	while (bracket < end && *bracket != '(')
+		bracket++;
+	const char *name_end = bracket;
+	while (name_end > s + 4 && (name_end[-1] == ' ' || name_end[-1] == '\t' || name_end[-1] == '\n' || name_end[-1] == '\r'))
+		name_end--;
+	const char *name = name_end;
+	while (name > s + 4 && is_ident_char(name[-1]))
+		name--;
+	if (bracket == end || name == name_end)
+		return;
+	char *copy = strndup(name, name_end - name);
+	char *task_name = ident_string(copy);
+	free(copy);
+	if (find_task(task_name) == NULL)
+		add_task(task_name);
+}
+
+void compile_stream_declaration(result_p decl_result, const char *file_name, ostream_p ostream)
+{
+	tree_p decl = tree_of_result(decl_result);
+	if (tree_is(decl, "include"))
 	{
-		ITERATOR_TREE(decl, decls0, i);
-		if (tree_is(decl, "declaration"))
+		header_p header = included_header(decl, file_name);
+		TREE_ITERATOR(header_decls, header != NULL ? &header->decls : NULL);
+		for (int i = 0; i < header_decls.nr_children; i++)
 		{
-			tree_p types = tree_child_list(decl, 1);
-			bool is_task = types != 0 && tree_is(tree_child_tree(types, 1), "task");
-			if (is_task)
-			{
-				char *task_name = ident_name(tree_child(tree_child_tree(decl, 2), 1));
-				result_p result_type = tree_child(types, 2);
-				const char *result_type_name = tree_name(result_type);
-				char *result_var_name = strprintf("%s_result", task_name);
-				cur_task = MALLOC(struct task);
-				cur_task->name = task_name;
-				cur_task->nr = nr_tasks++;
-				cur_task->result_var_name = result_var_name;
-				cur_task->nr_local_vars = 0;
-				cur_task->nr_funcs = 0;
-				cur_task->task_funcs = NULL;
-				cur_task->ref_next_task_func = &cur_task->task_funcs;
-				cur_task->next = NULL;
-				*ref_next_task = cur_task;
-				ref_next_task = &cur_task->next;
-				printf("task %s %s\n", task_name, result_type_name);
-				if (strcmp(result_type_name, "void") != 0)
-				{
-					// Add global var
-					node_p declaration 
-						= make_tree_for(&declaration_tp, 2,
-							make_tree_for(&list_tp, 1, node_of_result(result_type)),
-							make_tree_for(&decl_tp, 1,
-								make_tree_for(&list_tp, 1,
-									make_tree_for(&decl_init_tp, 2,
-										make_ident_node(result_var_name),
-										NULL))));
-					*ref_new_global_var = new_result_list((tree_p)declaration);
-					ref_new_global_var = &(*ref_new_global_var)->next;
-				}
-			}
+			/* The cached declaration is copied, as it is changed */
+			result_t copy;
+			RESULT_INIT(&copy);
+			result_assign_ref_counted(&copy, &copy_node(node_of_result(&header_decls.children[i]))->_base, header_decls.children[i].print);
+			compile_stream_declaration(&copy, header->path, ostream);
+			RESULT_RELEASE(&copy);
 		}
+		return;
 	}
 
-	cur_task = tasks;
-	TREE_ITERATOR(decls, result);
-	for (int i = 0; i < decls.nr_children; i++)
+	fold_time_literals(node_of_result(decl_result));
+	use_hr_timers(node_of_result(decl_result));
+	collect_log_formats(node_of_result(decl_result));
+
+	time_phase_begin(tp_discovery);
+	task_p task = compile_discover_task(decl);
+	time_phase_end(tp_discovery);
+
+	time_phase_begin(tp_pass1);
+	compile_pass1_declaration(decl_result, ostream);
+	time_phase_end(tp_pass1);
+
+	if (lint_mode)
 	{
-		ITERATOR_TREE(decl, decls, i);
-		if (tree_is(decl, "declaration"))
+		time_phase_begin(tp_lint);
+		lint_declaration(decl_result, task);
+		time_phase_end(tp_lint);
+	}
+
+	/* The body and the statements of the steps are released with the parse tree */
+	if (task != NULL)
+	{
+		bool ends_step;
+		task->cost = estimate_first_step_cost(task->body, &ends_step);
+		task->body = NULL;
+		for (task_func_p task_func = task->task_funcs; task_func != NULL; task_func = task_func->next)
+			RESULT_RELEASE(&task_func->statement_trace);
+	}
+}
+
+bool compile_stream(text_buffer_p text_buffer, non_terminal_dict_p all_nt, unsigned long parse_budget, ostream_p ostream)
+/*  With a parse budget, the budget applies to each part. */
+{
+	non_terminal_p root = find_nt("root", &all_nt);
+	size_t *boundaries = MALLOC_N(text_buffer->buffer_len + 2, size_t);
+	size_t nr_boundaries = find_top_level_boundaries(text_buffer->buffer, text_buffer->buffer_len, boundaries + 1, text_buffer->buffer_len + 1);
+	boundaries[0] = 0;
+	if (boundaries[nr_boundaries] < text_buffer->buffer_len)
+		boundaries[++nr_boundaries] = text_buffer->buffer_len;
+
+	for (size_t i = 0; i < nr_boundaries; i++)
+		prescan_task(text_buffer->buffer + boundaries[i], text_buffer->buffer + boundaries[i+1]);
+
+	bool parsed = TRUE;
+	text_buffer_t scan = *text_buffer;
+	for (size_t i = 0; i < nr_boundaries && parsed; i++)
+	{
+		parse_job_t job;
+		parse_job_init(&job, text_buffer, &scan, boundaries[i], boundaries[i+1], root);
+		unsigned int line = job.text_buffer.pos.cur_line;
+		unsigned int column = job.text_buffer.pos.cur_column;
+		job.work_budget = parse_budget;
+		reset_parse_work(all_nt);
+		time_phase_begin(tp_parse);
+		parse_job_run(&job);
+		time_phase_end(tp_parse);
+
+		/* A part with only white space and comments has no result */
+		tree_p list = tree_of_result(&job.result);
+		if (job.parser.out_of_work)
 		{
-			printf("\n");
-			tree_p types = tree_child_list(decl, 1);
-			bool is_task = types != 0 && tree_is(tree_child_tree(types, 1), "task");
-			if (is_task)
-			{
-				DECL_RESULT(statement_trace);
-				pass1_statement(tree_child(tree_child_tree(tree_child_tree(decl, 2), 3), 1), &statement_trace, NULL, ostream);
-				DISP_RESULT(statement_trace);
-				
-				for (task_func_p task_func = cur_task->task_funcs; task_func != 0; task_func = task_func->next)
-				{
-					printf("\nTask func %s : ", task_func->name);
-					result_print(&task_func->statement_trace, ostream);
-					printf("\n");
-				}
-				cur_task = cur_task->next;
-			}
-			else
-			{
-				if (tree_is(tree_child_tree(decl, 2), "decl"))
-					printf("global variable ");
-				result_print(&decls.children[i], ostream);
-			}
-			printf("\n");
+			parser_report_work(&job.parser, all_nt, stderr);
+			parsed = FALSE;
+		}
+		else if (!job.parsed || (list == NULL && job.result.data != NULL) || (list != NULL && list->tree_param->name != list_type))
+		{
+			fprintf(stderr, "ERROR: %s:%u:%u: failed to parse the declaration starting here\n", input_file_name, line, column);
+			print_expected(stdout);
+			parsed = FALSE;
 		}
 		else
-			printf("other\n");
+			for (int j = 0; list != NULL && j < list->nr_children; j++)
+				compile_stream_declaration(&list->children[j], input_file_name, ostream);
+		RESULT_RELEASE(&job.result);
+		FREE(job.parser.work_per_line);
+		FREE((char*)job.text_buffer.buffer);
 	}
-	EXIT_RESULT_CONTEXT
+	FREE(boundaries);
+	if (!parsed)
+		return FALSE;
+
+	time_phase_begin(tp_emission);
+	compile_emit(ostream);
+	time_phase_end(tp_emission);
+	if (lint_mode)
+		fprintf(stderr, "%d lint warning(s)\n", nr_lint_warnings);
+	return TRUE;
 }
 
-int main(int argc, char *argv[])
+/*  - Function to compile one input file, returns whether it was compiled */
+
+bool compile_file(const char *file_name, non_terminal_dict_p all_nt, int nr_jobs, unsigned long parse_budget)
 {
-	if (argc != 2)
+	FILE *f = fopen(file_name, "r");
+	if (f == 0)
 	{
-		printf("Usuage: %s <filename>\n", argv[0]);
-		return 0;
+		printf("Cannot open %s\n", file_name);
+		return FALSE;
 	}
-	FILE *f = fopen(argv[1], "r");
-	if (f == 0)
+	if (++nr_input_file > 1)
 	{
-		printf("Cannot open %s\n", argv[1]);
-		return 0;
+		compile_reset();
+		/* Return the slabs that were only used for the previous input file */
+		slab_flush_magazines();
+		slab_trim();
 	}
+	reset_parse_work(all_nt);
+	input_file_name = file_name;
+	time_phase_begin(tp_read);
 	text_buffer_t text_buffer;
 	text_buffer_from_file(&text_buffer, f);
 	fclose(f);
-	
-	file_ostream_t debug_ostream;
-	file_ostream_init(&debug_ostream, stdout);
-	stdout_stream = &debug_ostream.ostream;
-	
-	non_terminal_dict_p all_nt = NULL;
-	c_grammar(&all_nt);
-    //test_c_grammar(&all_nt_c_grammar);
+	time_phase_end(tp_read);
 
 	ENTER_RESULT_CONTEXT
 
@@ -4678,9 +8763,25 @@ int main(int argc, char *argv[])
 	parser_init(&parser, &text_buffer);
 	parser.cache_hit_function = solutions_find;
 	parser.cache = &solutions;
+	parser.work_budget = parse_budget;
 	
+	bool compiled = FALSE;
 	DECL_RESULT(result);
-	if (parse_nt(&parser, find_nt("root", &all_nt), &result) && text_buffer_end(&text_buffer))
+	time_phase_begin(tp_parse);
+	/* Parsing with a budget is done serially, because the work is counted per parser */
+	bool parsed_in_parallel = !stream_mode && nr_jobs > 1 && parse_budget == 0 && parse_parallel(&text_buffer, find_nt("root", &all_nt), nr_jobs, &result);
+	bool parsed = parsed_in_parallel || (!stream_mode && parse_nt(&parser, find_nt("root", &all_nt), &result));
+	time_phase_end(tp_parse);
+	if (stream_mode)
+	{
+		/* Each part is parsed and compiled before the next part is parsed */
+		file_ostream_t out_ostream;
+		file_ostream_init(&out_ostream, stdout);
+		compiled = compile_stream(&text_buffer, all_nt, parse_budget, &out_ostream.ostream);
+	}
+	else if (parser.out_of_work)
+		parser_report_work(&parser, all_nt, stderr);
+	else if (parsed && (parsed_in_parallel || text_buffer_end(&text_buffer)))
 	{
 		if (result.data == NULL)
 		{
@@ -4694,6 +8795,7 @@ int main(int argc, char *argv[])
 			//result_print(&result, &out_ostream.ostream);
 			//printf("\n");
 			compile(&result, &out_ostream.ostream);
+			compiled = TRUE;
 		}
 	}
 	else
@@ -4702,10 +8804,153 @@ int main(int argc, char *argv[])
 		print_expected(stdout);
 	}
 	DISP_RESULT(result);
+	FREE(parser.work_per_line);
 
 	EXIT_RESULT_CONTEXT
+	time_phase_begin(tp_teardown);
 	solutions_free(&solutions);
+	FREE((char*)text_buffer.buffer);
+	time_phase_end(tp_teardown);
+	return compiled;
+}
+
+#ifdef USE_GRAMMAR_TABLES
+#include "tcposc_grammar.h"
+#endif
+
+int main(int argc, char *argv[])
+{
+	const char **file_names = MALLOC_N(argc, const char *);
+	int nr_file_names = 0;
+	const char *log_ids_file_name = NULL;
+	int nr_jobs = 1;
+	const char *memo_profile_file_name = NULL;
+	const char *memo_profile_out_file_name = NULL;
+	unsigned long parse_budget = 0;
+	bool analyze_grammar_mode = FALSE;
+	const char *grammar_tables_file_name = NULL;
+	bool alloc_report = FALSE;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--log-ids") == 0 && i + 1 < argc)
+			log_ids_file_name = argv[++i];
+		else if (strcmp(argv[i], "--memo-profile") == 0 && i + 1 < argc)
+			memo_profile_file_name = argv[++i];
+		else if (strcmp(argv[i], "--memo-profile-out") == 0 && i + 1 < argc)
+			memo_profile_out_file_name = argv[++i];
+		else if (strcmp(argv[i], "--parse-budget") == 0 && i + 1 < argc)
+			parse_budget = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--emit-grammar-tables") == 0 && i + 1 < argc)
+			grammar_tables_file_name = argv[++i];
+		else if (strcmp(argv[i], "--tick-us") == 0 && i + 1 < argc)
+			tick_us = atoll(argv[++i]);
+		else if (strcmp(argv[i], "--max-time-tick") == 0 && i + 1 < argc)
+			max_time_tick = atoll(argv[++i]);
+		else if (strcmp(argv[i], "--boot-function") == 0 && i + 1 < argc)
+			boot_function_name = argv[++i];
+		else if (strcmp(argv[i], "--preinit") == 0)
+			preinit_mode = TRUE;
+		else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+			nr_jobs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--stream") == 0)
+			stream_mode = TRUE;
+		else if (strcmp(argv[i], "--time-report") == 0)
+			time_report = TRUE;
+		else if (strcmp(argv[i], "--alloc-report") == 0)
+			alloc_report = TRUE;
+		else if (strcmp(argv[i], "--analyze-grammar") == 0)
+			analyze_grammar_mode = TRUE;
+		else if (strcmp(argv[i], "--lint") == 0)
+			lint_mode = TRUE;
+		else if (strcmp(argv[i], "--lint-expensive") == 0 && i + 1 < argc)
+			lint_mark_expensive(argv[++i]);
+		else if (strcmp(argv[i], "--ops-per-tick") == 0 && i + 1 < argc)
+			lint_ops_per_tick = atol(argv[++i]);
+		else if (argv[i][0] != '-')
+			file_names[nr_file_names++] = argv[i];
+		else
+		{
+			nr_file_names = 0;
+			break;
+		}
+	}
+	if (tick_us <= 0 || max_time_tick < 2)
+	{
+		fprintf(stderr, "ERROR: --tick-us should be positive and --max-time-tick at least 2\n");
+		return 1;
+	}
+	if (analyze_grammar_mode || grammar_tables_file_name != NULL)
+	{
+		non_terminal_dict_p all_nt = NULL;
+		c_grammar(&all_nt);
+		if (analyze_grammar_mode)
+			analyze_grammar(all_nt, "root", stdout);
+		if (grammar_tables_file_name != NULL && !emit_grammar_tables(grammar_tables_file_name, all_nt))
+		{
+			fprintf(stderr, "ERROR: cannot write %s\n", grammar_tables_file_name);
+			return 1;
+		}
+		return 0;
+	}
+	if (nr_file_names == 0)
+	{
+		printf("Usuage: %s --analyze-grammar\n", argv[0]);
+		printf("Usuage: %s --emit-grammar-tables <file>\n", argv[0]);
+		printf("Usuage: %s [--log-ids <file>] [--memo-profile <file>] [--memo-profile-out <file>] [--parse-budget <n>] [--tick-us <n>] [--max-time-tick <n>] [--boot-function <name>] [--preinit] [--alloc-report] [--time-report] [--jobs <n> | --stream] [--lint [--lint-expensive <function>] [--ops-per-tick <n>]] <filename> ...\n", argv[0]);
+		return 0;
+	}
+	file_ostream_t debug_ostream;
+	file_ostream_init(&debug_ostream, stdout);
+	stdout_stream = &debug_ostream.ostream;
+	
+	time_phase_begin(tp_grammar);
+#ifdef USE_GRAMMAR_TABLES
+	non_terminal_dict_p all_nt = grammar_tables_init();
+#else
+	non_terminal_dict_p all_nt = NULL;
+	c_grammar(&all_nt);
+#endif
+    //test_c_grammar(&all_nt_c_grammar);
+	if (memo_profile_file_name != NULL && !read_memo_profile(memo_profile_file_name, all_nt))
+		fprintf(stderr, "ERROR: cannot read %s\n", memo_profile_file_name);
+	resolve_memo_policies(all_nt, memo_profile_file_name != NULL);
+	header_root = find_nt("root", &all_nt);
+	time_phase_end(tp_grammar);
+
+	/* The included files are parsed once for all input files */
+	bool compiled = FALSE;
+	for (int i = 0; i < nr_file_names; i++)
+	{
+		if (nr_file_names > 1)
+			printf("\nfile %s\n", file_names[i]);
+		if (compile_file(file_names[i], all_nt, nr_jobs, parse_budget))
+			compiled = TRUE;
+		else
+			nr_errors++;
+	}
+	FREE(file_names);
+	if (compiled && log_ids_file_name != NULL && !write_log_formats(log_ids_file_name))
+		fprintf(stderr, "ERROR: cannot write %s\n", log_ids_file_name);
+	if (memo_profile_out_file_name != NULL && !write_memo_profile(memo_profile_out_file_name, all_nt))
+		fprintf(stderr, "ERROR: cannot write %s\n", memo_profile_out_file_name);
+
+	/* The report is printed before the slabs are released, but outside the phase */
+	if (alloc_report)
+		slab_report(stderr);
+	time_phase_begin(tp_teardown);
+	slab_release_all();
+	time_phase_end(tp_teardown);
+	if (time_report)
+	{
+		print_time_report(stderr);
+		fprintf(stderr, "included files: %d parsed, %d reused\n", nr_headers_parsed, nr_headers_reused);
+	}
 
+	if (nr_errors > 0)
+	{
+		fprintf(stderr, "%d error(s)\n", nr_errors);
+		return 1;
+	}
 	return 0;
 }
 
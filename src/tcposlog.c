@@ -0,0 +1,172 @@
+/* tcposlog -- Decoder for the deferred log of TinyCoPoOS
+
+   Usage: tcposlog <log-ids-file> <dump-file>
+
+   The log ids file is written by 'tcposc --log-ids <file>'. The dump file
+   is a memory dump of the logRing variable of the runtime, taken from a
+   target with the same byte order as the host. The arguments of float
+   conversions are stored as the bits of a float by the runtime.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef int bool;
+#define TRUE 1
+#define FALSE 0
+
+/* The layout must be equal to that of LogRing in TinyCoPoOS.c */
+
+#define LOG_MAX_ARGS 4
+#define LOG_RING_MAGIC 0x474C4354
+#define LOG_ID_WRITING 0xFFFF
+
+typedef struct
+{
+	uint16_t id;
+	uint16_t nr_args;
+	uint32_t time;
+	uint32_t args[LOG_MAX_ARGS];
+} LogEntry;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t size;
+	uint32_t head;
+} LogRingHeader;
+
+#define MAX_LOG_IDS 1000
+
+char *formats[MAX_LOG_IDS];
+
+bool read_log_ids(const char *file_name)
+{
+	FILE *f = fopen(file_name, "r");
+	if (f == NULL)
+		return FALSE;
+	char line[1000];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		int id, nr_args, n;
+		if (sscanf(line, "%d %d \"%n", &id, &nr_args, &n) != 2 || id < 0 || id >= MAX_LOG_IDS)
+			continue;
+		char *format = (char*)malloc(strlen(line) + 1);
+		char *d = format;
+		for (const char *s = line + n; *s != '\0' && *s != '"'; s++)
+		{
+			if (*s == '\\' && s[1] != '\0')
+			{
+				s++;
+				*d++ = *s == 'n' ? '\n' : *s == 'r' ? '\r' : *s == '0' ? '\0' : *s;
+			}
+			else
+				*d++ = *s;
+		}
+		*d = '\0';
+		formats[id] = format;
+	}
+	fclose(f);
+	return TRUE;
+}
+
+void print_entry(LogEntry *entry)
+{
+	printf("[%6u] ", entry->time);
+	const char *format = entry->id < MAX_LOG_IDS ? formats[entry->id] : NULL;
+	if (format == NULL)
+	{
+		printf("<unknown id %u>\n", entry->id);
+		return;
+	}
+	int arg = 0;
+	for (const char *s = format; *s != '\0'; s++)
+	{
+		if (*s != '%')
+		{
+			putchar(*s);
+			continue;
+		}
+		if (s[1] == '%')
+		{
+			putchar('%');
+			s++;
+			continue;
+		}
+		/* Copy the conversion, without length modifiers, because all arguments are 32 bits */
+		char spec[20];
+		int i = 0;
+		spec[i++] = *s++;
+		for (; *s != '\0' && strchr("diouxXcspnfFeEgGaA", *s) == NULL; s++)
+			if (*s != 'l' && *s != 'h' && i < 18)
+				spec[i++] = *s;
+		if (*s == '\0')
+			break;
+		spec[i++] = *s;
+		spec[i] = '\0';
+		uint32_t value = arg < entry->nr_args && arg < LOG_MAX_ARGS ? entry->args[arg] : 0;
+		arg++;
+		if (*s == 'd' || *s == 'i')
+			printf(spec, (int32_t)value);
+		else if (*s == 'c')
+			printf(spec, (int)value);
+		else if (*s == 'p')
+			printf("<0x%08x>", value);
+		else if (strchr("fFeEgGaA", *s) != NULL)
+		{
+			float float_value;
+			memcpy(&float_value, &value, sizeof(float_value));
+			printf(spec, (double)float_value);
+		}
+		else if (*s == 's' || *s == 'n')
+			printf("<unsupported %%%c>", *s);
+		else
+			printf(spec, value);
+	}
+	if (format[0] == '\0' || format[strlen(format) - 1] != '\n')
+		putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3)
+	{
+		printf("Usage: %s <log-ids-file> <dump-file>\n", argv[0]);
+		return 0;
+	}
+	if (!read_log_ids(argv[1]))
+	{
+		printf("Cannot open %s\n", argv[1]);
+		return 1;
+	}
+	FILE *f = fopen(argv[2], "rb");
+	if (f == NULL)
+	{
+		printf("Cannot open %s\n", argv[2]);
+		return 1;
+	}
+	LogRingHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != LOG_RING_MAGIC || header.size == 0)
+	{
+		printf("%s is not a dump of the log ring\n", argv[2]);
+		fclose(f);
+		return 1;
+	}
+	LogEntry *entries = (LogEntry*)malloc(header.size * sizeof(LogEntry));
+	size_t nr_read = fread(entries, sizeof(LogEntry), header.size, f);
+	fclose(f);
+
+	/* When the ring has wrapped around, the oldest entry is at the head */
+	uint32_t first = header.head > header.size ? header.head - header.size : 0;
+	for (uint32_t i = first; i < header.head; i++)
+	{
+		LogEntry *entry = &entries[i % header.size];
+		if (i % header.size >= nr_read || entry->id == LOG_ID_WRITING)
+			continue;
+		print_entry(entry);
+	}
+	free(entries);
+	return 0;
+}
@@ -0,0 +1,206 @@
+/* tcposprof -- Report for the sampling profiler of TinyCoPoOS
+
+   Usage: tcposprof [--folded] <symbol-file> <dump-file>
+
+   The symbol file is the output of 'nm' for the application, which is used
+   to find the names of the step functions (and of the functions containing
+   the sampled PCs). The dump file is a memory dump of the profile variable
+   of the runtime (compiled with TCPOS_PROFILE), taken from a target with
+   the same byte order as the host. Without --folded, the percentage of the
+   samples is printed for each step, else the samples are printed as folded
+   stacks (task;step;function count), as used by flame graph tools.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef int bool;
+#define TRUE 1
+#define FALSE 0
+
+/* The layout must be equal to that of Profile in TinyCoPoOS.c */
+
+#define PROFILE_MAGIC 0x46525054
+
+typedef struct
+{
+	uint32_t task;
+	uint32_t step;
+	uint32_t pc;
+	uint32_t count;
+} ProfileEntry;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t size;
+	uint32_t samples;
+	uint32_t lost;
+} ProfileHeader;
+
+typedef struct
+{
+	uint32_t address;
+	char *name;
+} Symbol;
+
+Symbol *symbols = NULL;
+int nr_symbols = 0;
+
+int compare_symbols(const void *a, const void *b)
+{
+	uint32_t address_a = ((const Symbol*)a)->address;
+	uint32_t address_b = ((const Symbol*)b)->address;
+	return address_a < address_b ? -1 : address_a > address_b ? 1 : 0;
+}
+
+bool read_symbols(const char *file_name)
+{
+	FILE *f = fopen(file_name, "r");
+	if (f == NULL)
+		return FALSE;
+	int allocated = 0;
+	char line[1000];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		unsigned long address;
+		char type;
+		char name[900];
+		if (sscanf(line, "%lx %c %899s", &address, &type, name) != 3 || strchr("TtWw", type) == NULL)
+			continue;
+		if (nr_symbols == allocated)
+		{
+			allocated = allocated == 0 ? 100 : 2 * allocated;
+			symbols = (Symbol*)realloc(symbols, allocated * sizeof(Symbol));
+		}
+		symbols[nr_symbols].address = (uint32_t)address;
+		symbols[nr_symbols].name = strdup(name);
+		nr_symbols++;
+	}
+	fclose(f);
+	qsort(symbols, nr_symbols, sizeof(Symbol), compare_symbols);
+	return TRUE;
+}
+
+/* Returns the name of the function that contains the address */
+const char *function_at(uint32_t address)
+{
+	const char *name = NULL;
+	for (int i = 0; i < nr_symbols && symbols[i].address <= address; i++)
+		name = symbols[i].name;
+	return name;
+}
+
+const char *step_name(ProfileEntry *entry, char *buffer)
+{
+	if (entry->task == 0)
+		return "idle";
+	const char *name = function_at(entry->step);
+	if (name == NULL)
+	{
+		sprintf(buffer, "task%u_0x%08x", entry->task, entry->step);
+		return buffer;
+	}
+	return name;
+}
+
+/* The step functions written by tcposc are named <task>_step<n> */
+void task_name(ProfileEntry *entry, const char *step, char *buffer)
+{
+	const char *s = strstr(step, "_step");
+	if (entry->task != 0 && s != NULL && s[5] >= '0' && s[5] <= '9')
+		sprintf(buffer, "%.*s", (int)(s - step), step);
+	else if (entry->task != 0)
+		sprintf(buffer, "task%u", entry->task);
+	else
+		strcpy(buffer, "idle");
+}
+
+int compare_counts(const void *a, const void *b)
+{
+	uint32_t count_a = ((const ProfileEntry*)a)->count;
+	uint32_t count_b = ((const ProfileEntry*)b)->count;
+	return count_a > count_b ? -1 : count_a < count_b ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	bool folded = argc == 4 && strcmp(argv[1], "--folded") == 0;
+	if (argc != 3 && !folded)
+	{
+		printf("Usage: %s [--folded] <symbol-file> <dump-file>\n", argv[0]);
+		return 0;
+	}
+	const char *symbol_file = argv[argc - 2];
+	const char *dump_file = argv[argc - 1];
+	if (!read_symbols(symbol_file))
+	{
+		printf("Cannot open %s\n", symbol_file);
+		return 1;
+	}
+	FILE *f = fopen(dump_file, "rb");
+	if (f == NULL)
+	{
+		printf("Cannot open %s\n", dump_file);
+		return 1;
+	}
+	ProfileHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != PROFILE_MAGIC || header.size == 0)
+	{
+		printf("%s is not a dump of the profile\n", dump_file);
+		fclose(f);
+		return 1;
+	}
+	ProfileEntry *entries = (ProfileEntry*)malloc(header.size * sizeof(ProfileEntry));
+	size_t nr_entries = fread(entries, sizeof(ProfileEntry), header.size, f);
+	fclose(f);
+
+	char step_buffer[40];
+	char task_buffer[1000];
+	if (folded)
+	{
+		for (size_t i = 0; i < nr_entries; i++)
+		{
+			ProfileEntry *entry = &entries[i];
+			if (entry->count == 0)
+				continue;
+			const char *step = step_name(entry, step_buffer);
+			task_name(entry, step, task_buffer);
+			printf("%s", task_buffer);
+			if (entry->task != 0)
+				printf(";%s", step);
+			const char *function = entry->pc != 0 ? function_at(entry->pc) : NULL;
+			if (function != NULL && strcmp(function, step) != 0)
+				printf(";%s", function);
+			printf(" %u\n", entry->count);
+		}
+		free(entries);
+		return 0;
+	}
+
+	/* Add the samples of the same step with different PCs */
+	size_t nr_steps = 0;
+	for (size_t i = 0; i < nr_entries; i++)
+	{
+		if (entries[i].count == 0)
+			continue;
+		size_t j = 0;
+		while (j < nr_steps && (entries[j].task != entries[i].task || entries[j].step != entries[i].step))
+			j++;
+		if (j < nr_steps)
+			entries[j].count += entries[i].count;
+		else
+			entries[nr_steps++] = entries[i];
+	}
+	qsort(entries, nr_steps, sizeof(ProfileEntry), compare_counts);
+
+	printf("%u samples, %u lost\n", header.samples, header.lost);
+	printf("  cpu%%  samples  step\n");
+	for (size_t i = 0; i < nr_steps; i++)
+		printf("%5.1f%%  %7u  %s\n", header.samples > 0 ? 100.0 * entries[i].count / header.samples : 0.0,
+			   entries[i].count, step_name(&entries[i], step_buffer));
+	free(entries);
+	return 0;
+}
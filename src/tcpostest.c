@@ -0,0 +1,21 @@
+/* tcpostest -- Tests of the runtime of TinyCoPoOS on the host
+
+   Usage: gcc -DTCPOS_HOST tcpostest.c -o tcpostest -lpthread && ./tcpostest
+
+   The runtime is included, such that the tests can use all of its tables.
+   The exit status is non-zero when a test failed.
+*/
+
+#include "TinyCoPoOS.c"
+
+/* Normally emitted by tcposc, here for the variables of ScratchTest */
+const uint32_t scratchArenaStatic = 4 + sizeof(long);
+
+int main(void)
+{
+	bool ok = RetentionTest();
+	ok = PostTest() && ok;
+	ok = ScratchTest() && ok;
+	ok = PeriodicTest() && ok;
+	return ok ? 0 : 1;
+}
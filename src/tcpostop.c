@@ -0,0 +1,199 @@
+/* tcpostop -- Live viewer for the statistics block of TinyCoPoOS
+
+   Usage: tcpostop [--once] [<dump-file>]
+
+   Without a dump file, the statistics block is read from the shared memory
+   /dev/shm/tcpos-stats of a host build of the runtime (compiled with
+   TCPOS_STATS and TCPOS_HOST), and the view is refreshed every second,
+   unless --once is given. The dump file is a memory dump of the statsBlock
+   variable of the runtime, taken from a target with the same byte order
+   as the host.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef int bool;
+#define TRUE 1
+#define FALSE 0
+
+/* The layout must be equal to that of Stats in TinyCoPoOS.c */
+
+#define STATS_MAGIC 0x54534354
+#define STATS_VERSION 1
+#define STATS_MAX_TASKS 128
+#define STATS_MAX_QUEUES 16
+#define STATS_MAX_SECTIONS 32
+#define STATS_SHM_FILE "/dev/shm/tcpos-stats"
+
+#define STATS_IDLE 0
+#define STATS_QUEUED 1
+#define STATS_WAITING 2
+#define STATS_RUNNING 3
+
+typedef struct
+{
+	uint8_t state;
+	uint8_t group;
+	uint16_t reserved;
+	uint32_t runs;
+	uint32_t max_latency;
+	uint32_t prev_max_latency;
+} TaskStats;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence;
+	uint32_t time;
+	uint32_t nr_tasks;
+	uint32_t nr_queues;
+	uint32_t nr_sections;
+	uint32_t armed_timers;
+	TaskStats tasks[STATS_MAX_TASKS];
+	uint32_t queue_depths[STATS_MAX_QUEUES];
+	uint32_t section_holders[STATS_MAX_SECTIONS];
+} Stats;
+
+/* Takes a consistent copy of a block that is being updated by the runtime:
+   the copy is retried while the sequence number is odd (an update is in
+   progress) or has changed during the copy. */
+
+bool read_live(Stats *live, Stats *copy)
+{
+	for (int attempt = 0; attempt < 1000; attempt++)
+	{
+		uint32_t sequence = __atomic_load_n(&live->sequence, __ATOMIC_ACQUIRE);
+		if (sequence % 2 == 1)
+		{
+			usleep(10);
+			continue;
+		}
+		memcpy(copy, (const void*)live, sizeof(Stats));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&live->sequence, __ATOMIC_RELAXED) == sequence)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+bool valid_block(Stats *stats)
+{
+	return    stats->magic == STATS_MAGIC && stats->version == STATS_VERSION
+	       && stats->nr_tasks <= STATS_MAX_TASKS && stats->nr_queues <= STATS_MAX_QUEUES
+	       && stats->nr_sections <= STATS_MAX_SECTIONS;
+}
+
+const char *state_name(uint8_t state)
+{
+	switch (state)
+	{
+		case STATS_IDLE: return "idle";
+		case STATS_QUEUED: return "queued";
+		case STATS_WAITING: return "waiting";
+		case STATS_RUNNING: return "running";
+	}
+	return "?";
+}
+
+void print_stats(Stats *stats)
+{
+	printf("tick %u, armed timers %u\n\n", stats->time, stats->armed_timers);
+	printf("task  state    group      runs  max lat us  prev max us\n");
+	for (uint32_t i = 1; i < stats->nr_tasks; i++)
+	{
+		TaskStats *task = &stats->tasks[i];
+		if (task->runs == 0 && task->state == STATS_IDLE)
+			continue;
+		printf("%4u  %-7s  %5u  %8u  %10u  %11u\n", i, state_name(task->state), task->group,
+			   task->runs, task->max_latency, task->prev_max_latency);
+	}
+	printf("\nqueue  depth\n");
+	for (uint32_t i = 0; i < stats->nr_queues; i++)
+		if (stats->queue_depths[i] != 0)
+			printf("%5u  %5u\n", i, stats->queue_depths[i]);
+	printf("\nsection  holder\n");
+	for (uint32_t i = 0; i < stats->nr_sections; i++)
+		if (stats->section_holders[i] != 0)
+			printf("%7u  %6u\n", i, stats->section_holders[i]);
+}
+
+int main(int argc, char *argv[])
+{
+	bool once = FALSE;
+	const char *dump_file = NULL;
+	for (int i = 1; i < argc; i++)
+		if (strcmp(argv[i], "--once") == 0)
+			once = TRUE;
+		else if (argv[i][0] != '-' && dump_file == NULL)
+			dump_file = argv[i];
+		else
+		{
+			printf("Usage: %s [--once] [<dump-file>]\n", argv[0]);
+			return 0;
+		}
+
+	Stats stats;
+	if (dump_file != NULL)
+	{
+		FILE *f = fopen(dump_file, "rb");
+		if (f == NULL)
+		{
+			printf("Cannot open %s\n", dump_file);
+			return 1;
+		}
+		size_t nr_read = fread(&stats, sizeof(stats), 1, f);
+		fclose(f);
+		if (nr_read != 1 || !valid_block(&stats))
+		{
+			printf("%s is not a dump of the statistics block\n", dump_file);
+			return 1;
+		}
+		if (stats.sequence % 2 == 1)
+			printf("Warning: the dump was taken during an update\n");
+		print_stats(&stats);
+		return 0;
+	}
+
+	int fd = open(STATS_SHM_FILE, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("Cannot open %s\n", STATS_SHM_FILE);
+		return 1;
+	}
+	Stats *live = (Stats*)mmap(NULL, sizeof(Stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (live == MAP_FAILED)
+	{
+		printf("Cannot map %s\n", STATS_SHM_FILE);
+		return 1;
+	}
+	for (;;)
+	{
+		if (!read_live(live, &stats))
+		{
+			printf("No consistent copy of the statistics block\n");
+			return 1;
+		}
+		if (!valid_block(&stats))
+		{
+			printf("%s is not a statistics block\n", STATS_SHM_FILE);
+			return 1;
+		}
+		if (!once)
+			printf("\033[H\033[2J"); /* Clear the terminal */
+		print_stats(&stats);
+		if (once)
+			break;
+		fflush(stdout);
+		sleep(1);
+	}
+	munmap(live, sizeof(Stats));
+	return 0;
+}